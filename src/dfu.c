@@ -22,15 +22,40 @@
 
 #include <stdio.h>
 #include <libusb.h>
+#include "portable.h"
 #include "dfu.h"
 
 #define INVALID_DFU_TIMEOUT -1
 
 static int dfu_timeout = INVALID_DFU_TIMEOUT;
-static unsigned short transaction = 0;
+/* wBlockNum of the next DFU_DNLOAD or DFU_UPLOAD request */
+static unsigned int transaction = 0;
 
 static int dfu_debug_level = 0;
 
+/* Requests repeated after transient errors, for the statistics */
+unsigned int dfu_retry_count = 0;
+
+/* The block number is only 16 bits wide. On images of more than 65536
+ * blocks it wraps around from 0xffff to 0, as DFU 1.1 specifies. */
+static unsigned short dfu_next_block( void )
+{
+    unsigned short block = transaction;
+
+    transaction = (transaction + 1) & 0xffff;
+    if( 0 == transaction && 0 != dfu_debug_level )
+        fprintf( stderr, "dfu: block number wraps around to 0\n" );
+
+    return block;
+}
+
+/* Starts the next DFU_DNLOAD or DFU_UPLOAD sequence at block number 0,
+ * devices may work out the offset in the image from it */
+void dfu_reset_block( void )
+{
+    transaction = 0;
+}
+
 void dfu_init( const int timeout )
 {
     if( timeout > 0 ) {
@@ -129,7 +154,7 @@ int dfu_download( libusb_device_handle *device,
     status = libusb_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
-          /* wValue        */ transaction++,
+          /* wValue        */ dfu_next_block(),
           /* wIndex        */ interface,
           /* Data          */ data,
           /* wLength       */ length,
@@ -177,7 +202,7 @@ int dfu_upload( libusb_device_handle *device,
     status = libusb_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
-          /* wValue        */ transaction++,
+          /* wValue        */ dfu_next_block(),
           /* wIndex        */ interface,
           /* Data          */ data,
           /* wLength       */ length,
@@ -207,6 +232,7 @@ int dfu_get_status( libusb_device_handle *device,
 {
     unsigned char buffer[6];
     int result;
+    int tries;
 
     if( 0 != dfu_verify_init(__FUNCTION__) )
         return -1;
@@ -217,14 +243,22 @@ int dfu_get_status( libusb_device_handle *device,
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
 
-    result = libusb_control_transfer( device,
-          /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_GETSTATUS,
-          /* wValue        */ 0,
-          /* wIndex        */ interface,
-          /* Data          */ buffer,
-          /* wLength       */ 6,
-                              dfu_timeout );
+    /* Asking for the status again is harmless, at most the device
+     * has advanced its state by handling the lost request */
+    for( tries = 0; ; tries++ ) {
+        result = libusb_control_transfer( device,
+              /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+              /* bRequest      */ DFU_GETSTATUS,
+              /* wValue        */ 0,
+              /* wIndex        */ interface,
+              /* Data          */ buffer,
+              /* wLength       */ 6,
+                                  dfu_timeout );
+        if( result >= 0 || tries >= DFU_RETRIES ||
+            !dfu_transient_error(result) )
+            break;
+        dfu_retry_count++;
+    }
 
     if( 6 == result ) {
         status->bStatus = buffer[0];
@@ -329,6 +363,67 @@ int dfu_abort( libusb_device_handle *device,
 }
 
 
+/*
+ *  Tells whether a request that failed with the libusb error code
+ *  is worth repeating, as opposed to e.g. a disconnected device
+ */
+int dfu_transient_error( int error )
+{
+    return error == LIBUSB_ERROR_TIMEOUT ||
+           error == LIBUSB_ERROR_PIPE ||
+           error == LIBUSB_ERROR_IO ||
+           error == LIBUSB_ERROR_INTERRUPTED ||
+           error == LIBUSB_ERROR_OVERFLOW;
+}
+
+
+/*
+ *  Brings the device back to dfuIDLE after a failed request, by clearing
+ *  an error status, waiting for a busy device and aborting any pending
+ *  download or upload
+ *
+ *  device    - the usb_dev_handle to communicate with
+ *  interface - the interface to communicate with
+ *
+ *  returns 0 or < 0 on an error
+ */
+int dfu_resync( libusb_device_handle *device,
+                const unsigned short interface )
+{
+    struct dfu_status status;
+    int tries;
+    int result = -1;
+
+    for( tries = 0; tries < 4 * DFU_RETRIES; tries++ ) {
+        result = dfu_get_status( device, interface, &status );
+        if( result < 0 )
+            return result;
+
+        switch( status.bState ) {
+            case STATE_DFU_IDLE:
+                return 0;
+            case STATE_DFU_ERROR:
+                result = dfu_clear_status( device, interface );
+                break;
+            case STATE_DFU_DOWNLOAD_BUSY:
+            case STATE_DFU_MANIFEST:
+                milli_sleep( status.bwPollTimeout );
+                break;
+            default:
+                result = dfu_abort( device, interface );
+                break;
+        }
+        if( result < 0 && !dfu_transient_error(result) )
+            return result;
+    }
+
+    if( 0 != dfu_debug_level )
+        fprintf( stderr, "%s: device did not return to dfuIDLE\n",
+                 __FUNCTION__ );
+    return -1;
+}
+
+
 const char* dfu_state_to_string( int state )
 {
     const char *message = NULL;
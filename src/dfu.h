@@ -67,6 +67,7 @@
 
 /* DFU interface */
 #define DFU_IFF_DFU             0x0001  /* DFU Mode, (not Runtime) */
+#define DFU_IFF_GONE            0x0002  /* Reset, detached or left DFU mode */
 #define DFU_IFF_VENDOR          0x0100
 #define DFU_IFF_PRODUCT         0x0200
 #define DFU_IFF_CONFIG          0x0400
@@ -103,12 +104,19 @@ struct dfu_if {
     const char *path;
     unsigned int flags;
     unsigned int count;
+    uint8_t bmAttributes;       /* of the DFU functional descriptor */
     libusb_device *dev;
     libusb_device_handle *dev_handle;
 };
 
+/* Times a request is repeated after a transient error */
+#define DFU_RETRIES 3
+
+extern unsigned int dfu_retry_count;
+
 void dfu_init( const int timeout );
 void dfu_debug( const int level );
+void dfu_reset_block( void );
 int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout );
@@ -129,6 +137,9 @@ int dfu_get_state( libusb_device_handle *device,
                    const unsigned short interface );
 int dfu_abort( libusb_device_handle *device,
                const unsigned short interface );
+int dfu_transient_error( int error );
+int dfu_resync( libusb_device_handle *device,
+                const unsigned short interface );
 
 const char *dfu_state_to_string( int state );
 
@@ -1,5 +1,6 @@
 /*
  * Checks for, parses and generates a DFU suffix
+ * Loads Intel HEX, S-record and ELF images into sparse element lists
  *
  * (C) 2011 Tormod Volden <debian.tormod@gmail.com>
  * (C) 2012 Stefan Schmidt <stefan@datenfreihafen.org>
@@ -21,13 +22,30 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+
+#include "portable.h"
+#ifdef HAVE_MKSTEMP
+# include <unistd.h>
+# include <sys/stat.h>
+#endif
 
 #include "dfu_file.h"
 
-#define DFU_SUFFIX_LENGTH 16
+/* ELF definitions, only what is needed to find loadable segments */
+#define EI_NIDENT	16
+#define EI_CLASS	4
+#define EI_DATA		5
+#define ELFCLASS32	1
+#define ELFDATA2LSB	1
+#define ELFDATA2MSB	2
+#define ELF32_EHDR_SIZE	52
+#define ELF32_PHDR_SIZE	32
+#define PT_LOAD		1
 
 unsigned long crc32_table[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -79,6 +97,123 @@ uint32_t crc32_byte(uint32_t accum, uint8_t delta)
         return crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
 }
 
+uint32_t crc32_buf(uint32_t accum, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		accum = crc32_table[(accum ^ *buf++) & 0xff] ^ (accum >> 8);
+	return accum;
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Given the CRC register crc1 after a first block of data, and crc2
+ * computed over a second block of len2 bytes starting from a zero
+ * register, returns the register after both blocks. This allows
+ * computing the CRC of slices independently, as zlib's crc32_combine */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, off_t len2)
+{
+	uint32_t even[32];	/* even-power-of-two zeros operator */
+	uint32_t odd[32];	/* odd-power-of-two zeros operator */
+	uint32_t row;
+	int n;
+
+	if (len2 <= 0)
+		return crc1;
+
+	/* put operator for one zero bit in odd */
+	odd[0] = 0xedb88320;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* apply len2 zeros to crc1, first square will put the operator
+	 * for one zero byte, eight zero bits, in even */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (!len2)
+			break;
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+/* Fills in the first 12 bytes of a DFU suffix, all but the CRC */
+void fill_dfu_suffix(struct dfu_file *file, unsigned char *dfusuffix)
+{
+	dfusuffix[0] = file->bcdDevice & 0xff;
+	dfusuffix[1] = file->bcdDevice >> 8;
+	dfusuffix[2] = file->idProduct & 0xff;
+	dfusuffix[3] = file->idProduct >> 8;
+	dfusuffix[4] = file->idVendor & 0xff;
+	dfusuffix[5] = file->idVendor >> 8;
+	dfusuffix[6] = file->bcdDFU & 0xff;
+	dfusuffix[7] = file->bcdDFU >> 8;
+	dfusuffix[8] = 'U';
+	dfusuffix[9] = 'F';
+	dfusuffix[10] = 'D';
+	dfusuffix[11] = file->suffixlen;
+}
+
+/* Computes the CRC over len bytes from the current file position,
+ * reading through a buffer of fixed size.
+ * returns 0 on success, negative on file read error */
+int crc32_file(struct dfu_file *file, off_t len, uint32_t *crc)
+{
+	unsigned char *buf;
+	int ret = 0;
+
+	buf = malloc(DFU_FILE_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate file buffer\n");
+		return -ENOMEM;
+	}
+	while (len > 0) {
+		size_t chunk = len < DFU_FILE_BUFSIZE ? len : DFU_FILE_BUFSIZE;
+
+		if (fread(buf, 1, chunk, file->filep) < chunk) {
+			fprintf(stderr, "Could not read whole file\n");
+			if (ferror(file->filep))
+				perror(file->name);
+			ret = -EIO;
+			break;
+		}
+		*crc = crc32_buf(*crc, buf, chunk);
+		len -= chunk;
+	}
+	free(buf);
+	return ret;
+}
+
 /* reads the filep and name member, fills in all others
    returns 0 if no DFU suffix
    returns positive if valid DFU suffix
@@ -86,11 +221,9 @@ uint32_t crc32_byte(uint32_t accum, uint8_t delta)
 int parse_dfu_suffix(struct dfu_file *file)
 {
 	int ret;
-	int i;
 	uint32_t crc = 0xffffffff;
 	/* supported suffices are at least 16 bytes */
 	unsigned char dfusuffix[DFU_SUFFIX_LENGTH];
-	unsigned char *firmware = NULL;
 
 	file->size = 0;
 	/* default values, if no valid suffix is found */
@@ -101,40 +234,18 @@ int parse_dfu_suffix(struct dfu_file *file)
 	file->idProduct = 0xffff; /* wildcard value */
 	file->bcdDevice = 0xffff; /* wildcard value */
 
-	fseek(file->filep, 0, SEEK_END);
-	file->size = ftell(file->filep);
+	fseeko(file->filep, 0, SEEK_END);
+	file->size = ftello(file->filep);
 	rewind(file->filep);
 
-	if (file->size < sizeof(dfusuffix)) {
+	if (file->size < (off_t) sizeof(dfusuffix)) {
 		fprintf(stderr, "File too short for DFU suffix\n");
 		return 0;
 	}
 
-	firmware = (unsigned char*) malloc(file->size);
-	if (!firmware) {
-		fprintf(stderr, "Unable to allocate file buffer for firmware.\n");
-		exit(1);
-	}
-
-	ret = fread(firmware, 1, file->size, file->filep);
-	if (ret < 0) {
-		fprintf(stderr, "Could not read file\n");
-		perror(file->name);
-		free(firmware);
-		return ret;
-	} else if (ret < file->size) {
-		fprintf(stderr, "Could not read whole file\n");
-		free(firmware);
-		ret = -EIO;
-		goto out_rewind;
-	}
-
-	for (i = 0; i < file->size - 4; i++)
-		crc = crc32_byte(crc, firmware[i]);
-
-	free(firmware);
-
-	ret = fseek(file->filep, -sizeof(dfusuffix), SEEK_END);
+	/* Look at the signature first, so that files without a suffix
+	 * are not read through for nothing */
+	ret = fseeko(file->filep, -(off_t) sizeof(dfusuffix), SEEK_END);
 	if (ret < 0) {
 		fprintf(stderr, "Could not seek to DFU suffix\n");
 		perror(file->name);
@@ -165,6 +276,12 @@ int parse_dfu_suffix(struct dfu_file *file)
 		      (dfusuffix[13] << 8) +
 		       dfusuffix[12];
 
+	rewind(file->filep);
+	ret = crc32_file(file, file->size - 4, &crc);
+	if (ret < 0)
+		goto out_rewind;
+	ret = sizeof(dfusuffix);
+
 	if (file->dwCRC != crc) {
 		fprintf(stderr, "DFU CRC does not match\n");
 		ret = 0;
@@ -191,87 +308,589 @@ out_rewind:
 	return ret;
 }
 
-/* reads file, generates CRC and adds DFU suffix to file
+/* appends a DFU suffix with the bcdDFU version set in file, given the
+   CRC over the file contents
    returns positive on success
    returns negative on errors */
-
-int generate_dfu_suffix(struct dfu_file *file)
+int write_dfu_suffix(struct dfu_file *file, uint32_t crc)
 {
 	int ret;
-	int i;
 	unsigned char dfusuffix[DFU_SUFFIX_LENGTH];
-	unsigned char *firmware = NULL;
 
-	file->size = 0;
-	file->dwCRC = 0xffffffff;
 	file->suffixlen = DFU_SUFFIX_LENGTH;
+	fill_dfu_suffix(file, dfusuffix);
+
+	/* The CRC also covers the suffix excluding the CRC itself */
+	file->dwCRC = crc32_buf(crc, dfusuffix, DFU_SUFFIX_LENGTH - 4);
+
+	dfusuffix[12] = file->dwCRC;
+	dfusuffix[13] = file->dwCRC >> 8;
+	dfusuffix[14] = file->dwCRC >> 16;
+	dfusuffix[15] = file->dwCRC >> 24;
+
+	/* Add the suffix at the end of the file, this also syncs
+	 * read/write streams (see fopen(3) man page) */
+	fseeko(file->filep, 0, SEEK_END);
+
+	ret = fwrite(dfusuffix, 1, sizeof(dfusuffix), file->filep);
+	if (ret < 0) {
+		fprintf(stderr, "Could not write DFU suffix\n");
+		perror(file->name);
+	} else if (ret < sizeof(dfusuffix)) {
+		fprintf(stderr, "Could not write whole DFU suffix\n");
+		ret = -EIO;
+	}
+
+	rewind(file->filep);
+	return ret;
+}
+
+/* appends a DFU 1.0 suffix to the file, given the CRC over the file contents
+   returns positive on success
+   returns negative on errors */
+int append_dfu_suffix(struct dfu_file *file, uint32_t crc)
+{
 	file->bcdDFU = 0x0100; /* Default to bcdDFU version 1.0 */
+	return write_dfu_suffix(file, crc);
+}
 
-	dfusuffix[0] = file->bcdDevice & 0xff;
-	dfusuffix[1] = file->bcdDevice >> 8;
-	dfusuffix[2] = file->idProduct & 0xff;
-	dfusuffix[3] = file->idProduct >> 8;
-	dfusuffix[4] = file->idVendor & 0xff;
-	dfusuffix[5] = file->idVendor >> 8;
-	dfusuffix[6] = file->bcdDFU & 0xff;
-	dfusuffix[7] = file->bcdDFU >> 8;
-	dfusuffix[8] = 'U';
-	dfusuffix[9] = 'F';
-	dfusuffix[10] = 'D';
-	dfusuffix[11] = file->suffixlen;
+/* reads file, generates CRC and adds DFU suffix to file
+   returns positive on success
+   returns negative on errors */
+
+int generate_dfu_suffix(struct dfu_file *file)
+{
+	int ret;
+	uint32_t crc = 0xffffffff;
 
-	fseek(file->filep, 0, SEEK_END);
-	file->size = ftell(file->filep);
+	fseeko(file->filep, 0, SEEK_END);
+	file->size = ftello(file->filep);
 	rewind(file->filep);
 
-	/* Make space for all but CRC */
-	firmware = (unsigned char*) malloc(file->size + file->suffixlen - 4);
-	if (!firmware) {
-		fprintf(stderr, "Unable to allocate file buffer for firmware.\n");
-		exit(1);
+	ret = crc32_file(file, file->size, &crc);
+	if (ret < 0)
+		return ret;
+
+	return append_dfu_suffix(file, crc);
+}
+
+/* Creates a temporary file next to the given file, to be moved over it
+ * with replace_file() once complete. file->filep may be NULL if the file
+ * is not open or does not exist yet. Returns NULL on failure. */
+FILE *open_temp_file(struct dfu_file *file, char **tmpname)
+{
+	FILE *filep;
+	size_t len = strlen(file->name) + 8;
+
+	*tmpname = malloc(len);
+	if (!*tmpname) {
+		fprintf(stderr, "Unable to allocate file name\n");
+		return NULL;
 	}
+#ifdef HAVE_MKSTEMP
+	{
+		int fd;
+
+		struct stat st;
+
+		snprintf(*tmpname, len, "%s.XXXXXX", file->name);
+		fd = mkstemp(*tmpname);
+		/* mkstemp creates the file with mode 0600, keep the original */
+		if (fd >= 0 && file->filep &&
+		    !fstat(fileno(file->filep), &st))
+			fchmod(fd, st.st_mode & 07777);
+		filep = fd < 0 ? NULL : fdopen(fd, "wb");
+	}
+#else
+	snprintf(*tmpname, len, "%s.tmp", file->name);
+	filep = fopen(*tmpname, "wb");
+#endif /* HAVE_MKSTEMP */
+	if (!filep) {
+		perror(*tmpname);
+		free(*tmpname);
+		*tmpname = NULL;
+	}
+	return filep;
+}
 
-	ret = fread(firmware, 1, file->size, file->filep);
+/* Atomically replaces file with the completed temporary file, and
+ * reopens file->filep on the new contents if it was open.
+ * returns 0 on success, negative on errors */
+int replace_file(struct dfu_file *file, FILE *tmp, char *tmpname)
+{
+	int reopen = file->filep != NULL;
+	int ret = 0;
+
+	if (fflush(tmp) || ferror(tmp)) {
+		fprintf(stderr, "Could not write %s\n", tmpname);
+		ret = -EIO;
+	}
+	if (fclose(tmp))
+		ret = -EIO;
 	if (ret < 0) {
-		fprintf(stderr, "Could not read file\n");
-		perror(file->name);
-		free(firmware);
+		remove(tmpname);
+		free(tmpname);
+		return ret;
+	}
+
+	if (reopen)
+		fclose(file->filep);
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	remove(file->name);
+#endif
+	if (rename(tmpname, file->name) < 0) {
+		fprintf(stderr, "Could not replace %s\n", file->name);
+		perror(tmpname);
+		remove(tmpname);
+		ret = -EIO;
+	}
+	free(tmpname);
+	if (!reopen)
 		return ret;
-	} else if (ret < file->size) {
-		fprintf(stderr, "Could not read whole file\n");
-		free(firmware);
+
+	file->filep = fopen(file->name, "r+b");
+	if (!file->filep) {
+		perror(file->name);
+		exit(1);
+	}
+	return ret;
+}
+
+/* Peeks at the start of the file to find out how its contents
+ * should be interpreted. Rewinds the file. */
+enum dfu_file_format detect_file_format(struct dfu_file *file)
+{
+	unsigned char magic[4];
+	enum dfu_file_format format = DFU_FORMAT_RAW;
+	int ret;
+
+	rewind(file->filep);
+	ret = fread(magic, 1, sizeof(magic), file->filep);
+	rewind(file->filep);
+	if (ret < sizeof(magic) ||
+	    file->size - file->suffixlen < (off_t) sizeof(magic))
+		return DFU_FORMAT_RAW;
+
+	if (magic[0] == 0x7f && magic[1] == 'E' && magic[2] == 'L' &&
+	    magic[3] == 'F')
+		format = DFU_FORMAT_ELF;
+	else if (magic[0] == ':' && isxdigit(magic[1]) && isxdigit(magic[2]))
+		format = DFU_FORMAT_IHEX;
+	else if (magic[0] == 'S' && magic[1] >= '0' && magic[1] <= '9' &&
+		 isxdigit(magic[2]))
+		format = DFU_FORMAT_SREC;
+	else if (!memcmp(magic, "DfuP", 4))
+		format = DFU_FORMAT_PLAN;
+
+	return format;
+}
+
+const char *file_format_to_string(enum dfu_file_format format)
+{
+	switch (format) {
+	case DFU_FORMAT_IHEX:
+		return "Intel HEX";
+	case DFU_FORMAT_SREC:
+		return "Motorola S-record";
+	case DFU_FORMAT_ELF:
+		return "ELF";
+	case DFU_FORMAT_DFUSE:
+		return "DfuSe";
+	case DFU_FORMAT_PLAN:
+		return "compiled plan";
+	default:
+		return "raw binary";
+	}
+}
+
+void free_element_list(struct dfu_element *list)
+{
+	struct dfu_element *next;
+
+	while (list) {
+		next = list->next;
+		free(list->data);
+		free(list);
+		list = next;
+	}
+}
+
+/* State while collecting data records into a list of elements */
+struct element_builder {
+	struct dfu_element *head;
+	struct dfu_element **tail;
+	struct dfu_element *cur;
+	uint32_t capacity;
+};
+
+/* Adds data at a given address, extending the current element if the
+ * data directly follows it, otherwise starting a new element.
+ * returns 0 on success, -ENOMEM on allocation failure */
+static int element_add_data(struct element_builder *b, uint32_t address,
+			    const unsigned char *data, uint32_t len)
+{
+	struct dfu_element *el = b->cur;
+
+	if (!len)
+		return 0;
+
+	if (!el || el->address + el->size != address) {
+		el = malloc(sizeof(*el));
+		if (!el)
+			return -ENOMEM;
+		el->address = address;
+		el->size = 0;
+		el->data = NULL;
+		el->next = NULL;
+		*b->tail = el;
+		b->tail = &el->next;
+		b->cur = el;
+		b->capacity = 0;
+	}
+
+	if (el->size + len > b->capacity) {
+		unsigned char *data_new;
+		uint32_t capacity = b->capacity ? b->capacity : 256;
+
+		while (capacity < el->size + len)
+			capacity *= 2;
+		data_new = realloc(el->data, capacity);
+		if (!data_new)
+			return -ENOMEM;
+		el->data = data_new;
+		b->capacity = capacity;
+	}
+	memcpy(el->data + el->size, data, len);
+	el->size += len;
+	return 0;
+}
+
+static int hex_byte(const char *p)
+{
+	int hi, lo;
+
+	if (!isxdigit(p[0]) || !isxdigit(p[1]))
+		return -1;
+	hi = isdigit(p[0]) ? p[0] - '0' : (toupper(p[0]) - 'A' + 10);
+	lo = isdigit(p[1]) ? p[1] - '0' : (toupper(p[1]) - 'A' + 10);
+	return (hi << 4) | lo;
+}
+
+/* Decodes the hex digits of one record into bytes, returns the number of
+ * bytes or -EINVAL on malformed input */
+static int decode_record(const char *line, int len, unsigned char *out,
+			 int out_size)
+{
+	int i;
+	int n = 0;
+
+	if (len % 2)
+		return -EINVAL;
+	for (i = 0; i < len; i += 2) {
+		int byte = hex_byte(line + i);
+
+		if (byte < 0 || n >= out_size)
+			return -EINVAL;
+		out[n++] = byte;
+	}
+	return n;
+}
+
+/* Intel HEX, as per the Intel Hexadecimal Object File Format
+ * Specification Rev. A. Supports extended segment and linear addresses. */
+static int parse_ihex(struct dfu_file *file, char *text, long len,
+		      struct element_builder *b)
+{
+	unsigned char rec[260];
+	uint32_t base = 0;
+	int lineno = 0;
+	long pos = 0;
+
+	while (pos < len) {
+		char *line = text + pos;
+		int linelen = 0;
+		int n, i;
+		uint8_t sum = 0;
+		uint8_t count, type;
+		uint16_t offset;
+
+		while (pos + linelen < len && line[linelen] != '\n' &&
+		       line[linelen] != '\r')
+			linelen++;
+		pos += linelen;
+		while (pos < len && (text[pos] == '\n' || text[pos] == '\r'))
+			pos++;
+		lineno++;
+		if (!linelen)
+			continue;
+
+		if (line[0] != ':')
+			goto bad_record;
+		n = decode_record(line + 1, linelen - 1, rec, sizeof(rec));
+		if (n < 5 || n != rec[0] + 5)
+			goto bad_record;
+		for (i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum) {
+			fprintf(stderr, "%s:%i: Checksum error\n",
+				file->name, lineno);
+			return -EINVAL;
+		}
+
+		count = rec[0];
+		offset = (rec[1] << 8) | rec[2];
+		type = rec[3];
+		switch (type) {
+		case 0x00: /* data */
+			if (element_add_data(b, base + offset, rec + 4, count))
+				return -ENOMEM;
+			break;
+		case 0x01: /* end of file */
+			return 0;
+		case 0x02: /* extended segment address */
+			if (count != 2)
+				goto bad_record;
+			base = ((rec[4] << 8) | rec[5]) << 4;
+			break;
+		case 0x04: /* extended linear address */
+			if (count != 2)
+				goto bad_record;
+			base = (uint32_t) ((rec[4] << 8) | rec[5]) << 16;
+			break;
+		case 0x03: /* start segment address */
+		case 0x05: /* start linear address */
+			break;
+		default:
+			fprintf(stderr, "%s:%i: Unsupported record type %i\n",
+				file->name, lineno, type);
+			return -EINVAL;
+		}
+	}
+	fprintf(stderr, "Warning: %s has no end of file record\n",
+		file->name);
+	return 0;
+
+ bad_record:
+	fprintf(stderr, "%s:%i: Invalid Intel HEX record\n", file->name,
+		lineno);
+	return -EINVAL;
+}
+
+/* Motorola S-records (S19, S28, S37) */
+static int parse_srec(struct dfu_file *file, char *text, long len,
+		      struct element_builder *b)
+{
+	unsigned char rec[260];
+	int lineno = 0;
+	long pos = 0;
+
+	while (pos < len) {
+		char *line = text + pos;
+		int linelen = 0;
+		int n, i;
+		int addrlen;
+		uint8_t sum = 0;
+		uint32_t address;
+
+		while (pos + linelen < len && line[linelen] != '\n' &&
+		       line[linelen] != '\r')
+			linelen++;
+		pos += linelen;
+		while (pos < len && (text[pos] == '\n' || text[pos] == '\r'))
+			pos++;
+		lineno++;
+		if (!linelen)
+			continue;
+
+		if (linelen < 4 || line[0] != 'S')
+			goto bad_record;
+		n = decode_record(line + 2, linelen - 2, rec, sizeof(rec));
+		if (n < 1 || n != rec[0] + 1)
+			goto bad_record;
+		for (i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum != 0xff) {
+			fprintf(stderr, "%s:%i: Checksum error\n",
+				file->name, lineno);
+			return -EINVAL;
+		}
+
+		switch (line[1]) {
+		case '1':
+			addrlen = 2;
+			break;
+		case '2':
+			addrlen = 3;
+			break;
+		case '3':
+			addrlen = 4;
+			break;
+		case '7':
+		case '8':
+		case '9':
+			/* termination record */
+			return 0;
+		case '0': /* header */
+		case '5': /* record count */
+		case '6':
+			continue;
+		default:
+			goto bad_record;
+		}
+		if (n < addrlen + 2)
+			goto bad_record;
+		address = 0;
+		for (i = 0; i < addrlen; i++)
+			address = (address << 8) | rec[1 + i];
+		if (element_add_data(b, address, rec + 1 + addrlen,
+				     n - addrlen - 2))
+			return -ENOMEM;
+	}
+	return 0;
+
+ bad_record:
+	fprintf(stderr, "%s:%i: Invalid S-record\n", file->name, lineno);
+	return -EINVAL;
+}
+
+static uint32_t elf_get(const unsigned char *p, int size, int msb)
+{
+	uint32_t val = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		val |= (uint32_t) p[msb ? size - 1 - i : i] << (8 * i);
+	return val;
+}
+
+/* ELF32 executables: every PT_LOAD program header with file contents
+ * becomes an element at its physical (load) address */
+static int parse_elf(struct dfu_file *file, struct element_builder *b)
+{
+	unsigned char ehdr[ELF32_EHDR_SIZE];
+	unsigned char phdr[ELF32_PHDR_SIZE];
+	uint32_t phoff;
+	int phentsize, phnum;
+	int msb;
+	int i;
+
+	if (fread(ehdr, 1, sizeof(ehdr), file->filep) < sizeof(ehdr)) {
+		fprintf(stderr, "Could not read ELF header\n");
 		return -EIO;
 	}
+	if (ehdr[EI_CLASS] != ELFCLASS32) {
+		fprintf(stderr, "Only 32-bit ELF files are supported\n");
+		return -EINVAL;
+	}
+	if (ehdr[EI_DATA] != ELFDATA2LSB && ehdr[EI_DATA] != ELFDATA2MSB) {
+		fprintf(stderr, "Unknown ELF data encoding\n");
+		return -EINVAL;
+	}
+	msb = ehdr[EI_DATA] == ELFDATA2MSB;
+	phoff = elf_get(ehdr + 28, 4, msb);
+	phentsize = elf_get(ehdr + 42, 2, msb);
+	phnum = elf_get(ehdr + 44, 2, msb);
+	if (phnum && phentsize < ELF32_PHDR_SIZE) {
+		fprintf(stderr, "Invalid ELF program header size\n");
+		return -EINVAL;
+	}
 
-	/* Copy parts of the suffix for CRC calculation */
-	for(i = 0; i < 12; i++)
-		firmware[file->size + i] = dfusuffix[i];
+	for (i = 0; i < phnum; i++) {
+		uint32_t offset, paddr, filesz;
+		unsigned char *data;
+		int ret;
+
+		if (fseek(file->filep, phoff + i * phentsize, SEEK_SET) ||
+		    fread(phdr, 1, sizeof(phdr), file->filep) < sizeof(phdr)) {
+			fprintf(stderr, "Could not read ELF program header\n");
+			return -EIO;
+		}
+		if (elf_get(phdr, 4, msb) != PT_LOAD)
+			continue;
+		offset = elf_get(phdr + 4, 4, msb);
+		paddr = elf_get(phdr + 12, 4, msb);
+		filesz = elf_get(phdr + 16, 4, msb);
+		if (!filesz)
+			continue;
+		if ((off_t) offset + filesz > file->size - file->suffixlen) {
+			fprintf(stderr, "ELF segment %i exceeds file\n", i);
+			return -EINVAL;
+		}
+
+		data = malloc(filesz);
+		if (!data)
+			return -ENOMEM;
+		if (fseek(file->filep, offset, SEEK_SET) ||
+		    fread(data, 1, filesz, file->filep) < filesz) {
+			fprintf(stderr, "Could not read ELF segment %i\n", i);
+			free(data);
+			return -EIO;
+		}
+		/* Each segment stands on its own, never merge on load */
+		b->cur = NULL;
+		ret = element_add_data(b, paddr, data, filesz);
+		free(data);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
 
-	/* Calculate CRC. It is calculated over file and suffix excluding the CRC
-	 * itself */
-	for (i = 0; i < file->size + file->suffixlen - 4; i++)
-		file->dwCRC = crc32_byte(file->dwCRC, firmware[i]);
+/* Reads an Intel HEX, S-record or ELF file into a list of elements,
+ * leaving out everything between the data records.
+ * returns the number of elements, or negative on error */
+int load_sparse_image(struct dfu_file *file, enum dfu_file_format format,
+		      struct dfu_element **list)
+{
+	struct element_builder b;
+	struct dfu_element *el;
+	off_t len = file->size - file->suffixlen;
+	char *text = NULL;
+	int count = 0;
+	int ret;
 
-	free(firmware);
+	/* text formats are read into memory as a whole */
+	if (format != DFU_FORMAT_ELF && len > LONG_MAX) {
+		fprintf(stderr, "%s is too large to load\n", file->name);
+		return -EFBIG;
+	}
 
-	dfusuffix[12] = file->dwCRC;
-	dfusuffix[13] = file->dwCRC >> 8;
-	dfusuffix[14] = file->dwCRC >> 16;
-	dfusuffix[15] = file->dwCRC >> 24;
+	b.head = NULL;
+	b.tail = &b.head;
+	b.cur = NULL;
+	b.capacity = 0;
 
-	/* sync read/write streams (see fopen(3) man page) */
-	fseek(file->filep, 0L, SEEK_CUR);
+	rewind(file->filep);
+	if (format == DFU_FORMAT_ELF) {
+		ret = parse_elf(file, &b);
+	} else {
+		text = malloc(len);
+		if (!text) {
+			fprintf(stderr, "Unable to allocate file buffer\n");
+			return -ENOMEM;
+		}
+		if (fread(text, 1, len, file->filep) < len) {
+			fprintf(stderr, "Could not read whole file\n");
+			ret = -EIO;
+		} else if (format == DFU_FORMAT_IHEX) {
+			ret = parse_ihex(file, text, len, &b);
+		} else if (format == DFU_FORMAT_SREC) {
+			ret = parse_srec(file, text, len, &b);
+		} else {
+			ret = -EINVAL;
+		}
+		free(text);
+	}
+	rewind(file->filep);
 
-	/* Add the suffix at the end of the file */
-	ret = fwrite(dfusuffix, 1, sizeof(dfusuffix), file->filep);
 	if (ret < 0) {
-		fprintf(stderr, "Could not write DFU suffix\n");
-		perror(file->name);
-	} else if (ret < sizeof(dfusuffix)) {
-		fprintf(stderr, "Could not write whole DFU suffix\n");
-		ret = -EIO;
+		free_element_list(b.head);
+		return ret;
 	}
 
-	rewind(file->filep);
-	return ret;
+	for (el = b.head; el; el = el->next)
+		count++;
+	*list = b.head;
+	return count;
 }
@@ -4,11 +4,12 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 struct dfu_file {
     const char *name;
     FILE *filep;
-    long size;
+    off_t size;
     /* From DFU suffix fields */
     uint32_t dwCRC;
     unsigned char suffixlen;
@@ -16,9 +17,52 @@ struct dfu_file {
     uint16_t idVendor;
     uint16_t idProduct;
     uint16_t bcdDevice;
+    /* Set while reading a stream of unknown length, see stream.h */
+    struct stream *stream;
+    /* Set while writing an upload to a pipe or compressor, see sink.c */
+    struct sink *sink;
 };
 
+/* Contiguous block of image data to be written at a memory address */
+struct dfu_element {
+    uint32_t address;
+    uint32_t size;
+    unsigned char *data;
+    struct dfu_element *next;
+};
+
+enum dfu_file_format {
+    DFU_FORMAT_RAW,
+    DFU_FORMAT_IHEX,
+    DFU_FORMAT_SREC,
+    DFU_FORMAT_ELF,
+    DFU_FORMAT_DFUSE,
+    DFU_FORMAT_PLAN
+};
+
+#define DFU_SUFFIX_LENGTH 16
+
+/* Size of the buffer used for streaming through files */
+#define DFU_FILE_BUFSIZE 65536
+
+uint32_t crc32_byte(uint32_t accum, uint8_t delta);
+uint32_t crc32_buf(uint32_t accum, const unsigned char *buf, size_t len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, off_t len2);
+
+void fill_dfu_suffix(struct dfu_file *file, unsigned char *dfusuffix);
+int crc32_file(struct dfu_file *file, off_t len, uint32_t *crc);
 int parse_dfu_suffix(struct dfu_file *file);
+int write_dfu_suffix(struct dfu_file *file, uint32_t crc);
+int append_dfu_suffix(struct dfu_file *file, uint32_t crc);
 int generate_dfu_suffix(struct dfu_file *file);
 
+FILE *open_temp_file(struct dfu_file *file, char **tmpname);
+int replace_file(struct dfu_file *file, FILE *tmp, char *tmpname);
+
+enum dfu_file_format detect_file_format(struct dfu_file *file);
+const char *file_format_to_string(enum dfu_file_format format);
+int load_sparse_image(struct dfu_file *file, enum dfu_file_format format,
+		      struct dfu_element **list);
+void free_element_list(struct dfu_element *list);
+
 #endif /* DFU_FILE_H */
@@ -32,123 +32,364 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
-#include "quirks.h"
+#include "plan.h"
+#include "poll_history.h"
+#include "progress.h"
+#include "sink.h"
+#include "stream.h"
+#include "xfer_pool.h"
 
 extern int verbose;
+extern int verify;
+extern int plan;
 
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file)
 {
-	int total_bytes = 0;
+	off_t total_bytes = 0;
 	unsigned char *buf;
 	int ret;
 
-	buf = malloc(xfer_size);
+	buf = xfer_buf_alloc(xfer_size);
 	if (!buf)
 		return -ENOMEM;
 
-	printf("bytes_per_hash=%u\n", xfer_size);
 	printf("Copying data from DFU device to PC\n");
-	printf("Starting upload: [");
-	fflush(stdout);
+	progress_start(PROGRESS_UPLOAD, 0);
+	dfu_reset_block();
 
 	while (1) {
-		int rc, write_rc;
+		int rc;
 		rc = dfu_upload(dif->dev_handle, dif->interface, xfer_size, buf);
 		if (rc < 0) {
 			ret = rc;
 			goto out_free;
 		}
-		write_rc = fwrite(buf, 1, rc, file.filep);
-		if (write_rc < rc) {
+		if (file.sink) {
+			ret = sink_write(&file, buf, rc);
+			if (ret < 0)
+				goto out_free;
+		} else if (fwrite(buf, 1, rc, file.filep) < rc) {
 			fprintf(stderr, "Short file write: %s\n",
 				strerror(errno));
-			ret = total_bytes;
+			ret = -EIO;
 			goto out_free;
 		}
 		total_bytes += rc;
+		progress_add(rc);
 		if (rc < xfer_size) {
 			/* last block, return */
-			ret = total_bytes;
 			break;
 		}
-		putchar('#');
-		fflush(stdout);
 	}
 	ret = 0;
 
-	printf("] finished!\n");
-	fflush(stdout);
+	progress_finish();
 
 out_free:
-	free(buf);
+	xfer_buf_free(buf);
 	if (verbose)
-		printf("Received a total of %i bytes\n", total_bytes);
+		printf("Received a total of %lli bytes\n",
+		       (long long) total_bytes);
 
 	return ret;
 }
 
-#define PROGRESS_BAR_WIDTH 50
+/* Reads back as much firmware as was streamed to the device and
+ * compares the CRC of it to that of the stream
+ * returns 0 if identical, negative otherwise */
+static int dfuload_verify_stream(struct dfu_if *dif, int xfer_size,
+				 struct dfu_file file)
+{
+	unsigned char *buf;
+	off_t image_size = file.stream->bytes;
+	off_t offset = 0;
+	uint32_t crc = 0xffffffff;
+	int ret = 0;
+
+	buf = xfer_buf_alloc(xfer_size);
+	if (!buf)
+		return -ENOMEM;
+
+	printf("Verifying written firmware\n");
+	progress_start(PROGRESS_VERIFY, image_size);
+	dfu_reset_block();
+	while (offset < image_size) {
+		int chunk_size = xfer_size;
+		int rc;
+
+		if (image_size - offset < chunk_size)
+			chunk_size = image_size - offset;
+		rc = dfu_upload(dif->dev_handle, dif->interface, chunk_size,
+				buf);
+		if (rc < chunk_size) {
+			fprintf(stderr, "Error: Short read back at offset "
+				"0x%08llx\n", (long long) offset);
+			ret = -EIO;
+			break;
+		}
+		crc = crc32_buf(crc, buf, chunk_size);
+		offset += chunk_size;
+		progress_add(chunk_size);
+	}
+	if (offset >= image_size)
+		progress_finish();
+
+	/* The device may hold more data than the image */
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0)
+		fprintf(stderr, "Error sending dfu abort request\n");
+	xfer_buf_free(buf);
+
+	if (!ret && crc != stream_crc(&file)) {
+		fprintf(stderr, "Verify failed: CRC 0x%08x, streamed 0x%08x\n",
+			crc, stream_crc(&file));
+		ret = -EIO;
+	} else if (!ret) {
+		printf("Verify successful\n");
+	}
+	return ret;
+}
+
+/* Reads the firmware back from a device which returned to dfuIDLE
+ * after manifestation and compares it to the downloaded file.
+ * Mismatches are reported per transfer block.
+ * returns 0 if identical, negative otherwise */
+static int dfuload_do_verify(struct dfu_if *dif, int xfer_size,
+			     struct dfu_file file)
+{
+	unsigned char *buf, *expected;
+	off_t image_size = file.size - file.suffixlen;
+	off_t offset = 0;
+	off_t bad_start = -1, bad_end = -1;
+	int bad_blocks = 0;
+	int ret = 0;
+
+	buf = xfer_buf_alloc(xfer_size);
+	expected = xfer_buf_alloc(xfer_size);
+	if (!buf || !expected) {
+		xfer_buf_free(buf);
+		xfer_buf_free(expected);
+		return -ENOMEM;
+	}
+
+	printf("Verifying written firmware\n");
+	rewind(file.filep);
+	progress_start(PROGRESS_VERIFY, image_size);
+	dfu_reset_block();
+
+	while (offset < image_size) {
+		int chunk_size = xfer_size;
+		int rc;
+
+		if (image_size - offset < chunk_size)
+			chunk_size = image_size - offset;
+		if (fread(expected, 1, chunk_size, file.filep) < chunk_size) {
+			perror(file.name);
+			ret = -EIO;
+			break;
+		}
+		rc = dfu_upload(dif->dev_handle, dif->interface, chunk_size,
+				buf);
+		if (rc < chunk_size) {
+			fprintf(stderr, "Error: Short read back at offset "
+				"0x%08llx\n", (long long) offset);
+			ret = -EIO;
+			break;
+		}
+		if (memcmp(expected, buf, chunk_size)) {
+			if (bad_end != offset - 1) {
+				if (bad_start >= 0)
+					fprintf(stderr, "Verify mismatch at "
+						"offset 0x%08llx-0x%08llx\n",
+						(long long) bad_start,
+						(long long) bad_end);
+				bad_start = offset;
+			}
+			bad_end = offset + chunk_size - 1;
+			bad_blocks++;
+		}
+		offset += chunk_size;
+		progress_add(chunk_size);
+	}
+	if (offset >= image_size)
+		progress_finish();
+	if (bad_start >= 0)
+		fprintf(stderr, "Verify mismatch at offset 0x%08llx-0x%08llx\n",
+			(long long) bad_start, (long long) bad_end);
+
+	/* The device may hold more data than the image */
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0)
+		fprintf(stderr, "Error sending dfu abort request\n");
+
+	xfer_buf_free(buf);
+	xfer_buf_free(expected);
+
+	if (bad_blocks) {
+		fprintf(stderr, "Verify failed: %i mismatching blocks\n",
+			bad_blocks);
+		ret = -EIO;
+	} else if (!ret) {
+		printf("Verify successful\n");
+	}
+	return ret;
+}
+
+/* A device which is not manifestation tolerant stops answering requests
+ * after manifestation, until it is reset. It resets itself if it has the
+ * WillDetach attribute, otherwise the host has to reset the bus.
+ * returns 0 on success, negative on errors */
+static int dfuload_manifest_reset(struct dfu_if *dif, struct dfu_status *dst)
+{
+	int ret;
+
+	/* the status request in dfuMANIFEST-SYNC starts manifestation */
+	if (dst->bState == DFU_STATE_dfuMANIFEST_SYNC) {
+		milli_sleep(poll_manifest_wait(dst));
+		ret = dfu_get_status(dif->dev_handle, dif->interface, dst);
+		if (ret < 0) {
+			fprintf(stderr, "unable to read DFU status\n");
+			return ret;
+		}
+	}
+	if (dst->bState != DFU_STATE_dfuMANIFEST &&
+	    dst->bState != DFU_STATE_dfuMANIFEST_WAIT_RST)
+		return 0;
+
+	printf("Device is not manifestation tolerant\n");
+	/* manifestation is done after the poll timeout */
+	milli_sleep(dst->bwPollTimeout);
+	dif->flags |= DFU_IFF_GONE;
+	if (dif->bmAttributes & USB_DFU_WILL_DETACH) {
+		printf("Device will detach and reattach...\n");
+		return 0;
+	}
+	printf("Resetting USB to complete manifestation\n");
+	ret = libusb_reset_device(dif->dev_handle);
+	if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+		fprintf(stderr, "error resetting after manifestation\n");
+		return ret;
+	}
+	return 0;
+}
 
+/* Adds the blocks of the download, manifestation and read back to the
+ * plan instead of sending them
+ * returns 0 on success, negative on errors */
+static int dfuload_plan_dnload(struct dfu_if *dif, int xfer_size,
+			       struct dfu_file file)
+{
+	off_t total = file.size - file.suffixlen;
+	off_t bytes_sent;
+	int chunk_size;
+
+	if (plan_compiling()) {
+		fprintf(stderr, "Error: Plans can only be compiled for DfuSe "
+			"devices\n");
+		return -EINVAL;
+	}
+	/* the length of a stream is only known at its end */
+	if (file.stream) {
+		total = stream_skip(&file);
+		if (total < 0)
+			return total;
+	}
+
+	for (bytes_sent = 0; bytes_sent < total; bytes_sent += chunk_size) {
+		if (total - bytes_sent < xfer_size)
+			chunk_size = total - bytes_sent;
+		else
+			chunk_size = xfer_size;
+		plan_add(PLAN_WRITE, bytes_sent, chunk_size,
+			 plan_busy_ms(BUSY_PROGRAM, chunk_size));
+	}
+	plan_add(PLAN_MANIFEST, 0, 0, plan_busy_ms(BUSY_MANIFEST, 0));
+
+	if (verify && !(dif->bmAttributes & USB_DFU_MANIFEST_TOL))
+		fprintf(stderr, "Warning: Device resets after manifestation, "
+			"can not verify\n");
+	else if (verify)
+		plan_add(PLAN_VERIFY, 0, total, 0);
+	return 0;
+}
+
+/* The 16-bit block number of DFU_DNLOAD and DFU_UPLOAD wraps around to 0
+ * on images of more than 65536 blocks, see dfu_download(). Devices that
+ * work out the offset from it alone can not take such images.
+ * returns 0 on success, negative on errors */
 int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file)
 {
-	int bytes_sent = 0;
-	unsigned int bytes_per_hash, hashes = 0;
+	off_t image_size = file.size - file.suffixlen;
+	off_t bytes_sent = 0;
 	unsigned char *buf;
 	struct dfu_status dst;
 	int ret;
 
-	buf = malloc(xfer_size);
+	if (plan)
+		return dfuload_plan_dnload(dif, xfer_size, file);
+
+	buf = xfer_buf_alloc(xfer_size);
 	if (!buf)
 		return -ENOMEM;
 
-	bytes_per_hash = (file.size - file.suffixlen) / PROGRESS_BAR_WIDTH;
-	if (bytes_per_hash == 0)
-		bytes_per_hash = 1;
-	printf("bytes_per_hash=%u\n", bytes_per_hash);
+	/* the suffix of a stream comes too late to keep DfuSe files out */
+	if (file.stream) {
+		ret = stream_peek(&file, buf, 5);
+		if (ret < 0)
+			goto out_free;
+		if (ret == 5 && !memcmp(buf, "DfuSe", 5)) {
+			fprintf(stderr, "Error: %s is a DfuSe file, not meant "
+				"for raw download\n", file.name);
+			ret = -EINVAL;
+			goto out_free;
+		}
+	}
 
 	printf("Copying data from PC to DFU device\n");
-	printf("Starting download: [");
-	fflush(stdout);
-	while (bytes_sent < file.size - file.suffixlen) {
-		int hashes_todo;
-		int bytes_left;
+	if (verbose && !file.stream && (image_size - 1) / xfer_size > 0xffff)
+		printf("Image takes %lli blocks, block numbers wrap around\n",
+		       (long long) (image_size + xfer_size - 1) / xfer_size);
+	progress_start(PROGRESS_DOWNLOAD, file.stream ? 0 : image_size);
+	/* also after earlier steps of a session script */
+	dfu_reset_block();
+	while (1) {
 		int chunk_size;
 
-		bytes_left = file.size - file.suffixlen - bytes_sent;
-		if (bytes_left < xfer_size)
-			chunk_size = bytes_left;
-		else
-			chunk_size = xfer_size;
-		ret = fread(buf, 1, chunk_size, file.filep);
-		if (ret < 0) {
-			perror(file.name);
-			goto out_free;
+		if (file.stream) {
+			/* ends when the stream does */
+			chunk_size = stream_read(&file, buf, xfer_size);
+			if (chunk_size < 0) {
+				ret = chunk_size;
+				goto out_free;
+			}
+		} else {
+			if (image_size - bytes_sent < xfer_size)
+				chunk_size = image_size - bytes_sent;
+			else
+				chunk_size = xfer_size;
+			if (fread(buf, 1, chunk_size, file.filep) < chunk_size) {
+				perror(file.name);
+				ret = -EIO;
+				goto out_free;
+			}
 		}
-		ret = dfu_download(dif->dev_handle, dif->interface, ret, ret ? buf : NULL);
+		if (!chunk_size)
+			break;
+		ret = dfu_download(dif->dev_handle, dif->interface, chunk_size,
+				   buf);
 		if (ret < 0) {
 			fprintf(stderr, "Error during download\n");
 			goto out_free;
 		}
 		bytes_sent += ret;
+		progress_add(ret);
 
-		do {
-			ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-			if (ret < 0) {
-				fprintf(stderr, "Error during download get_status\n");
-				goto out_free;
-			}
-
-			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
-					dst.bState == DFU_STATE_dfuERROR)
-				break;
-
-			/* Wait while device executes flashing */
-			if (quirks & QUIRK_POLLTIMEOUT)
-				milli_sleep(DEFAULT_POLLTIMEOUT);
-			else
-				milli_sleep(dst.bwPollTimeout);
-
-		} while (1);
+		ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
+		/* Wait while device executes flashing */
+		if (ret >= 0)
+			ret = poll_busy(dif, &dst, BUSY_PROGRAM, chunk_size);
+		if (ret < 0) {
+			fprintf(stderr, "Error during download get_status\n");
+			goto out_free;
+		}
 		if (dst.bStatus != DFU_STATUS_OK) {
 			printf(" failed!\n");
 			printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
@@ -157,12 +398,6 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file)
 			ret = -1;
 			goto out_free;
 		}
-
-		hashes_todo = (bytes_sent / bytes_per_hash) - hashes;
-		hashes += hashes_todo;
-		while (hashes_todo--)
-			putchar('#');
-		fflush(stdout);
 	}
 
 	/* send one zero sized download request to signalize end */
@@ -172,12 +407,11 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file)
 		goto out_free;
 	}
 
-	printf("] finished!\n");
-	fflush(stdout);
+	progress_finish();
 	if (verbose)
-		printf("Sent a total of %i bytes\n", bytes_sent);
+		printf("Sent a total of %lli bytes\n",
+		       (long long) bytes_sent);
 
-get_status:
 	/* Transition to MANIFEST_SYNC state */
 	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
 	if (ret < 0) {
@@ -187,27 +421,39 @@ get_status:
 	printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
 		dfu_state_to_string(dst.bState), dst.bStatus,
 		dfu_status_to_string(dst.bStatus));
-	if (!(quirks & QUIRK_POLLTIMEOUT))
-		milli_sleep(dst.bwPollTimeout);
-
-	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
-	switch (dst.bState) {
-	case DFU_STATE_dfuMANIFEST_SYNC:
-	case DFU_STATE_dfuMANIFEST:
-		/* some devices (e.g. TAS1020b) need some time before we
-		 * can obtain the status */
-		milli_sleep(1000);
-		goto get_status;
-		break;
-	case DFU_STATE_dfuIDLE:
-		break;
+
+	if (!(dif->bmAttributes & USB_DFU_MANIFEST_TOL)) {
+		ret = dfuload_manifest_reset(dif, &dst);
+		if (ret < 0)
+			goto out_free;
+	} else if (dst.bState == DFU_STATE_dfuMANIFEST_SYNC ||
+		   dst.bState == DFU_STATE_dfuMANIFEST) {
+		ret = poll_busy(dif, &dst, BUSY_MANIFEST, 0);
+		if (ret < 0) {
+			fprintf(stderr, "unable to read DFU status\n");
+			goto out_free;
+		}
+		printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
+			dfu_state_to_string(dst.bState), dst.bStatus,
+			dfu_status_to_string(dst.bStatus));
 	}
 	printf("Done!\n");
+	ret = 0;
+
+	if (verify) {
+		if (dst.bState != DFU_STATE_dfuIDLE)
+			fprintf(stderr, "Warning: Device did not return to "
+				"dfuIDLE, can not verify\n");
+		else if (file.stream)
+			ret = dfuload_verify_stream(dif, xfer_size, file);
+		else
+			ret = dfuload_do_verify(dif, xfer_size, file);
+	}
 
 out_free:
-	free(buf);
+	xfer_buf_free(buf);
 
-	return bytes_sent;
+	return ret;
 }
 
 void dfuload_init()
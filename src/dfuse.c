@@ -30,11 +30,28 @@
 #include "dfu_file.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
+#include "image_writer.h"
+#include "dfuse_journal.h"
+#include "quirks.h"
+#include "poll_history.h"
+#include "progress.h"
+#include "sink.h"
+#include "stream.h"
+#include "xfer_pool.h"
+#include "dfuse_cost.h"
+#include "plan.h"
 
 #define DFU_TIMEOUT 5000
 
+/* Blocks of this size which read back as all 0xFF are taken as erased */
+#define DFUSE_ERASED_BLOCK 256
+
+/* Failed upload requests are retried this often per upload */
+#define DFUSE_UPLOAD_RETRIES 5
+
 extern int verbose;
-static unsigned int last_erased = 0;
+extern int verify;
+extern int plan;
 static struct memsegment *mem_layout;
 static unsigned int dfuse_address = 0;
 static unsigned int dfuse_length = 0;
@@ -42,12 +59,195 @@ static int dfuse_force = 0;
 static int dfuse_leave = 0;
 static int dfuse_unprotect = 0;
 static int dfuse_mass_erase = 0;
+static int dfuse_auto_erase = 0;
+static int dfuse_all = 0;
+static int dfuse_sparse = 0;
+static int dfuse_resume = 0;
+/* Sequence number of the next chunk, and chunks done in earlier sessions */
+static int chunk_index = 0;
+static int resume_chunks = 0;
+/* Address and block number of the next chunk after the last one written
+ * by dfuse_write_chunk, for devices that need no new SET_ADDRESS */
+static unsigned int next_chunk_address = 0;
+static int next_chunk_block = 0;
+/* Last byte of the chunks programmed in an earlier session */
+static unsigned int resume_last = 0;
+/* Pages erased on this alternate setting, in ascending order, kept for
+ * all downloads of a session script */
+static unsigned int *erased_pages;
+static int num_erased;
+static int erased_allocated;
+/* Whole memory erased on this alternate setting */
+static int mass_erased;
+
+/* Memory layouts parsed so far, one per alternate setting name */
+struct layout_cache {
+	char *alt_name;
+	struct memsegment *layout;
+	struct layout_cache *next;
+};
+
+static struct layout_cache *layouts;
+
+/* Part of an element downloaded in one transfer */
+struct dfuse_chunk {
+	unsigned int offset;		/* in the element */
+	int size;
+	struct memsegment *segment;
+};
+
+/* Range of consecutive mismatching pages found during verification */
+struct verify_range {
+	unsigned int start;
+	unsigned int end;
+	int pending;
+	int count;
+};
 
 unsigned int quad2uint(unsigned char *p)
 {
 	return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
 }
 
+static void erased_clear(void)
+{
+	free(erased_pages);
+	erased_pages = NULL;
+	num_erased = 0;
+	erased_allocated = 0;
+}
+
+/* Looks up page in the erased set, *pos is set to where it is or would
+ * be inserted. returns 1 if found */
+static int erased_find(unsigned int page, int *pos)
+{
+	int lo = 0, hi = num_erased;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (erased_pages[mid] < page)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return lo < num_erased && erased_pages[lo] == page;
+}
+
+static int erased_add(unsigned int page)
+{
+	int pos;
+
+	if (erased_find(page, &pos))
+		return 0;
+	if (num_erased == erased_allocated) {
+		int n = erased_allocated ? erased_allocated * 2 : 64;
+		unsigned int *more;
+
+		more = realloc(erased_pages, n * sizeof(*erased_pages));
+		if (!more)
+			return -ENOMEM;
+		erased_pages = more;
+		erased_allocated = n;
+	}
+	memmove(erased_pages + pos + 1, erased_pages + pos,
+		(num_erased - pos) * sizeof(*erased_pages));
+	erased_pages[pos] = page;
+	num_erased++;
+	return 0;
+}
+
+static void erased_remove(unsigned int page)
+{
+	int pos;
+
+	if (!erased_find(page, &pos))
+		return;
+	memmove(erased_pages + pos, erased_pages + pos + 1,
+		(num_erased - pos - 1) * sizeof(*erased_pages));
+	num_erased--;
+}
+
+/* Returns the start of the page holding address */
+static unsigned int page_of(struct memsegment *segment, unsigned int address)
+{
+	if (segment->pagesize <= 0)
+		return address;
+	return address - (address - segment->start) % segment->pagesize;
+}
+
+/* Forgets the modifiers and progress of the previous operation */
+static void dfuse_reset_options(void)
+{
+	dfuse_address = 0;
+	dfuse_length = 0;
+	dfuse_force = 0;
+	dfuse_leave = 0;
+	dfuse_unprotect = 0;
+	dfuse_mass_erase = 0;
+	dfuse_auto_erase = 0;
+	dfuse_all = 0;
+	dfuse_sparse = 0;
+	dfuse_resume = 0;
+	resume_last = 0;
+	chunk_index = 0;
+	resume_chunks = 0;
+	next_chunk_address = 0;
+	next_chunk_block = 0;
+}
+
+/* Returns the memory layout of the current alternate setting, parsing
+ * its name only the first time it is used, NULL on failure */
+static struct memsegment *dfuse_memory_layout(struct dfu_if *dif)
+{
+	struct layout_cache *entry;
+
+	if (!dif->alt_name)
+		return NULL;
+	for (entry = layouts; entry; entry = entry->next)
+		if (!strcmp(entry->alt_name, (char *)dif->alt_name))
+			return entry->layout;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->layout = parse_memory_layout((char *)dif->alt_name);
+	entry->alt_name = strdup((char *)dif->alt_name);
+	if (!entry->layout || !entry->alt_name) {
+		if (entry->layout)
+			free_segment_list(entry->layout);
+		free(entry->alt_name);
+		free(entry);
+		return NULL;
+	}
+	entry->next = layouts;
+	layouts = entry;
+	return entry->layout;
+}
+
+/* Forgets which pages were erased, when another alternate setting is
+ * selected and at the end of the session */
+void dfuse_forget_erased(void)
+{
+	erased_clear();
+	mass_erased = 0;
+}
+
+void dfuse_release_layouts(void)
+{
+	dfuse_forget_erased();
+	while (layouts) {
+		struct layout_cache *entry = layouts;
+
+		layouts = entry->next;
+		free_segment_list(entry->layout);
+		free(entry->alt_name);
+		free(entry);
+	}
+}
+
 void dfuse_parse_options(const char *options)
 {
 	char *end;
@@ -100,6 +300,26 @@ void dfuse_parse_options(const char *options)
 			options += 10;
 			continue;
 		}
+		if (!strncmp(options, "resume", endword - options)) {
+			dfuse_resume = 1;
+			options += 6;
+			continue;
+		}
+		if (!strncmp(options, "all", endword - options)) {
+			dfuse_all = 1;
+			options += 3;
+			continue;
+		}
+		if (!strncmp(options, "sparse", endword - options)) {
+			dfuse_sparse = 1;
+			options += 6;
+			continue;
+		}
+		if (!strncmp(options, "auto-erase", endword - options)) {
+			dfuse_auto_erase = 1;
+			options += 10;
+			continue;
+		}
 
 		/* any valid number is interpreted as upload length */
 		number = strtoul(options, &end, 0);
@@ -114,6 +334,15 @@ void dfuse_parse_options(const char *options)
 	}
 }
 
+/* returns 1 if the DfuSe options ask for resuming an upload, which is
+ * left for dfuse_do_upload() to check, 0 otherwise */
+int dfuse_upload_resumes(const char *dfuse_options)
+{
+	dfuse_reset_options();
+	dfuse_parse_options(dfuse_options);
+	return dfuse_resume;
+}
+
 /* DFU_UPLOAD request for DfuSe 1.1a */
 int dfuse_upload(struct dfu_if *dif, const unsigned short length,
 		 unsigned char *data, unsigned short transaction)
@@ -160,15 +389,122 @@ int dfuse_download(struct dfu_if *dif, const unsigned short length,
 	return status;
 }
 
+/* Sends a prepared special command and waits for its execution
+ * returns the libusb error code on transfer errors */
+static int dfuse_send_command(struct dfu_if *dif, unsigned char *buf,
+			      int length, enum dfuse_command command)
+{
+	struct dfu_status dst;
+	unsigned int address = buf[1] | (buf[2] << 8) | (buf[3] << 16) |
+			       ((unsigned int) buf[4] << 24);
+	enum busy_op op = BUSY_NONE;
+	int size = 0;
+	int ret;
+
+	ret = dfuse_download(dif, length, buf, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Error during special command download\n");
+		return ret;
+	}
+	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
+	if (ret < 0) {
+		fprintf(stderr, "Error during special command get_status\n");
+		return ret;
+	}
+	/* a repeated get_status may already find the command done */
+	if (dst.bState != DFU_STATE_dfuDNBUSY &&
+	    dst.bState != DFU_STATE_dfuDNLOAD_IDLE) {
+		fprintf(stderr, "Error: Wrong state after command download\n");
+		exit(1);
+	}
+
+	if (command == READ_UNPROTECT) {
+		/* the device resets itself when done */
+		if (verbose)
+			printf("   Poll timeout %i ms\n", dst.bwPollTimeout);
+		milli_sleep(dst.bwPollTimeout);
+		return ret;
+	}
+
+	/* wait while command is executed */
+	if (command == SET_ADDRESS) {
+		op = BUSY_SET_ADDRESS;
+	} else if (command == MASS_ERASE) {
+		op = BUSY_MASS_ERASE;
+	} else if (command == ERASE_PAGE) {
+		op = BUSY_ERASE;
+		size = find_segment(mem_layout, address)->pagesize;
+	}
+	ret = poll_busy(dif, &dst, op, size);
+	if (ret < 0) {
+		fprintf(stderr, "Error during second get_status\n");
+		printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
+		       dfu_state_to_string(dst.bState), dst.bStatus,
+		       dfu_status_to_string(dst.bStatus));
+		return ret;
+	}
+	if (dst.bStatus != DFU_STATUS_OK) {
+		fprintf(stderr, "Error: Command not correctly executed\n");
+		exit(1);
+	}
+	milli_sleep(dst.bwPollTimeout);
+
+	ret = dfu_abort(dif->dev_handle, dif->interface);
+	if (ret < 0) {
+		fprintf(stderr, "Error sending dfu abort request\n");
+		return ret;
+	}
+	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
+	if (ret < 0) {
+		fprintf(stderr, "Error during abort get_status\n");
+		return ret;
+	}
+	if (dst.bState != DFU_STATE_dfuIDLE) {
+		fprintf(stderr, "Error: Failed to enter idle state on abort\n");
+		exit(1);
+	}
+	milli_sleep(dst.bwPollTimeout);
+	return ret;
+}
+
+/* Adds a special command to the plan instead of sending it */
+static void dfuse_plan_command(unsigned int address,
+			       enum dfuse_command command)
+{
+	struct memsegment *segment;
+
+	switch (command) {
+	case ERASE_PAGE:
+		segment = find_segment(mem_layout, address);
+		plan_add(PLAN_ERASE, page_of(segment, address),
+			 segment->pagesize,
+			 dfuse_page_erase_ms(segment->pagesize));
+		break;
+	case SET_ADDRESS:
+		plan_add(PLAN_SET_ADDRESS, address, 0,
+			 plan_busy_ms(BUSY_SET_ADDRESS, 0));
+		break;
+	case MASS_ERASE:
+		plan_add(PLAN_MASS_ERASE, 0, 0, dfuse_mass_erase_ms(mem_layout));
+		break;
+	case READ_UNPROTECT:
+		plan_add(PLAN_UNPROTECT, 0, 0, 0);
+		break;
+	}
+}
+
 /* DfuSe only commands */
 int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			  enum dfuse_command command)
 {
 	unsigned char buf[5];
 	int length;
+	int tries;
 	int ret;
-	struct dfu_status dst;
 
+	/* every command moves the address pointer, ST's erase loads it with
+	 * the page address, so the next chunk needs its own SET_ADDRESS */
+	next_chunk_block = 0;
 	if (command == ERASE_PAGE) {
 		struct memsegment *segment;
 		int page_size;
@@ -187,7 +523,6 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			       address & ~(page_size - 1));
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased = address;
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 2)
 			printf("  Setting address pointer to 0x%08x\n",
@@ -210,58 +545,245 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 	buf[3] = (address >> 16) & 0xff;
 	buf[4] = (address >> 24) & 0xff;
 
-	ret = dfuse_download(dif, length, buf, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Error during special command download\n");
+	if (plan) {
+		dfuse_plan_command(address, command);
+		return 0;
+	}
+
+	/* all these commands can be repeated safely, once the device is
+	 * back in dfuIDLE, except the read unprotect which resets it */
+	for (tries = 0; ; tries++) {
+		ret = dfuse_send_command(dif, buf, length, command);
+		if (ret >= 0 || command == READ_UNPROTECT ||
+		    tries >= DFU_RETRIES || !dfu_transient_error(ret) ||
+		    dfu_resync(dif->dev_handle, dif->interface) < 0)
+			break;
+		dfu_retry_count++;
+		fprintf(stderr, "Retrying special command\n");
+	}
+	if (ret < 0)
 		exit(1);
+	return ret;
+}
+
+/* Block numbers 0 and 1 are commands, so the 16-bit block number of an
+ * upload must not wrap around. Before it would, the address pointer is
+ * moved on to address, where the upload continues with block 2.
+ * returns the transaction number to continue with, negative on errors */
+static int dfuse_upload_block(struct dfu_if *dif, unsigned int address,
+			      int transaction)
+{
+	if (transaction <= 0xffff)
+		return transaction;
+	if (verbose)
+		printf("Setting address pointer to 0x%08x, block numbers "
+		       "would wrap around\n", address);
+	/* leave dfuUPLOAD-IDLE so that the address can be set */
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0) {
+		fprintf(stderr, "Error sending dfu abort request\n");
+		return -EIO;
 	}
-	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-	if (ret < 0) {
-		fprintf(stderr, "Error during special command get_status\n");
+	dfuse_special_command(dif, address, SET_ADDRESS);
+	return 2;
+}
+
+static int is_erased(const unsigned char *buf, int len)
+{
+	while (len--)
+		if (*buf++ != 0xff)
+			return 0;
+	return 1;
+}
+
+/* Reads all readable segments of the memory layout, leaving erased
+ * blocks out of the written file */
+static int dfuse_upload_all(struct dfu_if *dif, int xfer_size,
+			    struct dfu_file *file)
+{
+	struct image_writer w;
+	struct memsegment *segment;
+	enum dfu_file_format format;
+	unsigned char *buf;
+	unsigned int base = 0xffffffff;
+	unsigned int end = 0;
+	long total_bytes = 0;
+	long readable = 0;
+	int ret;
+
+	mem_layout = dfuse_memory_layout(dif);
+	if (!mem_layout) {
+		fprintf(stderr, "Error: Failed to parse memory layout\n");
 		exit(1);
 	}
-	if (dst.bState != DFU_STATE_dfuDNBUSY) {
-		fprintf(stderr, "Error: Wrong state after command download\n");
+	for (segment = mem_layout; segment; segment = segment->next) {
+		if (!(segment->memtype & DFUSE_READABLE))
+			continue;
+		if (segment->start < base)
+			base = segment->start;
+		if (segment->end >= end)
+			end = segment->end + 1;
+		readable += segment->end - segment->start + 1;
+	}
+	if (base > end) {
+		fprintf(stderr, "Error: No readable memory segment\n");
 		exit(1);
 	}
-	/* wait while command is executed */
-	if (verbose)
-		printf("   Poll timeout %i ms\n", dst.bwPollTimeout);
-	milli_sleep(dst.bwPollTimeout);
+	if (dfuse_address || dfuse_length)
+		fprintf(stderr, "Warning: Reading all memory, ignoring "
+			"address and length\n");
+
+	/* The file was opened for appending, which prevents seeking */
+	if (!freopen(file->name, "w+b", file->filep)) {
+		perror(file->name);
+		return -EIO;
+	}
+	file->idVendor = dif->vendor;
+	file->idProduct = dif->product;
+	file->bcdDevice = dif->bcdDevice;
+	format = image_format_from_name(file->name);
+	if (format == DFU_FORMAT_RAW && dfuse_sparse)
+		printf("Writing raw file starting at 0x%08x, erased blocks "
+		       "are left as holes, which read back as zeros\n", base);
+	else if (format == DFU_FORMAT_RAW)
+		printf("Writing raw file starting at 0x%08x\n", base);
+	else
+		printf("Writing %s file, erased blocks are left out\n",
+		       file_format_to_string(format));
+	ret = image_writer_start(&w, file, format, dif->altsetting, base);
+	if (ret < 0)
+		return ret;
+	w.holes = dfuse_sparse;
+
+	buf = xfer_buf_alloc(xfer_size);
+	if (!buf)
+		return -ENOMEM;
 
-	if (command == READ_UNPROTECT)
+	progress_start(PROGRESS_UPLOAD, readable);
+	for (segment = mem_layout; segment && !ret; segment = segment->next) {
+		unsigned int address = segment->start;
+		int transaction = 2;
+
+		if (!(segment->memtype & DFUSE_READABLE))
+			continue;
+		dfuse_special_command(dif, address, SET_ADDRESS);
+		while (1) {
+			int chunk = xfer_size;
+			int rc, i, len;
+
+			if (segment->end - address < chunk - 1)
+				chunk = segment->end - address + 1;
+			transaction = dfuse_upload_block(dif, address,
+							 transaction);
+			if (transaction < 0) {
+				ret = transaction;
+				break;
+			}
+			rc = dfuse_upload(dif, chunk, buf, transaction++);
+			if (rc < chunk) {
+				fprintf(stderr, "\nError: Short upload at "
+					"0x%08x\n", address);
+				ret = -EIO;
+				break;
+			}
+			for (i = 0; i < rc && !ret; i += len) {
+				len = DFUSE_ERASED_BLOCK -
+				      (address + i) % DFUSE_ERASED_BLOCK;
+				if (len > rc - i)
+					len = rc - i;
+				if (!is_erased(buf + i, len))
+					ret = image_writer_data(&w, address + i,
+								buf + i, len);
+			}
+			total_bytes += rc;
+			progress_add(rc);
+			if (ret || address + rc - 1 == segment->end)
+				break;
+			address += rc;
+		}
+		/* Leave dfuUPLOAD-IDLE so that the next address can be set */
+		if (dfu_abort(dif->dev_handle, dif->interface) < 0) {
+			fprintf(stderr, "Error sending dfu abort request\n");
+			ret = -EIO;
+		}
+	}
+	xfer_buf_free(buf);
+	if (!ret)
+		ret = image_writer_finish(&w, end);
+	if (ret < 0)
 		return ret;
 
+	progress_finish();
+	printf("Read %li bytes, %li bytes of it not erased\n", total_bytes,
+	       w.data_bytes);
+	return total_bytes;
+}
+
+/* Continues an upload from address at offset bytes into the file. The
+ * device is brought back to dfuIDLE, the address pointer is set to the
+ * block before offset, and that block is read again and checked against
+ * the file by CRC.
+ * returns the transaction number to continue with, negative on errors */
+static int dfuse_upload_resync(struct dfu_if *dif, struct dfu_file *file,
+			       unsigned int address, long offset,
+			       int xfer_size, unsigned char *buf)
+{
+	struct dfu_status dst;
+	unsigned char *tail;
+	uint32_t device_crc, file_crc;
+	int ret;
+
 	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-	if (ret < 0) {
-		fprintf(stderr, "Error during second get_status\n");
-		printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
-		       dfu_state_to_string(dst.bState), dst.bStatus,
-		       dfu_status_to_string(dst.bStatus));
-		exit(1);
+	if (ret >= 0 && dst.bState == DFU_STATE_dfuERROR)
+		dfu_clear_status(dif->dev_handle, dif->interface);
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0) {
+		fprintf(stderr, "Error sending dfu abort request\n");
+		return -EIO;
 	}
-	if (dst.bStatus != DFU_STATUS_OK) {
-		fprintf(stderr, "Error: Command not correctly executed\n");
-		exit(1);
+
+	if (offset < xfer_size) {
+		/* not enough data for checking the overlap, start over */
+		if (!freopen(file->name, "w+b", file->filep)) {
+			perror(file->name);
+			return -EIO;
+		}
+		dfuse_special_command(dif, address, SET_ADDRESS);
+		return 2;
 	}
-	milli_sleep(dst.bwPollTimeout);
 
-	ret = dfu_abort(dif->dev_handle, dif->interface);
-	if (ret < 0) {
-		fprintf(stderr, "Error sending dfu abort request\n");
-		exit(1);
+	dfuse_special_command(dif, address + offset - xfer_size, SET_ADDRESS);
+	if (dfuse_upload(dif, xfer_size, buf, 2) < xfer_size) {
+		fprintf(stderr, "Error: Could not read back 0x%08lx\n",
+			address + offset - xfer_size);
+		return -EIO;
 	}
-	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-	if (ret < 0) {
-		fprintf(stderr, "Error during abort get_status\n");
-		exit(1);
+	device_crc = crc32_buf(0xffffffff, buf, xfer_size);
+
+	tail = xfer_buf_alloc(xfer_size);
+	if (!tail)
+		return -ENOMEM;
+	fflush(file->filep);
+	if (fseek(file->filep, offset - xfer_size, SEEK_SET) ||
+	    fread(tail, 1, xfer_size, file->filep) < xfer_size) {
+		fprintf(stderr, "Could not read back %s\n", file->name);
+		xfer_buf_free(tail);
+		return -EIO;
 	}
-	if (dst.bState != DFU_STATE_dfuIDLE) {
-		fprintf(stderr, "Error: Failed to enter idle state on abort\n");
-		exit(1);
+	file_crc = crc32_buf(0xffffffff, tail, xfer_size);
+	xfer_buf_free(tail);
+
+	if (device_crc != file_crc) {
+		fprintf(stderr, "Error: Device memory at 0x%08lx does not "
+			"match %s (CRC 0x%08x, expected 0x%08x)\n",
+			address + offset - xfer_size, file->name,
+			device_crc, file_crc);
+		return -EIO;
 	}
-	milli_sleep(dst.bwPollTimeout);
-	return ret;
+	/* switching from reading to writing needs a seek */
+	if (fseek(file->filep, offset, SEEK_SET)) {
+		perror(file->name);
+		return -EIO;
+	}
+	return 3;
 }
 
 int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
@@ -269,22 +791,40 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 {
 	int total_bytes = 0;
 	int upload_limit = 0;
+	int block_size = xfer_size;
+	int retries = 0;
 	unsigned char *buf;
 	int transaction;
 	int ret;
 
-	buf = malloc(xfer_size);
+	buf = xfer_buf_alloc(xfer_size);
 	if (!buf)
 		return -ENOMEM;
 
+	dfuse_reset_options();
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
+	if (dfuse_resume && !dfuse_address) {
+		fprintf(stderr, "Error: Resuming an upload needs an address\n");
+		xfer_buf_free(buf);
+		return -EINVAL;
+	}
+	if (file.sink && (dfuse_all || dfuse_resume)) {
+		fprintf(stderr, "Error: Uploads to a pipe can neither read "
+			"all memory nor be resumed\n");
+		xfer_buf_free(buf);
+		return -EINVAL;
+	}
+	if (dfuse_all) {
+		xfer_buf_free(buf);
+		return dfuse_upload_all(dif, xfer_size, &file);
+	}
 	if (dfuse_length)
 		upload_limit = dfuse_length;
 	if (dfuse_address) {
 		struct memsegment *segment;
 
-		mem_layout = parse_memory_layout((char *)dif->alt_name);
+		mem_layout = dfuse_memory_layout(dif);
 		if (!mem_layout) {
 			fprintf(stderr,
 				"Error: Failed to parse memory layout\n");
@@ -303,7 +843,15 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 			printf("Limiting upload to end of memory segment, "
 			       "%i bytes\n", upload_limit);
 		}
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+		/* reading back the file is needed for resuming */
+		if (!file.sink) {
+			if (!freopen(file.name, "r+b", file.filep)) {
+				perror(file.name);
+				exit(1);
+			}
+			fseek(file.filep, 0, SEEK_END);
+			total_bytes = ftell(file.filep);
+		}
 	} else {
 		/* Boot loader decides the start address, unknown to us */
 		/* Use a short length to lower risk of running out of bounds */
@@ -312,44 +860,100 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 		printf("Limiting default upload to %i bytes\n", upload_limit);
 	}
 
-	printf("bytes_per_hash=%u\n", xfer_size);
-	printf("Starting upload: [");
-	fflush(stdout);
+	if (total_bytes >= upload_limit) {
+		printf("Upload already complete, %i bytes\n", total_bytes);
+		xfer_buf_free(buf);
+		return total_bytes;
+	}
+	if (total_bytes) {
+		printf("Resuming upload at 0x%08x, %i bytes already in %s\n",
+		       dfuse_address + total_bytes, total_bytes, file.name);
+		transaction = dfuse_upload_resync(dif, &file, dfuse_address,
+						  total_bytes, block_size,
+						  buf);
+		if (transaction < 0) {
+			ret = transaction;
+			goto out_free;
+		}
+		if (transaction == 2)
+			total_bytes = 0;
+	} else {
+		if (dfuse_address)
+			dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+		transaction = 2;
+	}
+
+	progress_start(PROGRESS_UPLOAD, upload_limit - total_bytes);
 
-	transaction = 2;
 	while (1) {
-		int rc, write_rc;
+		int rc;
 
 		/* last chunk can be smaller than original xfer_size */
 		if (upload_limit - total_bytes < xfer_size)
 			xfer_size = upload_limit - total_bytes;
+		if (transaction > 0xffff && !dfuse_address) {
+			fprintf(stderr, "\nError: Upload too long for the block "
+				"numbers, an address is needed to go on\n");
+			ret = -EINVAL;
+			goto out_free;
+		}
+		transaction = dfuse_upload_block(dif,
+						 dfuse_address + total_bytes,
+						 transaction);
+		if (transaction < 0) {
+			ret = transaction;
+			goto out_free;
+		}
 		rc = dfuse_upload(dif, xfer_size, buf, transaction++);
+		/* what went into a pipe can not be read back for checking */
+		if (rc < 0 && dfuse_address && !file.sink &&
+		    retries++ < DFUSE_UPLOAD_RETRIES) {
+			/* continue after the data already in the file */
+			dfu_retry_count++;
+			fprintf(stderr, "\nRetrying upload at 0x%08x\n",
+				dfuse_address + total_bytes);
+			transaction = dfuse_upload_resync(dif, &file,
+							  dfuse_address,
+							  total_bytes,
+							  block_size, buf);
+			if (transaction < 0) {
+				ret = transaction;
+				goto out_free;
+			}
+			if (transaction == 2)
+				total_bytes = 0;
+			continue;
+		}
 		if (rc < 0) {
 			ret = rc;
 			goto out_free;
 		}
-		write_rc = fwrite(buf, 1, rc, file.filep);
-		if (write_rc < rc) {
+		if (file.sink) {
+			ret = sink_write(&file, buf, rc);
+			if (ret < 0)
+				goto out_free;
+		} else if (fwrite(buf, 1, rc, file.filep) < rc) {
 			fprintf(stderr, "Short file write: %s\n",
 				strerror(errno));
 			ret = -1;
 			goto out_free;
 		}
 		total_bytes += rc;
+		progress_add(rc);
+		/* keep the file a valid checkpoint for resuming */
+		if (dfuse_resume)
+			fflush(file.filep);
 		if (rc < xfer_size || total_bytes >= upload_limit) {
 			/* last block, return successfully */
 			ret = total_bytes;
 			break;
 		}
-		putchar('#');
-		fflush(stdout);
 	}
 
-	printf("] finished!\n");
-	fflush(stdout);
+	progress_finish();
 
  out_free:
-	free(buf);
+	xfer_buf_free(buf);
 
 	return ret;
 }
@@ -368,16 +972,14 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	}
 	bytes_sent = ret;
 
-	do {
-		ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-		if (ret < 0) {
-			fprintf(stderr, "Error during download get_status\n");
-			return ret;
-		}
-		milli_sleep(dst.bwPollTimeout);
-	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
-		 dst.bState != DFU_STATE_dfuERROR &&
-		 dst.bState != DFU_STATE_dfuMANIFEST);
+	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
+	if (ret >= 0)
+		ret = poll_busy(dif, &dst, size ? BUSY_PROGRAM : BUSY_NONE,
+				size);
+	if (ret < 0) {
+		fprintf(stderr, "Error during download get_status\n");
+		return ret;
+	}
 
 	if (dst.bState == DFU_STATE_dfuMANIFEST)
 			printf("Transitioning to dfuMANIFEST state\n");
@@ -387,95 +989,506 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 		printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
 		       dfu_state_to_string(dst.bState), dst.bStatus,
 		       dfu_status_to_string(dst.bStatus));
-		return -1;
+		return -EINVAL;
 	}
 	return bytes_sent;
 }
 
-/* Writes an element of any size to the device, taking care of page erases */
-/* returns 0 on success, otherwise -EINVAL */
-int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
-			 unsigned int dwElementSize, unsigned char *data,
-			 int xfer_size)
+/* Reads size bytes of device memory at address into buf
+ * returns 0 on success, negative on errors */
+static int dfuse_read_memory(struct dfu_if *dif, unsigned int address,
+			     int size, unsigned char *buf, int xfer_size)
 {
+	int transaction = 2;
 	int p;
-	int ret;
-	struct memsegment *segment;
-
-	/* Check at least that we can write to the last address */
-	segment =
-	    find_segment(mem_layout, dwElementAddress + dwElementSize - 1);
-	if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
-		fprintf(stderr, "Error: Last page at 0x%08x is not writeable\n",
-			dwElementAddress + dwElementSize - 1);
-		exit(1);
-	}
+	int ret = 0;
 
-	for (p = 0; p < dwElementSize; p += xfer_size) {
-		int page_size;
-		unsigned int erase_address;
-		unsigned int address = dwElementAddress + p;
+	dfuse_special_command(dif, address, SET_ADDRESS);
+	for (p = 0; p < size; p += xfer_size) {
 		int chunk_size = xfer_size;
 
-		segment = find_segment(mem_layout, address);
-		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
-			fprintf(stderr,
-				"Error: Page at 0x%08x is not writeable\n",
-				address);
-			exit(1);
+		if (p + chunk_size > size)
+			chunk_size = size - p;
+		transaction = dfuse_upload_block(dif, address + p,
+						 transaction);
+		if (transaction < 0) {
+			ret = transaction;
+			break;
 		}
-		page_size = segment->pagesize;
+		if (dfuse_upload(dif, chunk_size, buf + p, transaction++) <
+		    chunk_size) {
+			fprintf(stderr, "Error: Short read back at 0x%08x\n",
+				address + p);
+			ret = -EIO;
+			break;
+		}
+	}
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0) {
+		fprintf(stderr, "Error sending dfu abort request\n");
+		ret = -EIO;
+	}
+	return ret;
+}
 
-		/* check if this is the last chunk */
-		if (p + chunk_size > dwElementSize)
-			chunk_size = dwElementSize - p;
+/* Checks the page shared by the chunks programmed in an earlier session
+ * and chunks[i], the first one to be programmed now. The part of this
+ * element already programmed must match the image, and the chunk must
+ * still be erased, otherwise the page is erased and programmed again.
+ * returns the chunk to continue from, negative on errors */
+static int dfuse_resume_check(struct dfu_if *dif, unsigned int dwElementAddress,
+			      unsigned char *data, struct dfuse_chunk *chunks,
+			      int i, int xfer_size)
+{
+	struct memsegment *segment;
+	unsigned int address = dwElementAddress + chunks[i].offset;
+	unsigned int page_start, start, end, a;
+	unsigned char *buf;
+	int j;
+	int ret;
 
-		/* Erase only for flash memory downloads */
-		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
-			/* erase all involved pages */
-			for (erase_address = address;
-			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
-				    (last_erased & ~(page_size - 1)))
-					dfuse_special_command(dif,
-							      erase_address,
-							      ERASE_PAGE);
-
-			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    (last_erased & ~(page_size - 1))) {
-				if (verbose > 2)
-					printf(" Chunk extends into next page,"
-					       " erase it as well\n");
-				dfuse_special_command(dif,
-						      address + chunk_size - 1,
-						      ERASE_PAGE);
+	resume_chunks = 0;	/* only checked once */
+	segment = find_segment(mem_layout, resume_last);
+	if (!segment || !(segment->memtype & DFUSE_ERASABLE))
+		return i;
+	page_start = page_of(segment, resume_last);
+
+	start = page_start > dwElementAddress ? page_start : dwElementAddress;
+	end = address;
+	if (chunks[i].segment == segment &&
+	    page_of(segment, address) == page_start)
+		end += chunks[i].size;
+	if (end <= start)
+		return i;
+
+	printf("Checking boundary page at 0x%08x\n", page_start);
+	buf = xfer_buf_alloc(end - start);
+	if (!buf)
+		return -ENOMEM;
+	ret = dfuse_read_memory(dif, start, end - start, buf, xfer_size);
+	if (ret < 0)
+		goto out_free;
+
+	for (a = start; a < end; a++) {
+		unsigned char expected = a < address ?
+					 data[a - dwElementAddress] : 0xff;
+
+		if (buf[a - start] != expected)
+			break;
+	}
+	if (a == end) {
+		ret = i;
+		goto out_free;
+	}
+
+	printf("Boundary page at 0x%08x must be programmed again\n",
+	       page_start);
+	if (page_start < dwElementAddress) {
+		fprintf(stderr, "Error: Can not resume inside this page, "
+			"please download without resume\n");
+		ret = -EINVAL;
+		goto out_free;
+	}
+	/* back to the first chunk of the page */
+	for (j = i; j > 0 && dwElementAddress + chunks[j - 1].offset >=
+	     page_start; j--)
+		;
+	chunk_index -= i - j;
+	ret = j;
+	if (dfuse_journal_truncate(chunk_index) < 0)
+		ret = -EIO;
+	/* make sure the page gets erased */
+	erased_remove(page_start);
+
+ out_free:
+	xfer_buf_free(buf);
+	return ret;
+}
+
+/* Sets the address pointer and downloads one chunk. After a transient
+ * error the chunk is read back, and sent again if the memory is still
+ * erased, or taken as done if it already holds the data.
+ * returns the chunk size on success */
+static int dfuse_write_chunk(struct dfu_if *dif, struct memsegment *segment,
+			     unsigned int address, unsigned char *data,
+			     int size, int xfer_size)
+{
+	unsigned char *buf;
+	int tries, reads;
+	int ret;
+
+	for (tries = 0; ; tries++) {
+		int block = 2;	/* for no address offset */
+
+		if ((quirks & QUIRK_SKIP_SET_ADDRESS) && !tries &&
+		    next_chunk_block && address == next_chunk_address)
+			block = next_chunk_block;
+		else
+			dfuse_special_command(dif, address, SET_ADDRESS);
+
+		if (plan) {
+			plan_write(address, data, size,
+				   plan_busy_ms(BUSY_PROGRAM, size));
+			ret = size;
+		} else {
+			ret = dfuse_dnload_chunk(dif, data, size, block);
+		}
+		next_chunk_block = 0;
+		/* the address is set again before block numbers wrap
+		 * around into the command blocks 0 and 1 */
+		if (ret == size && size == xfer_size && block < 0xffff) {
+			next_chunk_address = address + size;
+			next_chunk_block = block + 1;
+		}
+		if (ret >= 0 || tries >= DFU_RETRIES ||
+		    !dfu_transient_error(ret) ||
+		    dfu_resync(dif->dev_handle, dif->interface) < 0)
+			return ret;
+		dfu_retry_count++;
+		fprintf(stderr, "Retrying chunk at 0x%08x\n", address);
+
+		/* writing RAM again is harmless */
+		if (!(segment->memtype & DFUSE_ERASABLE))
+			continue;
+
+		buf = xfer_buf_alloc(size);
+		if (!buf)
+			return -ENOMEM;
+		for (reads = 0; reads <= DFU_RETRIES; reads++) {
+			ret = dfuse_read_memory(dif, address, size, buf,
+						xfer_size);
+			if (ret == 0 ||
+			    dfu_resync(dif->dev_handle, dif->interface) < 0)
+				break;
+			dfu_retry_count++;
+		}
+		if (ret == 0 && !memcmp(buf, data, size)) {
+			xfer_buf_free(buf);
+			return size;
+		}
+		if (ret == 0 && !is_erased(buf, size)) {
+			fprintf(stderr, "Error: Chunk at 0x%08x was partly "
+				"written\n", address);
+			ret = -EIO;
+		}
+		xfer_buf_free(buf);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+/* Cuts an element into the chunks it is downloaded in. Chunks end at
+ * multiples of the transfer size, at page and segment boundaries and at
+ * the end of the element, so an unaligned start or end of the element
+ * becomes a short head or tail chunk of its own, and each chunk lies in
+ * a single page. Pages smaller than the transfer size are the exception:
+ * there a chunk covers several whole pages.
+ * returns the number of chunks, negative on errors */
+static int dfuse_schedule_chunks(unsigned int dwElementAddress,
+				 unsigned int dwElementSize, int xfer_size,
+				 struct dfuse_chunk **chunks)
+{
+	struct dfuse_chunk *list = NULL;
+	unsigned int offset = 0;
+	int count = 0, allocated = 0;
+
+	while (offset < dwElementSize) {
+		struct memsegment *segment;
+		unsigned int address = dwElementAddress + offset;
+		unsigned int end = dwElementAddress + dwElementSize - 1;
+		unsigned int limit;
+
+		segment = find_segment(mem_layout, address);
+		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+			fprintf(stderr,
+				"Error: Page at 0x%08x is not writeable\n",
+				address);
+			exit(1);
+		}
+		/* the last byte of the chunk is the lowest of these limits */
+		limit = address - address % xfer_size + xfer_size - 1;
+		if (limit < address)	/* wrapped at the top */
+			limit = 0xffffffff;
+		if (end > limit)
+			end = limit;
+		if (end > segment->end)
+			end = segment->end;
+		if (segment->pagesize >= xfer_size) {
+			limit = page_of(segment, address) +
+				segment->pagesize - 1;
+			if (end > limit)
+				end = limit;
+		}
+
+		if (count == allocated) {
+			struct dfuse_chunk *more;
+
+			allocated = allocated ? allocated * 2 :
+				    dwElementSize / xfer_size + 2;
+			more = realloc(list, allocated * sizeof(*list));
+			if (!more) {
+				free(list);
+				return -ENOMEM;
+			}
+			list = more;
+		}
+		list[count].offset = offset;
+		list[count].size = end - address + 1;
+		list[count].segment = segment;
+		offset += list[count].size;
+		count++;
+	}
+	*chunks = list;
+	return count;
+}
+
+/* Erases the pages of the chunk not erased yet in this session */
+static void dfuse_erase_chunk(struct dfu_if *dif, unsigned int address,
+			      struct dfuse_chunk *chunk)
+{
+	struct memsegment *segment = chunk->segment;
+	unsigned int page = page_of(segment, address);
+	unsigned int last = address + chunk->size - 1;
+
+	for (; page >= segment->start && page <= last;
+	     page += segment->pagesize) {
+		if (erased_find(page, NULL))
+			continue;
+		dfuse_special_command(dif, page, ERASE_PAGE);
+		if (erased_add(page) < 0) {
+			fprintf(stderr, "Error: Out of memory\n");
+			exit(1);
+		}
+	}
+}
+
+/* Writes an element of any size to the device, taking care of page erases */
+/* returns 0 on success, otherwise -EINVAL */
+int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
+			 unsigned int dwElementSize, unsigned char *data,
+			 int xfer_size)
+{
+	struct dfuse_chunk *chunks;
+	struct dfuse_chunk *chunk;
+	int num_chunks;
+	int i;
+	int ret = 0;
+
+	num_chunks = dfuse_schedule_chunks(dwElementAddress, dwElementSize,
+					   xfer_size, &chunks);
+	if (num_chunks < 0) {
+		fprintf(stderr, "Could not allocate chunk list\n");
+		return num_chunks;
+	}
+
+	progress_start(PROGRESS_DOWNLOAD, dwElementSize);
+	for (i = 0; i < num_chunks; i++) {
+		unsigned int address;
+		int erasable;
+
+		if (resume_chunks && chunk_index == resume_chunks) {
+			i = dfuse_resume_check(dif, dwElementAddress, data,
+					       chunks, i, xfer_size);
+			if (i < 0) {
+				ret = i;
+				goto out_free;
+			}
+		}
+		chunk = &chunks[i];
+		address = dwElementAddress + chunk->offset;
+		erasable = chunk->segment->memtype & DFUSE_ERASABLE;
+
+		if (chunk_index < resume_chunks) {
+			/* erased and programmed in an earlier session */
+			chunk_index++;
+			resume_last = address + chunk->size - 1;
+			if (erasable &&
+			    erased_add(page_of(chunk->segment, address)) < 0) {
+				ret = -ENOMEM;
+				goto out_free;
 			}
+			progress_add(chunk->size);
+			continue;
 		}
 
-		if (verbose) {
+		/* Erase only for flash memory downloads */
+		if (erasable && !dfuse_mass_erase && !mass_erased)
+			dfuse_erase_chunk(dif, address, chunk);
+
+		if (verbose)
 			printf(" Download from image offset "
 			       "%08x to memory %08x-%08x, size %i\n",
-			       p, address, address + chunk_size - 1,
-			       chunk_size);
+			       chunk->offset, address,
+			       address + chunk->size - 1, chunk->size);
+
+		ret = dfuse_write_chunk(dif, chunk->segment, address,
+					data + chunk->offset, chunk->size,
+					xfer_size);
+		if (ret != chunk->size) {
+			fprintf(stderr, "Failed to write whole chunk: "
+				"%i of %i bytes\n", ret, chunk->size);
+			ret = -EINVAL;
+			goto out_free;
+		}
+		dfuse_journal_chunk_done(chunk_index++);
+		progress_add(chunk->size);
+	}
+	progress_finish();
+	ret = 0;
+
+ out_free:
+	free(chunks);
+	return ret;
+}
+
+static void verify_flush_range(struct verify_range *range)
+{
+	if (!range->pending)
+		return;
+	fprintf(stderr, "Verify mismatch at 0x%08x-0x%08x\n",
+		range->start, range->end);
+	range->pending = 0;
+}
+
+/* Compares one read back chunk against the image, page by page,
+ * and collects consecutive mismatching pages into ranges */
+static void verify_compare_chunk(unsigned int address, unsigned char *expected,
+				 unsigned char *actual, int size,
+				 struct verify_range *range)
+{
+	int offset = 0;
+
+	/* Most chunks match, so try a single compare of the whole chunk */
+	if (!memcmp(expected, actual, size)) {
+		if (address > range->end)
+			verify_flush_range(range);
+		return;
+	}
+
+	while (offset < size) {
+		struct memsegment *segment;
+		unsigned int page_start;
+		unsigned int page_end;
+		int slice;
+
+		segment = find_segment(mem_layout, address + offset);
+		if (segment && segment->pagesize > 0) {
+			page_start = page_of(segment, address + offset);
+			page_end = page_start + segment->pagesize - 1;
 		} else {
-			printf(".");
-			fflush(stdout);
+			page_start = address + offset;
+			page_end = address + size - 1;
 		}
-		
-		dfuse_special_command(dif, address, SET_ADDRESS);
+		slice = page_end - (address + offset) + 1;
+		if (slice > size - offset)
+			slice = size - offset;
+
+		if (memcmp(expected + offset, actual + offset, slice)) {
+			if (range->pending && range->end + 1 >= page_start) {
+				if (page_end > range->end) {
+					range->end = page_end;
+					range->count++;
+				}
+			} else {
+				verify_flush_range(range);
+				range->start = page_start;
+				range->end = page_end;
+				range->pending = 1;
+				range->count++;
+			}
+		} else if (page_start > range->end) {
+			verify_flush_range(range);
+		}
+		offset += slice;
+	}
+}
 
-		/* transaction = 2 for no address offset */
-		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
-		if (ret != chunk_size) {
-			fprintf(stderr, "Failed to write whole chunk: "
-				"%i of %i bytes\n", ret, chunk_size);
-			return -EINVAL;
+/* Reads back an element from the device and compares it to the image
+ * returns 0 if the memory matches, -EIO otherwise */
+static int dfuse_verify_element(struct dfu_if *dif,
+				unsigned int dwElementAddress,
+				unsigned int dwElementSize, unsigned char *data,
+				int xfer_size, struct verify_range *range)
+{
+	unsigned char *buf;
+	int transaction;
+	int p;
+	int ret = 0;
+
+	if (plan) {
+		plan_add(PLAN_VERIFY, dwElementAddress, dwElementSize, 0);
+		return 0;
+	}
+
+	buf = xfer_buf_alloc(xfer_size);
+	if (!buf)
+		return -ENOMEM;
+
+	if (verbose)
+		printf(" Verifying memory %08x-%08x\n", dwElementAddress,
+		       dwElementAddress + dwElementSize - 1);
+
+	dfuse_special_command(dif, dwElementAddress, SET_ADDRESS);
+
+	progress_start(PROGRESS_VERIFY, dwElementSize);
+	transaction = 2;
+	for (p = 0; p < dwElementSize; p += xfer_size) {
+		int chunk_size = xfer_size;
+		int rc;
+
+		if (p + chunk_size > dwElementSize)
+			chunk_size = dwElementSize - p;
+
+		transaction = dfuse_upload_block(dif, dwElementAddress + p,
+						 transaction);
+		if (transaction < 0) {
+			ret = transaction;
+			break;
 		}
+		rc = dfuse_upload(dif, chunk_size, buf, transaction++);
+		if (rc < chunk_size) {
+			fprintf(stderr, "Error: Short read back at 0x%08x\n",
+				dwElementAddress + p);
+			ret = -EIO;
+			break;
+		}
+		verify_compare_chunk(dwElementAddress + p, data + p, buf,
+				     chunk_size, range);
+		progress_add(chunk_size);
 	}
-	if (!verbose)
-		printf("\n"); /* terminate line of dots */
-	return 0;
+	if (!ret)
+		progress_finish();
+	verify_flush_range(range);
+
+	/* Leave dfuUPLOAD-IDLE so that further commands are accepted */
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0) {
+		fprintf(stderr, "Error sending dfu abort request\n");
+		ret = -EIO;
+	}
+	xfer_buf_free(buf);
+
+	if (!ret && range->count)
+		ret = -EIO;
+	return ret;
+}
+
+/* Verifies all elements in the list */
+static int dfuse_verify_elements(struct dfu_if *dif,
+				 struct dfu_element *list, int xfer_size)
+{
+	struct verify_range range;
+	int ret = 0;
+
+	memset(&range, 0, sizeof(range));
+	printf("Verifying written memory\n");
+	for (; list && !ret; list = list->next)
+		ret = dfuse_verify_element(dif, list->address, list->size,
+					   list->data, xfer_size, &range);
+	if (range.count)
+		fprintf(stderr, "Verify failed: %i mismatching pages\n",
+			range.count);
+	else if (!ret && !plan)
+		printf("Verify successful\n");
+	return ret;
 }
 
 /* Download raw binary file to DfuSe device */
@@ -489,21 +1502,45 @@ int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
 	int ret;
 
 	dwElementAddress = start_address;
-	dwElementSize = file.size;
-	printf("Downloading to address = 0x%08x, size = %i\n",
-	       dwElementAddress, dwElementSize);
+	if (file.stream) {
+		off_t size;
 
-	data = malloc(dwElementSize);
-	if (!data) {
-		fprintf(stderr, "Could not allocate data buffer\n");
-		return -ENOMEM;
+		/* the whole element is needed for erasing and verifying */
+		data = stream_read_all(&file, &size);
+		if (!data)
+			return -EIO;
+		if (file.stream->suffix.bcdDFU == 0x11a) {
+			fprintf(stderr, "Error: %s is a DfuSe file, not meant "
+				"for raw download\n", file.name);
+			free(data);
+			return -EINVAL;
+		}
+		if (size > 0xffffffffLL - start_address) {
+			fprintf(stderr, "Error: %s does not fit at 0x%08x\n",
+				file.name, start_address);
+			free(data);
+			return -EFBIG;
+		}
+		dwElementSize = size;
+		read_bytes = size;
+	} else {
+		dwElementSize = file.size;
+		data = xfer_buf_alloc(dwElementSize);
+		if (!data) {
+			fprintf(stderr, "Could not allocate data buffer\n");
+			return -ENOMEM;
+		}
 	}
-	ret = fread(data, 1, dwElementSize, file.filep);
-	read_bytes += ret;
-	if (ret < dwElementSize) {
-		fprintf(stderr, "Could not read data\n");
-		ret = -EINVAL;
-		goto out_free;
+	printf("Downloading to address = 0x%08x, size = %i\n",
+	       dwElementAddress, dwElementSize);
+	if (!file.stream) {
+		ret = fread(data, 1, dwElementSize, file.filep);
+		read_bytes += ret;
+		if (ret < dwElementSize) {
+			fprintf(stderr, "Could not read data\n");
+			ret = -EINVAL;
+			goto out_free;
+		}
 	}
 
 	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
@@ -511,39 +1548,279 @@ int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
 	if (ret != 0)
 		goto out_free;
 
-	if (read_bytes != file.size) {
-		fprintf(stderr, "Warning: Read %i bytes, file size %li\n",
-			read_bytes, file.size);
+	if (verify) {
+		struct verify_range range;
+
+		memset(&range, 0, sizeof(range));
+		printf("Verifying written memory\n");
+		ret = dfuse_verify_element(dif, dwElementAddress,
+					   dwElementSize, data, xfer_size,
+					   &range);
+		if (ret != 0) {
+			fprintf(stderr, "Verify failed: %i mismatching "
+				"pages\n", range.count);
+			goto out_free;
+		}
+		if (!plan)
+			printf("Verify successful\n");
 	}
-	printf("File downloaded successfully\n");
+
+	if (!file.stream && read_bytes != file.size) {
+		fprintf(stderr, "Warning: Read %i bytes, file size %lli\n",
+			read_bytes, (long long) file.size);
+	}
+	if (!plan)
+		printf("File downloaded successfully\n");
 	ret = read_bytes;
 
  out_free:
-	free(data);
+	if (file.stream)
+		free(data);
+	else
+		xfer_buf_free(data);
 	return ret;
 }
 
+/* Element with its position in the image */
+struct element_ref {
+	struct dfu_element *el;
+	int index;
+};
+
+static int compare_element_address(const void *a, const void *b)
+{
+	const struct element_ref *ra = a, *rb = b;
+
+	if (ra->el->address != rb->el->address)
+		return ra->el->address < rb->el->address ? -1 : 1;
+	return ra->index - rb->index;
+}
+
+static int compare_element_index(const void *a, const void *b)
+{
+	return ((const struct element_ref *)a)->index -
+	       ((const struct element_ref *)b)->index;
+}
+
+/* Tells if the gap after the byte at last up to next is better filled
+ * than skipped: it is shorter than a transfer, which costs about as much
+ * as the SET_ADDRESS command it saves, and lies within one erasable page
+ * that is erased anyway, so writing 0xff there changes nothing */
+static int dfuse_gap_fillable(unsigned int last, unsigned int next,
+			      int xfer_size)
+{
+	struct memsegment *segment;
+
+	if (next - last - 1 >= (unsigned int)xfer_size)
+		return 0;
+	segment = find_segment(mem_layout, last);
+	if (!segment || !(segment->memtype & DFUSE_ERASABLE) ||
+	    next > segment->end)
+		return 0;
+	return page_of(segment, last) == page_of(segment, next);
+}
+
+/* Sorts the elements by address and merges those that overlap, adjoin
+ * or have a fillable gap between them, so the device sees as few
+ * SET_ADDRESS commands and short chunks as possible. Where elements
+ * overlap the one later in the image wins, as it was written last.
+ * Empty elements are dropped.
+ * returns the number of elements left, negative on errors */
+static int dfuse_coalesce_elements(struct dfu_element **list, int xfer_size)
+{
+	struct element_ref *refs;
+	struct dfu_element *el, *merged;
+	struct dfu_element **tail = list;
+	int count = 0, merges = 0;
+	int n = 0;
+	int i, j, k;
+
+	for (el = *list; el; el = el->next)
+		n++;
+	if (n < 2)
+		return n;
+
+	refs = malloc(n * sizeof(*refs));
+	if (!refs)
+		return -ENOMEM;
+	for (el = *list, i = 0; el; el = el->next, i++) {
+		refs[i].el = el;
+		refs[i].index = i;
+	}
+	qsort(refs, n, sizeof(*refs), compare_element_address);
+
+	*list = NULL;
+	for (i = 0; i < n; i = j) {
+		unsigned int start = refs[i].el->address;
+		unsigned int last = start + refs[i].el->size - 1;
+
+		if (!refs[i].el->size) {
+			j = i + 1;
+			free(refs[i].el->data);
+			free(refs[i].el);
+			continue;
+		}
+		for (j = i + 1; j < n; j++) {
+			unsigned int address = refs[j].el->address;
+
+			if (!refs[j].el->size)
+				continue;
+			if (address <= last) {
+				printf("Warning: Elements overlap at 0x%08x, "
+				       "using the later one\n", address);
+			} else if (address - last != 1 &&
+				   !dfuse_gap_fillable(last, address,
+						       xfer_size)) {
+				break;
+			}
+			if (address + refs[j].el->size - 1 > last)
+				last = address + refs[j].el->size - 1;
+		}
+
+		if (j - i == 1) {
+			el = refs[i].el;
+		} else {
+			el = malloc(sizeof(*el));
+			if (el)
+				el->data = malloc(last - start + 1);
+			if (!el || !el->data) {
+				free(el);
+				/* put the rest back to be freed */
+				for (k = i; k < n; k++) {
+					*tail = refs[k].el;
+					tail = &refs[k].el->next;
+				}
+				*tail = NULL;
+				free(refs);
+				return -ENOMEM;
+			}
+			el->address = start;
+			el->size = last - start + 1;
+			memset(el->data, 0xff, el->size);
+			qsort(refs + i, j - i, sizeof(*refs),
+			      compare_element_index);
+			for (k = i; k < j; k++) {
+				merged = refs[k].el;
+				memcpy(el->data + (merged->address - start),
+				       merged->data, merged->size);
+				free(merged->data);
+				free(merged);
+			}
+			merges += j - i - 1;
+			if (verbose)
+				printf("Merged %i elements into 0x%08x-0x%08x\n",
+				       j - i, start, last);
+		}
+		*tail = el;
+		tail = &el->next;
+		count++;
+	}
+	*tail = NULL;
+	free(refs);
+
+	if (merges)
+		printf("Downloading %i elements after merging %i\n",
+		       count, merges);
+	return count;
+}
+
+/* Reads the elements of a DfuSe image into a list
+ * returns 0 on success, negative on errors */
+static int dfuse_read_elements(struct dfu_file *file, int dwNbElements,
+			       int *read_bytes, struct dfu_element **list)
+{
+	char elementheader[8];
+	struct dfu_element **tail = list;
+	struct dfu_element *el;
+	int element;
+	int ret;
+
+	*list = NULL;
+	for (element = 1; element <= dwNbElements; element++) {
+		printf("parsing element %i, ", element);
+		ret = fread(elementheader, 1, sizeof(elementheader),
+			    file->filep);
+		*read_bytes += ret;
+		if (ret < sizeof(elementheader)) {
+			fprintf(stderr, "Could not read element header\n");
+			return -EINVAL;
+		}
+		el = malloc(sizeof(*el));
+		if (!el)
+			return -ENOMEM;
+		el->address = quad2uint((unsigned char *)elementheader);
+		el->size = quad2uint((unsigned char *)elementheader + 4);
+		el->data = NULL;
+		el->next = NULL;
+		*tail = el;
+		tail = &el->next;
+		printf("address = 0x%08x, ", el->address);
+		printf("size = %i\n", el->size);
+
+		/* sanity check */
+		if (*read_bytes + el->size + file->suffixlen > file->size) {
+			fprintf(stderr, "File too small for element size\n");
+			return -EINVAL;
+		}
+		el->data = malloc(el->size ? el->size : 1);
+		if (!el->data) {
+			fprintf(stderr, "Could not allocate data buffer\n");
+			return -ENOMEM;
+		}
+		ret = fread(el->data, 1, el->size, file->filep);
+		*read_bytes += ret;
+		if (ret < el->size) {
+			fprintf(stderr, "Could not read data\n");
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* Downloads the elements one after another, after merging them
+ * returns the number of bytes written, negative on errors */
+static int dfuse_dnload_elements(struct dfu_if *dif, struct dfu_element **list,
+				 int xfer_size)
+{
+	struct dfu_element *el;
+	int bytes = 0;
+	int ret;
+
+	ret = dfuse_coalesce_elements(list, xfer_size);
+	if (ret < 0) {
+		fprintf(stderr, "Could not merge elements\n");
+		return ret;
+	}
+	for (el = *list; el; el = el->next) {
+		ret = dfuse_dnload_element(dif, el->address, el->size,
+					   el->data, xfer_size);
+		if (ret != 0)
+			return ret;
+		bytes += el->size;
+	}
+	return bytes;
+}
+
 /* Parse a DfuSe file and download contents to device */
 int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 			  struct dfu_file file)
 {
 	char dfuprefix[11];
 	char targetprefix[274];
-	char elementheader[8];
 	int image;
-	int element;
 	int bTargets;
 	int bAlternateSetting;
 	int dwNbElements;
-	unsigned int dwElementAddress;
-	unsigned int dwElementSize;
 	unsigned char *data;
+	struct dfu_element *elements = NULL;
+	struct dfu_element *written = NULL;
+	struct dfu_element **written_tail = &written;
 	int read_bytes = 0;
 	int ret;
 
 	/* Must be larger than a minimal DfuSe header and suffix */
 	if (file.size <= sizeof(dfuprefix) + file.suffixlen +
-	    sizeof(targetprefix) + sizeof(elementheader)) {
+	    sizeof(targetprefix) + 8) {
 		fprintf(stderr, "File too small for a DfuSe file\n");
 		return -EINVAL;
 	}
@@ -572,11 +1849,13 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 		read_bytes += ret;
 		if (ret < sizeof(targetprefix)) {
 			fprintf(stderr, "Could not read DFU header\n");
-			return -EIO;
+			ret = -EIO;
+			goto out_verify;
 		}
 		if (strncmp(targetprefix, "Target", 6)) {
 			fprintf(stderr, "No valid target signature\n");
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out_verify;
 		}
 		bAlternateSetting = targetprefix[6];
 		dwNbElements = quad2uint((unsigned char *)targetprefix + 270);
@@ -589,55 +1868,40 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 			       " setting.\n"
 			       "Please rerun with the correct -a option setting"
 			       " to download this image!\n");
-		for (element = 1; element <= dwNbElements; element++) {
-			printf("parsing element %i, ", element);
-			ret = fread(elementheader, 1, sizeof(elementheader),
-				    file.filep);
-			read_bytes += ret;
-			if (ret < sizeof(elementheader)) {
-				fprintf(stderr,
-					"Could not read element header\n");
-				return -EINVAL;
-			}
-			dwElementAddress =
-			    quad2uint((unsigned char *)elementheader);
-			dwElementSize =
-			    quad2uint((unsigned char *)elementheader + 4);
-			printf("address = 0x%08x, ", dwElementAddress);
-			printf("size = %i\n", dwElementSize);
-
-			/* sanity check */
-			if (read_bytes + dwElementSize + file.suffixlen >
-			    file.size) {
-				fprintf(stderr,
-					"File too small for element size\n");
-				return -EINVAL;
-			}
-			data = malloc(dwElementSize);
-			if (!data) {
-				fprintf(stderr,
-					"Could not allocate data buffer\n");
-				return -ENOMEM;
-			}
-			ret = fread(data, 1, dwElementSize, file.filep);
-			read_bytes += ret;
-			if (ret < dwElementSize) {
-				fprintf(stderr, "Could not read data\n");
-				free(data);
-				return -EIO;
-			}
 
-			if (bAlternateSetting == dif->altsetting)
-				ret =
-				    dfuse_dnload_element(dif, dwElementAddress,
-							 dwElementSize, data,
-							 xfer_size);
-			else
-				ret = 0;
-			free(data);
-			if (ret != 0)
-				return ret;
+		/* The whole image is read first so that its elements can
+		 * be sorted and merged */
+		ret = dfuse_read_elements(&file, dwNbElements, &read_bytes,
+					  &elements);
+		if (ret < 0)
+			goto out_verify;
+		if (bAlternateSetting != dif->altsetting) {
+			free_element_list(elements);
+			elements = NULL;
+			continue;
+		}
+		ret = dfuse_dnload_elements(dif, &elements, xfer_size);
+		if (ret < 0)
+			goto out_verify;
+
+		/* Keep written elements around until they have been
+		 * read back, a later image may share their pages */
+		if (verify) {
+			*written_tail = elements;
+			while (*written_tail)
+				written_tail = &(*written_tail)->next;
+		} else {
+			free_element_list(elements);
 		}
+		elements = NULL;
+	}
+
+	if (verify) {
+		ret = dfuse_verify_elements(dif, written, xfer_size);
+		free_element_list(written);
+		written = NULL;
+		if (ret != 0)
+			return ret;
 	}
 
 	/* Just for book-keeping, read through the whole file */
@@ -655,27 +1919,437 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 	read_bytes += ret;
 
 	if (read_bytes != file.size) {
-		fprintf(stderr, "Warning: Read %i bytes, file size %li\n",
-			read_bytes, file.size);
+		fprintf(stderr, "Warning: Read %i bytes, file size %lli\n",
+			read_bytes, (long long) file.size);
 	}
 
 	printf("done parsing DfuSe file\n");
 	return read_bytes;
+
+ out_verify:
+	free_element_list(elements);
+	free_element_list(written);
+	return ret;
+}
+
+/* Download Intel HEX, S-record or ELF file to DfuSe device.
+ * Only the addresses covered by data records are erased and written. */
+int dfuse_do_sparse_dnload(struct dfu_if *dif, int xfer_size,
+			   struct dfu_file file, enum dfu_file_format format)
+{
+	struct dfu_element *list, *el;
+	int bytes;
+	int ret;
+
+	ret = load_sparse_image(&file, format, &list);
+	if (ret < 0)
+		return ret;
+	printf("%s file contains %i elements\n",
+	       file_format_to_string(format), ret);
+	for (el = list; el; el = el->next)
+		printf("element at address = 0x%08x, size = %i\n",
+		       el->address, el->size);
+
+	bytes = dfuse_dnload_elements(dif, &list, xfer_size);
+	if (bytes < 0) {
+		ret = bytes;
+		goto out_free;
+	}
+
+	if (verify) {
+		ret = dfuse_verify_elements(dif, list, xfer_size);
+		if (ret != 0)
+			goto out_free;
+	}
+	if (!plan)
+		printf("File downloaded successfully\n");
+	ret = bytes;
+
+ out_free:
+	free_element_list(list);
+	return ret;
+}
+
+static int add_range(struct dfu_element ***tail, unsigned int address,
+		     unsigned int size)
+{
+	struct dfu_element *el = calloc(1, sizeof(*el));
+
+	if (!el)
+		return -ENOMEM;
+	el->address = address;
+	el->size = size;
+	**tail = el;
+	*tail = &el->next;
+	return 0;
+}
+
+/* Lists the address ranges a download of file will write, without their
+ * data, leaving the file position at the start */
+static int dfuse_image_ranges(struct dfu_if *dif, struct dfu_file *file,
+			      enum dfu_file_format format,
+			      struct dfu_element **list)
+{
+	struct dfu_element **tail = list;
+	unsigned char prefix[274];
+	int targets, elements;
+	int alt;
+	int ret = 0;
+
+	*list = NULL;
+	if (format != DFU_FORMAT_RAW && file->bcdDFU != 0x11a) {
+		ret = load_sparse_image(file, format, list);
+		return ret < 0 ? ret : 0;
+	}
+	if (file->bcdDFU != 0x11a) {
+		if (!dfuse_address)
+			return -EINVAL;
+		return add_range(&tail, dfuse_address, file->size);
+	}
+
+	/* walk the DfuSe file headers, skipping the element data */
+	if (fread(prefix, 1, 11, file->filep) < 11 ||
+	    strncmp((char *) prefix, "DfuSe", 5)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (targets = prefix[10]; targets > 0 && !ret; targets--) {
+		if (fread(prefix, 1, sizeof(prefix), file->filep) <
+		    sizeof(prefix)) {
+			ret = -EINVAL;
+			break;
+		}
+		alt = prefix[6];
+		for (elements = quad2uint(prefix + 270); elements > 0;
+		     elements--) {
+			unsigned int address, size;
+
+			if (fread(prefix, 1, 8, file->filep) < 8) {
+				ret = -EINVAL;
+				break;
+			}
+			address = quad2uint(prefix);
+			size = quad2uint(prefix + 4);
+			if (alt == dif->altsetting)
+				ret = add_range(&tail, address, size);
+			if (ret < 0 || fseek(file->filep, size, SEEK_CUR)) {
+				ret = ret < 0 ? ret : -EIO;
+				break;
+			}
+		}
+	}
+ out:
+	rewind(file->filep);
+	if (ret < 0) {
+		free_element_list(*list);
+		*list = NULL;
+	}
+	return ret;
+}
+
+/* Compares the estimated times of erasing the image's pages and of a mass
+ * erase, returns 1 if the mass erase is faster and allowed */
+static int dfuse_choose_erase(struct dfu_if *dif, struct dfu_file *file,
+			      enum dfu_file_format format)
+{
+	struct dfu_element *ranges;
+	struct erase_estimate est;
+	int poll_timeout = poll_timeout_now(dif);
+	int ret;
+
+	ret = dfuse_image_ranges(dif, file, format, &ranges);
+	if (ret >= 0) {
+		ret = dfuse_erase_estimate(mem_layout, ranges, poll_timeout,
+					   &est);
+		free_element_list(ranges);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Warning: Cannot estimate erase times, "
+			"erasing page by page\n");
+		return 0;
+	}
+
+	printf("Erase estimate: %i pages in %li ms, mass erase in %li ms\n",
+	       est.pages, est.pages_ms, est.mass_ms);
+	/* the estimates are rough, only a clear gain is worth clearing
+	 * memory the image does not cover */
+	if (est.mass_ms > est.pages_ms) {
+		printf("Erasing page by page, saving about %li ms\n",
+		       est.mass_ms - est.pages_ms);
+		return 0;
+	}
+	if (est.mass_ms >= est.pages_ms * (100 - DFUSE_MASS_ERASE_GAIN) / 100) {
+		printf("Erasing page by page, a mass erase would save only "
+		       "%li ms\n", est.pages_ms - est.mass_ms);
+		return 0;
+	}
+	if (!dfuse_force) {
+		printf("A mass erase would save about %li ms, but clears all "
+		       "flash and needs force\n", est.pages_ms - est.mass_ms);
+		return 0;
+	}
+	printf("Using mass erase, saving about %li ms\n",
+	       est.pages_ms - est.mass_ms);
+	return 1;
+}
+
+/* Reads back the chunks written from a compiled plan and compares their
+ * CRCs, reading adjoining chunks in one go
+ * returns 0 on success, negative on errors or mismatches */
+static int dfuse_verify_plan(struct dfu_if *dif, struct plan_record *chunks,
+			     int count, int xfer_size)
+{
+	unsigned char *buf;
+	int mismatches = 0;
+	int i, j, k;
+	int ret = 0;
+
+	printf("Verifying written memory\n");
+	for (i = 0; i < count && !ret; i = j) {
+		unsigned int start = chunks[i].address;
+		unsigned int end = start + chunks[i].size;
+
+		for (j = i + 1; j < count && chunks[j].address == end; j++)
+			end += chunks[j].size;
+		if (verbose)
+			printf(" Verifying memory %08x-%08x\n", start, end - 1);
+
+		buf = xfer_buf_alloc(end - start);
+		if (!buf)
+			return -ENOMEM;
+		ret = dfuse_read_memory(dif, start, end - start, buf,
+					xfer_size);
+		for (k = i; k < j && !ret; k++) {
+			if (crc32_buf(0xffffffff, buf + chunks[k].address -
+				      start, chunks[k].size) == chunks[k].crc)
+				continue;
+			fprintf(stderr, "Mismatch in chunk at 0x%08x\n",
+				chunks[k].address);
+			mismatches++;
+		}
+		xfer_buf_free(buf);
+	}
+	if (ret < 0)
+		return ret;
+	if (mismatches) {
+		fprintf(stderr, "Verify failed: %i mismatching chunks\n",
+			mismatches);
+		return -EIO;
+	}
+	printf("Verify successful\n");
+	return 0;
+}
+
+/* Downloads a plan compiled with --compile-plan, after checking that it
+ * was made for this device model, memory layout and transfer size. The
+ * records are carried out as they are read, nothing is planned again.
+ * returns the number of bytes written, negative on errors */
+static int dfuse_do_plan_dnload(struct dfu_if *dif, int xfer_size,
+				struct dfu_file *file)
+{
+	struct plan_header header;
+	struct plan_record record;
+	struct plan_record *chunks = NULL;
+	struct memsegment *segment;
+	unsigned char *buf;
+	int num_chunks = 0, allocated = 0;
+	int leave = 0;
+	int bytes = 0;
+	int started = 0;
+	int ret;
+
+	/* the suffix CRC covers the whole plan, check it before erasing */
+	if (file->bcdDFU != 0x11a) {
+		fprintf(stderr, "Error: Plan has no valid DFU suffix, it may "
+			"be damaged\n");
+		return -EINVAL;
+	}
+	ret = plan_read_header(file, &header);
+	if (ret < 0)
+		return ret;
+	if (header.idVendor != dif->vendor || header.idProduct != dif->product ||
+	    header.bcdDevice != dif->bcdDevice) {
+		fprintf(stderr, "Error: Plan was compiled for device "
+			"%04x:%04x version %04x\n", header.idVendor,
+			header.idProduct, header.bcdDevice);
+		ret = -EINVAL;
+	} else if (strcmp(header.layout, (char *)dif->alt_name)) {
+		fprintf(stderr, "Error: Plan was compiled for memory layout "
+			"\"%s\"\n", header.layout);
+		ret = -EINVAL;
+	} else if (header.xfer_size != xfer_size) {
+		fprintf(stderr, "Error: Plan was compiled for transfer size "
+			"%i\n", header.xfer_size);
+		ret = -EINVAL;
+	}
+	free(header.layout);
+	if (ret < 0)
+		return ret;
+	printf("Plan for an image of %u bytes with CRC 0x%08x\n",
+	       header.image_size, header.image_crc);
+
+	buf = xfer_buf_alloc(xfer_size);
+	if (!buf)
+		return -ENOMEM;
+
+	while ((ret = plan_read_record(file, &record)) == 0 &&
+	       record.type != PLAN_RECORD_END) {
+		switch (record.type) {
+		case PLAN_RECORD_ERASE:
+			dfuse_special_command(dif, record.address, ERASE_PAGE);
+			break;
+		case PLAN_RECORD_MASS_ERASE:
+			dfuse_do_mass_erase(dif);
+			break;
+		case PLAN_RECORD_LEAVE:
+			leave = 1;
+			break;
+		case PLAN_RECORD_WRITE:
+			if (record.size > xfer_size ||
+			    fread(buf, 1, record.size, file->filep) <
+			    record.size ||
+			    crc32_buf(0xffffffff, buf, record.size) !=
+			    record.crc) {
+				fprintf(stderr, "Error: Corrupt chunk for "
+					"0x%08x in plan\n", record.address);
+				ret = -EINVAL;
+				goto out_free;
+			}
+			segment = find_segment(mem_layout, record.address);
+			if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+				fprintf(stderr, "Error: Page at 0x%08x is not "
+					"writeable\n", record.address);
+				ret = -EINVAL;
+				goto out_free;
+			}
+			/* after a mass erase and its message */
+			if (!started) {
+				progress_start(PROGRESS_DOWNLOAD, header.bytes);
+				started = 1;
+			}
+			if (verbose)
+				printf(" Download to memory %08x-%08x, "
+				       "size %i\n", record.address,
+				       record.address + record.size - 1,
+				       record.size);
+			ret = dfuse_write_chunk(dif, segment, record.address,
+						buf, record.size, xfer_size);
+			if (ret != record.size) {
+				fprintf(stderr, "Failed to write whole chunk: "
+					"%i of %i bytes\n", ret, record.size);
+				ret = -EINVAL;
+				goto out_free;
+			}
+			bytes += record.size;
+			progress_add(record.size);
+			if (!verify)
+				break;
+			if (num_chunks == allocated) {
+				struct plan_record *more;
+
+				allocated = allocated ? allocated * 2 : 64;
+				more = realloc(chunks,
+					       allocated * sizeof(*chunks));
+				if (!more) {
+					ret = -ENOMEM;
+					goto out_free;
+				}
+				chunks = more;
+			}
+			chunks[num_chunks++] = record;
+			break;
+		default:
+			fprintf(stderr, "Error: Unknown record type %i in "
+				"plan\n", record.type);
+			ret = -EINVAL;
+			goto out_free;
+		}
+	}
+	if (ret < 0)
+		goto out_free;
+	if (started)
+		progress_finish();
+
+	if (verify) {
+		ret = dfuse_verify_plan(dif, chunks, num_chunks, xfer_size);
+		if (ret < 0)
+			goto out_free;
+	}
+	printf("File downloaded successfully\n");
+	if (leave)
+		dfuse_do_leave(dif);
+	ret = bytes;
+
+ out_free:
+	free(chunks);
+	xfer_buf_free(buf);
+	return ret;
 }
 
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 		    const char *dfuse_options)
 {
+	enum dfu_file_format format;
 	int ret;
 
+	/* addresses and element sizes are only 32 bits wide */
+	if (file.size - file.suffixlen > 0xffffffffLL) {
+		fprintf(stderr, "Error: %s is too large for a DfuSe device\n",
+			file.name);
+		return -EFBIG;
+	}
+	dfuse_reset_options();
+	/* a stream can not be looked at before it is downloaded */
+	format = file.stream ? DFU_FORMAT_RAW : detect_file_format(&file);
+	if (format == DFU_FORMAT_PLAN && plan) {
+		fprintf(stderr, "Error: A compiled plan can not be planned "
+			"again\n");
+		return -EINVAL;
+	}
+	if (format == DFU_FORMAT_PLAN && dfuse_options) {
+		fprintf(stderr, "Warning: Ignoring address and modifiers, the "
+			"plan provides its own\n");
+		dfuse_options = NULL;
+	}
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
-	mem_layout = parse_memory_layout((char *)dif->alt_name);
+	/* a raw binary can start like a HEX or S-record file by chance,
+	 * an address given means the file is to be written as is */
+	if (dfuse_address && format != DFU_FORMAT_RAW &&
+	    format != DFU_FORMAT_PLAN) {
+		printf("Downloading %s as raw binary to 0x%08x, not as %s "
+		       "file\n", file.name, dfuse_address,
+		       file_format_to_string(format));
+		format = DFU_FORMAT_RAW;
+	}
+	if (file.stream && !dfuse_address) {
+		fprintf(stderr, "Error: Only raw binary images can be "
+			"streamed, give an address\n");
+		return -EINVAL;
+	}
+	if (file.stream && (dfuse_resume || plan_compiling())) {
+		fprintf(stderr, "Error: Streamed images can not be "
+			"resumed or compiled into a plan\n");
+		return -EINVAL;
+	}
+	if (file.stream && dfuse_auto_erase) {
+		printf("Image size not known in advance, erasing page by "
+		       "page\n");
+		dfuse_auto_erase = 0;
+	}
+	mem_layout = dfuse_memory_layout(dif);
 	if (!mem_layout) {
 		fprintf(stderr, "Error: Failed to parse memory layout\n");
 		exit(1);
 	}
+	if (format == DFU_FORMAT_PLAN)
+		return dfuse_do_plan_dnload(dif, xfer_size, &file);
 	if (dfuse_unprotect) {
+		if (plan_compiling()) {
+			fprintf(stderr, "Error: Read unprotect can not be "
+				"compiled into a plan\n");
+			exit(1);
+		}
 		if (!dfuse_force) {
 			fprintf(stderr, "Error: The read unprotect command "
 				"will erase the flash memory\n"
@@ -683,48 +2357,101 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 			exit(1);
 		}
 		dfuse_special_command(dif, 0, READ_UNPROTECT);
+		if (plan)
+			return 0;
 		printf("Device disconnects, erases flash and resets now\n");
 		exit(0);
 	}
-	if (dfuse_mass_erase) {
+	/* before anything is erased or the journal is rewritten */
+	if (dfuse_address && file.bcdDFU == 0x11a) {
+		fprintf(stderr, "Error: This is a DfuSe file, not "
+			"meant for raw download\n");
+		return -EINVAL;
+	}
+	if (!dfuse_address && format == DFU_FORMAT_RAW &&
+	    file.bcdDFU != 0x11a) {
+		fprintf(stderr, "Error: Only DfuSe file version 1.1a "
+			"is supported\n");
+		fprintf(stderr, "(for raw binary download, use the "
+			"--dfuse-address option,\n Intel HEX, S-record "
+			"and ELF files are detected automatically)\n");
+		return -EINVAL;
+	}
+	if (dfuse_resume && plan) {
+		printf("Planning the whole download, the journal is not "
+		       "used\n");
+	} else if (dfuse_resume) {
+		resume_chunks = dfuse_journal_open(dif, &file, xfer_size);
+		if (resume_chunks < 0)
+			exit(1);
+		if (resume_chunks)
+			printf("Resuming download after %i chunks programmed "
+			       "earlier\n", resume_chunks);
+	}
+	if (plan_compiling() && plan_compile_start(dif, &file) < 0)
+		exit(1);
+	/* a mass erase would also clear what earlier downloads of the
+	 * session wrote */
+	if (dfuse_auto_erase && !dfuse_mass_erase && !resume_chunks &&
+	    !mass_erased && !num_erased)
+		dfuse_mass_erase = dfuse_choose_erase(dif, &file, format);
+	if (dfuse_mass_erase && resume_chunks) {
+		printf("Skipping mass erase when resuming a download\n");
+	} else if (dfuse_mass_erase) {
 		if (!dfuse_force) {
 			fprintf(stderr, "Error: The mass erase command "
 				"can only be used with force\n");
 			exit(1);
 		}
-		printf("Performing mass erase, this can take a moment\n");
-		dfuse_special_command(dif, 0, MASS_ERASE);
+		dfuse_do_mass_erase(dif);
 	}
-	if (dfuse_address) {
-		if (file.bcdDFU == 0x11a) {
-			fprintf(stderr, "Error: This is a DfuSe file, not "
-				"meant for raw download\n");
-			return -EINVAL;
-		}
+	if (format != DFU_FORMAT_RAW && file.bcdDFU != 0x11a) {
+		ret = dfuse_do_sparse_dnload(dif, xfer_size, file, format);
+	} else if (dfuse_address) {
 		ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
 	} else {
-		if (file.bcdDFU != 0x11a) {
-			fprintf(stderr, "Error: Only DfuSe file version 1.1a "
-				"is supported\n");
-			fprintf(stderr, "(for raw binary download, use the "
-				"--dfuse-address option)\n");
-			return -EINVAL;
-		}
 		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
 	}
-	free_segment_list(mem_layout);
+	dfuse_journal_close(ret >= 0);
 
-	if (dfuse_leave) {
-		int ret2;
-		struct dfu_status dst;
+	if (dfuse_leave)
+		dfuse_do_leave(dif);
+	if (plan_compile_finish(dif, ret >= 0) < 0)
+		ret = -EIO;
+	return ret;
+}
 
-		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
-		ret2 = dfu_get_status(dif->dev_handle, dif->interface, &dst);
-		if (ret2 < 0)
-			fprintf(stderr, "Error during download get_status\n");
-		if (verbose)
-			printf("bState = %i and bStatus = %i\n",
-			       dst.bState, dst.bStatus);
+int dfuse_do_mass_erase(struct dfu_if *dif)
+{
+	int ret;
+
+	printf("Performing mass erase, this can take a moment\n");
+	ret = dfuse_special_command(dif, 0, MASS_ERASE);
+	if (ret >= 0) {
+		/* later downloads of the session need no page erases */
+		erased_clear();
+		mass_erased = 1;
+	}
+	return ret;
+}
+
+/* Makes the device leave DFU mode and run from the address set last */
+int dfuse_do_leave(struct dfu_if *dif)
+{
+	int ret;
+	struct dfu_status dst;
+
+	if (plan) {
+		plan_add(PLAN_LEAVE, 0, 0, 0);
+		return 0;
 	}
+	dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
+	ret = dfu_get_status(dif->dev_handle, dif->interface, &dst);
+	if (ret < 0)
+		fprintf(stderr, "Error during download get_status\n");
+	if (verbose)
+		printf("bState = %i and bStatus = %i\n",
+		       dst.bState, dst.bStatus);
+	dif->flags |= DFU_IFF_GONE;
 	return ret;
 }
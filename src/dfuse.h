@@ -27,9 +27,14 @@ enum dfuse_command { SET_ADDRESS, ERASE_PAGE, MASS_ERASE, READ_UNPROTECT };
 
 int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			  enum dfuse_command command);
+int dfuse_upload_resumes(const char *dfuse_options);
 int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 		    const char *dfuse_options);
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file file,
 		    const char *dfuse_options);
+int dfuse_do_mass_erase(struct dfu_if *dif);
+int dfuse_do_leave(struct dfu_if *dif);
+void dfuse_forget_erased(void);
+void dfuse_release_layouts(void);
 
 #endif /* DFUSE_H */
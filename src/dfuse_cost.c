@@ -0,0 +1,182 @@
+/* Time estimates for DfuSe erase strategies.
+ *
+ * Before a download the pages it touches can be erased one by one, or the
+ * whole flash can be mass erased. Which is faster depends on how much of
+ * the flash the image covers, how many pages that is, and how long the
+ * device takes per page and for a mass erase. These times come from the
+ * busy times learned on the device model, from its profile, or from a
+ * default rate per KiB. Without a learned or profiled mass erase time, a
+ * mass erase is taken to be as slow as erasing every page, which leaves
+ * only the per command overhead to be saved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfuse_mem.h"
+#include "dfuse_cost.h"
+#include "poll_history.h"
+#include "quirks.h"
+
+struct page {
+	unsigned int start;
+	int size;
+};
+
+/* Returns the estimated busy time of erasing one page of pagesize bytes */
+long dfuse_page_erase_ms(int pagesize)
+{
+	int learned = poll_history_estimate(BUSY_ERASE, pagesize);
+
+	if (learned >= 0)
+		return learned;
+	if (profile.erase_time)
+		return (long) profile.erase_time * pagesize / 1024;
+	return (long) DFUSE_DEFAULT_ERASE_TIME * pagesize / 1024;
+}
+
+/* Returns the estimated busy time of a mass erase, taken as erasing
+ * all pages of the layout one by one if nothing is learned or profiled */
+long dfuse_mass_erase_ms(struct memsegment *layout)
+{
+	struct memsegment *segment;
+	int learned = poll_history_estimate(BUSY_MASS_ERASE, 0);
+	long ms = 0;
+
+	if (learned >= 0)
+		return learned;
+	if (profile.mass_erase_time)
+		return profile.mass_erase_time;
+	for (segment = layout; segment; segment = segment->next) {
+		if (!(segment->memtype & DFUSE_ERASABLE) ||
+		    segment->pagesize <= 0)
+			continue;
+		ms += ((long) segment->end - segment->start + 1) /
+		      segment->pagesize * dfuse_page_erase_ms(segment->pagesize);
+	}
+	return ms;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	unsigned int x = ((const struct page *) a)->start;
+	unsigned int y = ((const struct page *) b)->start;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Returns the segment holding address, or else the first one after it */
+static struct memsegment *segment_from(struct memsegment *layout,
+				       unsigned int address)
+{
+	struct memsegment *segment = find_segment(layout, address);
+	struct memsegment *next = NULL;
+
+	if (segment)
+		return segment;
+	for (segment = layout; segment; segment = segment->next)
+		if (segment->start > address &&
+		    (!next || segment->start < next->start))
+			next = segment;
+	return next;
+}
+
+/* Adds the erasable pages overlapping [start, end] to *pages */
+static int add_pages(struct memsegment *layout, unsigned int start,
+		     unsigned int end, struct page **pages, int *count,
+		     int *allocated)
+{
+	struct memsegment *segment;
+	unsigned int address = start;
+
+	while (address <= end) {
+		struct page *page;
+
+		segment = segment_from(layout, address);
+		if (!segment || segment->start > end)
+			break;
+		if (segment->start > address)
+			address = segment->start;
+		if (!(segment->memtype & DFUSE_ERASABLE) ||
+		    segment->pagesize <= 0) {
+			if (segment->end >= end)
+				break;
+			address = segment->end + 1;
+			continue;
+		}
+		if (*count == *allocated) {
+			int n = *allocated ? *allocated * 2 : 64;
+
+			page = realloc(*pages, n * sizeof(*page));
+			if (!page)
+				return -ENOMEM;
+			*pages = page;
+			*allocated = n;
+		}
+		page = &(*pages)[(*count)++];
+		page->start = address - (address - segment->start) %
+			      segment->pagesize;
+		page->size = segment->pagesize;
+		if (page->start + page->size - 1 >= end)
+			break;
+		address = page->start + page->size;
+	}
+	return 0;
+}
+
+/* Estimates erasing the pages the image ranges touch, each as its own
+ * command with poll_timeout ms waits around it, against one mass erase
+ * returns 0 on success, -ENOMEM */
+int dfuse_erase_estimate(struct memsegment *layout,
+			 struct dfu_element *ranges, int poll_timeout,
+			 struct erase_estimate *est)
+{
+	struct page *pages = NULL;
+	long command = DFUSE_COMMAND_OVERHEAD + 2 * poll_timeout;
+	int count = 0, allocated = 0;
+	int i;
+	int ret;
+
+	for (; ranges; ranges = ranges->next) {
+		if (!ranges->size)
+			continue;
+		ret = add_pages(layout, ranges->address,
+				ranges->address + ranges->size - 1,
+				&pages, &count, &allocated);
+		if (ret < 0) {
+			free(pages);
+			return ret;
+		}
+	}
+	if (count)
+		qsort(pages, count, sizeof(*pages), compare_pages);
+
+	est->pages = 0;
+	est->pages_ms = 0;
+	for (i = 0; i < count; i++) {
+		if (i && pages[i].start == pages[i - 1].start)
+			continue;
+		est->pages++;
+		est->pages_ms += dfuse_page_erase_ms(pages[i].size) + command;
+	}
+	free(pages);
+
+	est->mass_ms = dfuse_mass_erase_ms(layout) + command;
+	return 0;
+}
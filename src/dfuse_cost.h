@@ -0,0 +1,45 @@
+/* Time estimates for DfuSe erase strategies
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFUSE_COST_H
+#define DFUSE_COST_H
+
+#include "dfu_file.h"
+#include "dfuse_mem.h"
+
+/* Used for page erase when nothing is learned or profiled */
+#define DFUSE_DEFAULT_ERASE_TIME 20	/* ms per KiB */
+
+/* Requests around every DfuSe command, on top of the poll timeouts */
+#define DFUSE_COMMAND_OVERHEAD 4	/* ms */
+
+/* Mass erase is only chosen if it is estimated this much faster */
+#define DFUSE_MASS_ERASE_GAIN 10	/* percent */
+
+struct erase_estimate {
+	int pages;		/* erasable pages touched by the image */
+	long pages_ms;		/* erasing them one by one */
+	long mass_ms;		/* a mass erase */
+};
+
+long dfuse_page_erase_ms(int pagesize);
+long dfuse_mass_erase_ms(struct memsegment *layout);
+int dfuse_erase_estimate(struct memsegment *layout,
+			 struct dfu_element *ranges, int poll_timeout,
+			 struct erase_estimate *est);
+
+#endif /* DFUSE_COST_H */
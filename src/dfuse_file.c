@@ -0,0 +1,232 @@
+/* Builds DfuSe (.dfu) container files
+ * as per the DfuSe File Format Specification (ST document UM0391)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfuse_file.h"
+
+/* Output stream with running CRC over everything written */
+struct dfuse_writer {
+	struct dfu_file *file;
+	uint32_t crc;
+	off_t written;
+};
+
+static void uint2quad(unsigned char *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static int dfuse_write(struct dfuse_writer *w, const unsigned char *buf,
+		       size_t len)
+{
+	if (fwrite(buf, 1, len, w->file->filep) < len) {
+		fprintf(stderr, "Could not write to %s\n", w->file->name);
+		perror(w->file->name);
+		return -EIO;
+	}
+	w->crc = crc32_buf(w->crc, buf, len);
+	w->written += len;
+	return 0;
+}
+
+/* Parses an input specification of the form alt:address:file
+ * returns 0 on success, -EINVAL on syntax errors */
+int dfuse_parse_input(const char *spec, struct dfuse_input *input)
+{
+	char *end;
+
+	input->alt = strtoul(spec, &end, 0);
+	if (end == spec || *end != ':' || input->alt > 255)
+		return -EINVAL;
+	spec = end + 1;
+	input->address = strtoul(spec, &end, 0);
+	if (end == spec || *end != ':' || !end[1])
+		return -EINVAL;
+	input->name = end + 1;
+	input->size = 0;
+	return 0;
+}
+
+/* Copies an input file into the DfuSe image, one buffer at a time */
+static int dfuse_copy_input(struct dfuse_writer *w, struct dfuse_input *in,
+			    unsigned char *buf)
+{
+	FILE *filep;
+	off_t left = in->size;
+	int ret = 0;
+
+	filep = fopen(in->name, "rb");
+	if (!filep) {
+		perror(in->name);
+		return -EIO;
+	}
+	while (left > 0) {
+		size_t chunk = left < DFU_FILE_BUFSIZE ?
+			       left : DFU_FILE_BUFSIZE;
+
+		if (fread(buf, 1, chunk, filep) < chunk) {
+			fprintf(stderr, "Could not read whole file %s\n",
+				in->name);
+			ret = -EIO;
+			break;
+		}
+		ret = dfuse_write(w, buf, chunk);
+		if (ret < 0)
+			break;
+		left -= chunk;
+	}
+	fclose(filep);
+	return ret;
+}
+
+/* Writes a DfuSe image with all inputs, followed by a DFU suffix, to
+ * file->filep in a single pass. Inputs with the same alternate setting
+ * are collected into one target, in order of appearance. file->size is
+ * set to the size of the written file.
+ * returns 0 on success, negative on error */
+int dfuse_build_file(struct dfu_file *file, struct dfuse_input *inputs,
+		     int count)
+{
+	unsigned char header[DFUSE_TARGET_PREFIX_LENGTH];
+	unsigned char dfusuffix[DFU_SUFFIX_LENGTH];
+	unsigned char *buf;
+	struct dfuse_writer w;
+	uint64_t image_size = DFUSE_PREFIX_LENGTH;
+	int done[256];
+	int targets = 0;
+	int alt;
+	int i, j;
+	int ret = 0;
+
+	/* All header fields are known up front from the input sizes */
+	memset(done, 0, sizeof(done));
+	for (i = 0; i < count; i++) {
+		FILE *filep;
+
+		filep = fopen(inputs[i].name, "rb");
+		if (!filep) {
+			perror(inputs[i].name);
+			return -EIO;
+		}
+		fseeko(filep, 0, SEEK_END);
+		inputs[i].size = ftello(filep);
+		fclose(filep);
+		if (inputs[i].size < 0 || inputs[i].size > 0xffffffffLL) {
+			fprintf(stderr, "Unusable file size for %s\n",
+				inputs[i].name);
+			return -EINVAL;
+		}
+		if (!done[inputs[i].alt]) {
+			done[inputs[i].alt] = 1;
+			targets++;
+			image_size += DFUSE_TARGET_PREFIX_LENGTH;
+		}
+		image_size += DFUSE_ELEMENT_HEADER_LENGTH + inputs[i].size;
+	}
+	if (image_size > 0xffffffffULL || targets > 255) {
+		fprintf(stderr, "Too much data for a DfuSe file\n");
+		return -EINVAL;
+	}
+
+	buf = malloc(DFU_FILE_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate file buffer\n");
+		return -ENOMEM;
+	}
+
+	w.file = file;
+	w.crc = 0xffffffff;
+	w.written = 0;
+
+	memcpy(header, "DfuSe", 5);
+	header[5] = 0x01;	/* bVersion */
+	uint2quad(header + 6, image_size);
+	header[10] = targets;
+	ret = dfuse_write(&w, header, DFUSE_PREFIX_LENGTH);
+
+	memset(done, 0, sizeof(done));
+	for (i = 0; i < count && !ret; i++) {
+		uint32_t target_size = 0;
+		uint32_t elements = 0;
+
+		alt = inputs[i].alt;
+		if (done[alt])
+			continue;
+		done[alt] = 1;
+
+		for (j = i; j < count; j++) {
+			if (inputs[j].alt != alt)
+				continue;
+			target_size += DFUSE_ELEMENT_HEADER_LENGTH +
+				       inputs[j].size;
+			elements++;
+		}
+		printf("Target for alternate setting %i, %u elements, "
+		       "%u bytes\n", alt, elements, target_size);
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, "Target", 6);
+		header[6] = alt;
+		/* bTargetNamed and szTargetName are left empty */
+		uint2quad(header + 266, target_size);
+		uint2quad(header + 270, elements);
+		ret = dfuse_write(&w, header, DFUSE_TARGET_PREFIX_LENGTH);
+
+		for (j = i; j < count && !ret; j++) {
+			if (inputs[j].alt != alt)
+				continue;
+			printf(" element at 0x%08x, size %lli, from %s\n",
+			       inputs[j].address, (long long) inputs[j].size,
+			       inputs[j].name);
+			uint2quad(header, inputs[j].address);
+			uint2quad(header + 4, inputs[j].size);
+			ret = dfuse_write(&w, header,
+					  DFUSE_ELEMENT_HEADER_LENGTH);
+			if (!ret)
+				ret = dfuse_copy_input(&w, &inputs[j], buf);
+		}
+	}
+	free(buf);
+	if (ret < 0)
+		return ret;
+
+	/* The CRC covers the suffix itself, except the CRC field */
+	file->bcdDFU = 0x011a;
+	file->suffixlen = DFU_SUFFIX_LENGTH;
+	fill_dfu_suffix(file, dfusuffix);
+	w.crc = crc32_buf(w.crc, dfusuffix, DFU_SUFFIX_LENGTH - 4);
+	file->dwCRC = w.crc;
+	uint2quad(dfusuffix + 12, w.crc);
+	if (fwrite(dfusuffix, 1, sizeof(dfusuffix), file->filep) <
+	    sizeof(dfusuffix)) {
+		fprintf(stderr, "Could not write DFU suffix\n");
+		perror(file->name);
+		return -EIO;
+	}
+	file->size = w.written + DFU_SUFFIX_LENGTH;
+	return 0;
+}
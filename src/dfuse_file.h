@@ -0,0 +1,41 @@
+/* Builds DfuSe (.dfu) container files
+ * as per the DfuSe File Format Specification (ST document UM0391)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFUSE_FILE_H
+#define DFUSE_FILE_H
+
+#include <stdint.h>
+#include "dfu_file.h"
+
+#define DFUSE_PREFIX_LENGTH		11
+#define DFUSE_TARGET_PREFIX_LENGTH	274
+#define DFUSE_ELEMENT_HEADER_LENGTH	8
+
+/* One raw binary file to be placed at an address of an alternate setting */
+struct dfuse_input {
+	int alt;
+	uint32_t address;
+	const char *name;
+	off_t size;
+};
+
+int dfuse_parse_input(const char *spec, struct dfuse_input *input);
+int dfuse_build_file(struct dfu_file *file, struct dfuse_input *inputs,
+		     int count);
+
+#endif /* DFUSE_FILE_H */
@@ -0,0 +1,176 @@
+/* Journal of programmed chunks for resuming interrupted DfuSe downloads.
+ *
+ * The journal is kept next to the image as <image>.journal. Its first
+ * line identifies the device by USB IDs and serial number, and the
+ * image by size and CRC together with the transfer size, since that
+ * and the page layout of the device decide how the image is cut into
+ * chunks. Every chunk that has been
+ * erased and programmed is then recorded by its sequence number. The
+ * journal is removed once the download completes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfuse_journal.h"
+
+#define JOURNAL_LINE_LEN 512
+
+static FILE *journal;
+static char *journal_name;
+static char journal_head[JOURNAL_LINE_LEN];
+
+/* Builds the identification line for this device, image and transfer size
+ * returns 0 on success, negative on errors */
+static int journal_header(struct dfu_if *dif, struct dfu_file *file,
+			  int xfer_size, char *header, size_t len)
+{
+	struct libusb_device_descriptor desc;
+	unsigned char serial[128] = "";
+	uint32_t crc = 0xffffffff;
+	int ret;
+
+	if (libusb_get_device_descriptor(dif->dev, &desc) == 0 &&
+	    desc.iSerialNumber) {
+		ret = libusb_get_string_descriptor_ascii(dif->dev_handle,
+				desc.iSerialNumber, serial, sizeof(serial));
+		if (ret < 0)
+			serial[0] = 0;
+		else
+			serial[ret < sizeof(serial) ? ret :
+			       sizeof(serial) - 1] = 0;
+	}
+
+	rewind(file->filep);
+	ret = crc32_file(file, file->size, &crc);
+	rewind(file->filep);
+	if (ret < 0)
+		return ret;
+
+	snprintf(header, len, "dfu-util journal 2 %04x:%04x serial \"%s\" "
+		 "size %lli crc %08x xfer %i\n", dif->vendor, dif->product,
+		 serial, (long long) file->size, crc, xfer_size);
+	return 0;
+}
+
+/* Writes the journal anew, with the first done chunks recorded
+ * returns 0 on success, negative on errors */
+static int journal_rewrite(int done)
+{
+	int i;
+
+	if (journal)
+		fclose(journal);
+	journal = fopen(journal_name, "w");
+	if (!journal) {
+		perror(journal_name);
+		return -EIO;
+	}
+	fputs(journal_head, journal);
+	for (i = 0; i < done; i++)
+		fprintf(journal, "%i\n", i);
+	if (fflush(journal)) {
+		perror(journal_name);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Opens the journal for the download of file, starting a new one unless
+ * an existing journal was written for the same device, image and
+ * transfer size.
+ * returns the number of chunks programmed earlier, negative on errors */
+int dfuse_journal_open(struct dfu_if *dif, struct dfu_file *file,
+		       int xfer_size)
+{
+	char line[JOURNAL_LINE_LEN];
+	int done = 0;
+	int ret;
+
+	ret = journal_header(dif, file, xfer_size, journal_head,
+			     sizeof(journal_head));
+	if (ret < 0)
+		return ret;
+
+	journal_name = malloc(strlen(file->name) + 9);
+	if (!journal_name) {
+		fprintf(stderr, "Unable to allocate file name\n");
+		return -ENOMEM;
+	}
+	sprintf(journal_name, "%s.journal", file->name);
+
+	journal = fopen(journal_name, "r");
+	if (journal) {
+		if (fgets(line, sizeof(line), journal) &&
+		    !strcmp(line, journal_head)) {
+			/* chunks are recorded in order, a partly written
+			 * last line does not count */
+			while (fgets(line, sizeof(line), journal) &&
+			       strchr(line, '\n') &&
+			       strtol(line, NULL, 10) == done)
+				done++;
+		} else {
+			printf("Journal %s is for another device or image, "
+			       "starting over\n", journal_name);
+		}
+		fclose(journal);
+		journal = NULL;
+	}
+
+	/* drop anything after the last good line */
+	ret = journal_rewrite(done);
+	return ret < 0 ? ret : done;
+}
+
+/* Records that the chunk with sequence number index has been erased and
+ * programmed, in the same format as journal_rewrite() */
+void dfuse_journal_chunk_done(int index)
+{
+	if (!journal)
+		return;
+	fprintf(journal, "%i\n", index);
+	if (fflush(journal))
+		perror(journal_name);
+}
+
+/* Forgets all chunks from sequence number done on, as they are going to
+ * be erased and programmed again */
+int dfuse_journal_truncate(int done)
+{
+	if (!journal)
+		return 0;
+	return journal_rewrite(done);
+}
+
+void dfuse_journal_close(int completed)
+{
+	if (!journal)
+		return;
+	fclose(journal);
+	journal = NULL;
+	if (completed)
+		remove(journal_name);
+	else
+		printf("Progress kept in %s, use the resume modifier to "
+		       "continue\n", journal_name);
+	free(journal_name);
+	journal_name = NULL;
+}
@@ -0,0 +1,30 @@
+/* Journal of programmed chunks for resuming interrupted DfuSe downloads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFUSE_JOURNAL_H
+#define DFUSE_JOURNAL_H
+
+#include "dfu.h"
+#include "dfu_file.h"
+
+int dfuse_journal_open(struct dfu_if *dif, struct dfu_file *file,
+		       int xfer_size);
+void dfuse_journal_chunk_done(int index);
+int dfuse_journal_truncate(int done);
+void dfuse_journal_close(int completed);
+
+#endif /* DFUSE_JOURNAL_H */
@@ -0,0 +1,331 @@
+/* Writes memory read back from a device as a raw, Intel HEX or DfuSe
+ * file, leaving out the regions the caller skips as erased.
+ * Raw files get the skipped regions filled in as erased (0xFF), so that
+ * they match the memory, or on request holes, which the file system may
+ * store sparsely but which read back as zeros. HEX and DfuSe files simply
+ * get gaps between records or elements.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "portable.h"
+#ifdef HAVE_FTRUNCATE
+# include <unistd.h>
+#endif
+
+#include "dfu_file.h"
+#include "dfuse_file.h"
+#include "image_writer.h"
+
+#define IHEX_RECORD_SIZE 16
+#define RAW_FILL_SIZE 4096
+
+static void uint2quad(unsigned char *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static int write_at(struct image_writer *w, off_t pos,
+		    const unsigned char *buf, size_t len)
+{
+	if (pos >= 0 && fseeko(w->file->filep, pos, SEEK_SET)) {
+		perror(w->file->name);
+		return -EIO;
+	}
+	if (fwrite(buf, 1, len, w->file->filep) < len) {
+		fprintf(stderr, "Could not write to %s\n", w->file->name);
+		perror(w->file->name);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Fills the raw file as erased from address from up to address to, or
+ * leaves a hole there, which only shows if something follows it
+ * returns 0 on success, negative on errors */
+static int raw_fill(struct image_writer *w, uint32_t from, uint32_t to)
+{
+	unsigned char erased[RAW_FILL_SIZE];
+	off_t pos = from - w->base;
+	int ret;
+
+	if (w->holes || from >= to)
+		return 0;
+	memset(erased, 0xff, sizeof(erased));
+	while (from < to) {
+		size_t len = sizeof(erased);
+
+		if (len > to - from)
+			len = to - from;
+		ret = write_at(w, pos, erased, len);
+		if (ret < 0)
+			return ret;
+		pos = -1;
+		from += len;
+	}
+	return 0;
+}
+
+static int ihex_record(struct image_writer *w, int type, uint16_t offset,
+		       const unsigned char *data, int len)
+{
+	unsigned char sum;
+	int i;
+
+	sum = len + (offset >> 8) + (offset & 0xff) + type;
+	fprintf(w->file->filep, ":%02X%04X%02X", len, offset, type);
+	for (i = 0; i < len; i++) {
+		fprintf(w->file->filep, "%02X", data[i]);
+		sum += data[i];
+	}
+	if (fprintf(w->file->filep, "%02X\n", (unsigned char) -sum) < 0) {
+		perror(w->file->name);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int ihex_data(struct image_writer *w, uint32_t address,
+		     const unsigned char *data, size_t len)
+{
+	int ret;
+
+	while (len) {
+		int chunk = IHEX_RECORD_SIZE - address % IHEX_RECORD_SIZE;
+
+		if (chunk > len)
+			chunk = len;
+		if (!w->started || (address >> 16) != w->hex_upper) {
+			unsigned char upper[2];
+
+			w->hex_upper = address >> 16;
+			upper[0] = w->hex_upper >> 8;
+			upper[1] = w->hex_upper & 0xff;
+			ret = ihex_record(w, 4, 0, upper, 2);
+			if (ret < 0)
+				return ret;
+			w->started = 1;
+		}
+		ret = ihex_record(w, 0, address & 0xffff, data, chunk);
+		if (ret < 0)
+			return ret;
+		address += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* Fills in the size of the DfuSe element being written */
+static int dfuse_close_element(struct image_writer *w)
+{
+	unsigned char size[4];
+	int ret;
+
+	if (!w->elements)
+		return 0;
+	uint2quad(size, w->next - w->element_start);
+	ret = write_at(w, w->element_pos + 4, size, 4);
+	if (ret < 0)
+		return ret;
+	if (fseek(w->file->filep, 0, SEEK_END)) {
+		perror(w->file->name);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int dfuse_open_element(struct image_writer *w, uint32_t address)
+{
+	unsigned char header[DFUSE_ELEMENT_HEADER_LENGTH];
+	int ret;
+
+	ret = dfuse_close_element(w);
+	if (ret < 0)
+		return ret;
+	w->element_pos = ftell(w->file->filep);
+	w->element_start = address;
+	w->elements++;
+	uint2quad(header, address);
+	uint2quad(header + 4, 0);
+	return write_at(w, -1, header, sizeof(header));
+}
+
+/* Picks the output format from the file name extension */
+enum dfu_file_format image_format_from_name(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	char lower[6];
+	int i;
+
+	if (!ext || strlen(ext) >= sizeof(lower))
+		return DFU_FORMAT_RAW;
+	for (i = 0; ext[i]; i++)
+		lower[i] = tolower((unsigned char) ext[i]);
+	lower[i] = 0;
+
+	if (!strcmp(lower, ".dfu"))
+		return DFU_FORMAT_DFUSE;
+	if (!strcmp(lower, ".hex") || !strcmp(lower, ".ihex"))
+		return DFU_FORMAT_IHEX;
+	return DFU_FORMAT_RAW;
+}
+
+/* Prepares writing to file, which must be empty and opened for reading
+ * and writing. For DfuSe files all data goes into one target for
+ * alternate setting alt, and the file idVendor, idProduct and bcdDevice
+ * members are used for the suffix. Raw files start at address base,
+ * set w->holes afterwards to leave skipped regions as holes.
+ * returns 0 on success, negative on errors */
+int image_writer_start(struct image_writer *w, struct dfu_file *file,
+		       enum dfu_file_format format, int alt, uint32_t base)
+{
+	unsigned char header[DFUSE_PREFIX_LENGTH + DFUSE_TARGET_PREFIX_LENGTH];
+
+	memset(w, 0, sizeof(*w));
+	w->file = file;
+	w->format = format;
+	w->alt = alt;
+	w->base = base;
+
+	if (format == DFU_FORMAT_DFUSE) {
+		/* filled in by image_writer_finish() */
+		memset(header, 0, sizeof(header));
+		return write_at(w, 0, header, sizeof(header));
+	}
+	if (format != DFU_FORMAT_RAW && format != DFU_FORMAT_IHEX) {
+		fprintf(stderr, "Can not write %s files\n",
+			file_format_to_string(format));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Writes data read from address, any region skipped since the previous
+ * call is left out of the file
+ * returns 0 on success, negative on errors */
+int image_writer_data(struct image_writer *w, uint32_t address,
+		      const unsigned char *data, size_t len)
+{
+	int ret = 0;
+
+	if (!len)
+		return 0;
+
+	switch (w->format) {
+	case DFU_FORMAT_DFUSE:
+		if (!w->started || address != w->next)
+			ret = dfuse_open_element(w, address);
+		if (!ret)
+			ret = write_at(w, -1, data, len);
+		break;
+	case DFU_FORMAT_IHEX:
+		ret = ihex_data(w, address, data, len);
+		break;
+	default:
+		if (address < w->base) {
+			fprintf(stderr, "Error: Address 0x%08x is below the "
+				"start of the file\n", address);
+			return -EINVAL;
+		}
+		ret = raw_fill(w, w->started ? w->next : w->base, address);
+		if (!ret)
+			ret = write_at(w, w->holes && (!w->started ||
+				       address != w->next) ?
+				       (off_t) (address - w->base) : -1,
+				       data, len);
+		break;
+	}
+	if (ret < 0)
+		return ret;
+	w->started = 1;
+	w->next = address + len;
+	w->data_bytes += len;
+	return 0;
+}
+
+/* Completes the file, which for raw files is extended up to address end
+ * returns 0 on success, negative on errors */
+int image_writer_finish(struct image_writer *w, uint32_t end)
+{
+	unsigned char header[DFUSE_PREFIX_LENGTH + DFUSE_TARGET_PREFIX_LENGTH];
+	uint32_t crc = 0xffffffff;
+	long size;
+	int ret;
+
+	switch (w->format) {
+	case DFU_FORMAT_DFUSE:
+		ret = dfuse_close_element(w);
+		if (ret < 0)
+			return ret;
+		size = ftell(w->file->filep);
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, "DfuSe", 5);
+		header[5] = 0x01;	/* bVersion */
+		uint2quad(header + 6, size);
+		header[10] = 1;		/* bTargets */
+		memcpy(header + DFUSE_PREFIX_LENGTH, "Target", 6);
+		header[DFUSE_PREFIX_LENGTH + 6] = w->alt;
+		uint2quad(header + DFUSE_PREFIX_LENGTH + 266, size -
+			  DFUSE_PREFIX_LENGTH - DFUSE_TARGET_PREFIX_LENGTH);
+		uint2quad(header + DFUSE_PREFIX_LENGTH + 270, w->elements);
+		ret = write_at(w, 0, header, sizeof(header));
+		if (ret < 0)
+			return ret;
+
+		fflush(w->file->filep);
+		rewind(w->file->filep);
+		ret = crc32_file(w->file, size, &crc);
+		if (ret < 0)
+			return ret;
+		w->file->bcdDFU = 0x011a;
+		ret = write_dfu_suffix(w->file, crc);
+		return ret < 0 ? ret : 0;
+	case DFU_FORMAT_IHEX:
+		return ihex_record(w, 1, 0, NULL, 0);
+	default:
+		if (end <= w->base || (w->started && w->next >= end))
+			return 0;
+		/* the end of memory was erased, make the file full size */
+		if (!w->holes)
+			return raw_fill(w, w->started ? w->next : w->base, end);
+		fflush(w->file->filep);
+#ifdef HAVE_FTRUNCATE
+		if (ftruncate(fileno(w->file->filep), end - w->base) < 0) {
+			perror(w->file->name);
+			return -EIO;
+		}
+		return 0;
+#else
+		{
+			/* reads back as zero like the rest of the hole */
+			unsigned char zero = 0;
+
+			return write_at(w, (off_t) (end - w->base - 1),
+					&zero, 1);
+		}
+#endif /* HAVE_FTRUNCATE */
+	}
+}
@@ -0,0 +1,47 @@
+/* Writes memory read back from a device as a raw, Intel HEX or DfuSe
+ * file, leaving out the regions the caller skips as erased
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <stdint.h>
+#include "dfu_file.h"
+
+struct image_writer {
+	struct dfu_file *file;
+	enum dfu_file_format format;
+	int alt;
+	uint32_t base;		/* raw: address at file offset 0 */
+	int holes;		/* raw: leave skipped regions as holes */
+	uint32_t next;		/* address following the last data written */
+	int started;		/* any data written yet */
+	long element_pos;	/* DfuSe: file position of element header */
+	uint32_t element_start;
+	int elements;
+	uint32_t hex_upper;	/* HEX: current extended linear address */
+	long data_bytes;
+};
+
+enum dfu_file_format image_format_from_name(const char *name);
+int image_writer_start(struct image_writer *w, struct dfu_file *file,
+		       enum dfu_file_format format, int alt, uint32_t base);
+int image_writer_data(struct image_writer *w, uint32_t address,
+		      const unsigned char *data, size_t len);
+int image_writer_finish(struct image_writer *w, uint32_t end);
+
+#endif /* IMAGE_WRITER_H */
@@ -41,66 +41,95 @@ unsigned char lmdfu_dfu_prefix[] = {
 	0x00,			/* MSB file payload length */
 };
 
-int lmdfu_add_prefix(struct dfu_file file, unsigned int address)
+/* Copies len bytes from the current position of file to tmp through a
+ * fixed size buffer, updating the CRC if crc is not NULL */
+static int lmdfu_copy(struct dfu_file *file, FILE *tmp, long len,
+		      uint32_t *crc)
 {
-	int ret;
-	uint16_t addr;
-	uint32_t len;
-
-	unsigned char *data = NULL;
-
-	fseek(file.filep, 0, SEEK_END);
-	len = ftell(file.filep);
-	rewind(file.filep);
+	unsigned char *buf;
+	int ret = 0;
 
-	data = (unsigned char *)malloc(len);
-	if (!data) {
+	buf = malloc(DFU_FILE_BUFSIZE);
+	if (!buf) {
 		fprintf(stderr, "Unable to allocate buffer.\n");
-		exit(1);
+		return -ENOMEM;
 	}
-
-	ret = fread(data, 1, len, file.filep);
-	if (ret < 0) {
-		fprintf(stderr, "Could not read file\n");
-		perror(file.name);
-		free(data);
-		return ret;
-	} else if (ret < len) {
-		fprintf(stderr, "Could not read whole file\n");
-		free(data);
-		return -EIO;
+	while (len > 0) {
+		size_t chunk = len < DFU_FILE_BUFSIZE ? len : DFU_FILE_BUFSIZE;
+
+		if (fread(buf, 1, chunk, file->filep) < chunk) {
+			fprintf(stderr, "Could not read whole file\n");
+			perror(file->name);
+			ret = -EIO;
+			break;
+		}
+		if (fwrite(buf, 1, chunk, tmp) < chunk) {
+			fprintf(stderr, "Could not write whole file\n");
+			ret = -EIO;
+			break;
+		}
+		if (crc)
+			*crc = crc32_buf(*crc, buf, chunk);
+		len -= chunk;
 	}
+	free(buf);
+	return ret;
+}
+
+/* Prepends the prefix by streaming the file into a temporary file which
+ * then replaces the original. If crc is not NULL, the DFU suffix CRC of
+ * the new contents is computed on the way, see append_dfu_suffix() */
+int lmdfu_add_prefix(struct dfu_file *file, unsigned int address,
+		     uint32_t *crc)
+{
+	int ret;
+	uint16_t addr;
+	uint32_t len;
+	unsigned char prefix[sizeof(lmdfu_dfu_prefix)];
+	char *tmpname;
+	FILE *tmp;
+
+	fseek(file->filep, 0, SEEK_END);
+	len = ftell(file->filep);
+	rewind(file->filep);
 
 	/* fill Stellaris lmdfu_dfu_prefix with correct data */
+	memcpy(prefix, lmdfu_dfu_prefix, sizeof(prefix));
 	addr = address / 1024;
-	lmdfu_dfu_prefix[2] = (unsigned char)addr & 0xff;
-	lmdfu_dfu_prefix[3] = (unsigned char)addr >> 8;
-	lmdfu_dfu_prefix[4] = (unsigned char)len & 0xff;
-	lmdfu_dfu_prefix[5] = (unsigned char)(len >> 8) & 0xff;
-	lmdfu_dfu_prefix[6] = (unsigned char)(len >> 16) & 0xff;
-	lmdfu_dfu_prefix[7] = (unsigned char)(len) >> 24;
-
-	rewind(file.filep);
-	ret = fwrite(lmdfu_dfu_prefix, 1, sizeof(lmdfu_dfu_prefix), file.filep);
-	if (ret < 0) {
+	prefix[2] = addr & 0xff;
+	prefix[3] = addr >> 8;
+	prefix[4] = len & 0xff;
+	prefix[5] = (len >> 8) & 0xff;
+	prefix[6] = (len >> 16) & 0xff;
+	prefix[7] = len >> 24;
+
+	tmp = open_temp_file(file, &tmpname);
+	if (!tmp)
+		return -EIO;
+
+	ret = fwrite(prefix, 1, sizeof(prefix), tmp);
+	if (ret < sizeof(prefix)) {
 		fprintf(stderr, "Could not write TI Stellaris DFU prefix\n");
-		perror(file.name);
-	} else if (ret < sizeof(lmdfu_dfu_prefix)) {
-		fprintf(stderr, "Could not write while file\n");
-		ret = -EIO;
+		fclose(tmp);
+		remove(tmpname);
+		free(tmpname);
+		return -EIO;
 	}
+	if (crc)
+		*crc = crc32_buf(*crc, prefix, sizeof(prefix));
 
-	ret = fwrite(data, 1, len, file.filep);
+	ret = lmdfu_copy(file, tmp, len, crc);
 	if (ret < 0) {
-		fprintf(stderr, "Could not write data after TI Stellaris DFU "
-			"prefix\n");
-		perror(file.name);
-	} else if (ret < sizeof(lmdfu_dfu_prefix)) {
-		fprintf(stderr, "Could not write whole file\n");
-		ret = -EIO;
+		fclose(tmp);
+		remove(tmpname);
+		free(tmpname);
+		return ret;
 	}
 
-	rewind(file.filep);
+	ret = replace_file(file, tmp, tmpname);
+	if (ret < 0)
+		return ret;
+
 	printf("TI Stellaris DFU prefix added.\n");
 	return 0;
 }
@@ -108,48 +137,38 @@ int lmdfu_add_prefix(struct dfu_file file, unsigned int address)
 int lmdfu_remove_prefix(struct dfu_file *file)
 {
 	long len;
-	unsigned char *data;
+	char *tmpname;
+	FILE *tmp;
 	int ret;
 
-#ifdef HAVE_FTRUNCATE
 	printf("Remove TI Stellaris prefix\n");
 
 	fseek(file->filep, 0, SEEK_END);
 	len = ftell(file->filep);
-	rewind(file->filep);
-
-	data = (unsigned char *)malloc(len);
-	if (!data) {
-		fprintf(stderr, "Unable to allocate buffer.\n");
-		exit(1);
+	if (len < sizeof(lmdfu_dfu_prefix)) {
+		fprintf(stderr, "File too short for TI Stellaris prefix\n");
+		rewind(file->filep);
+		return -EINVAL;
 	}
+	fseek(file->filep, sizeof(lmdfu_dfu_prefix), SEEK_SET);
 
-	ret = fread(data, 1, len, file->filep);
-	if (ret < 0) {
-		fprintf(stderr, "Could not read file\n");
-		perror(file->name);
-		free(data);
-		return ret;
-	} else if (ret < len) {
-		fprintf(stderr, "Could not read whole file\n");
-		free(data);
+	tmp = open_temp_file(file, &tmpname);
+	if (!tmp)
 		return -EIO;
-	}
 
-	ret = ftruncate(fileno(file->filep), 0);
+	ret = lmdfu_copy(file, tmp, len - sizeof(lmdfu_dfu_prefix), NULL);
 	if (ret < 0) {
-		fprintf(stderr, "Error truncating\n");
+		fclose(tmp);
+		remove(tmpname);
+		free(tmpname);
+		return ret;
 	}
-	rewind(file->filep);
 
-	fwrite(data + sizeof(lmdfu_dfu_prefix), 1, len - sizeof(lmdfu_dfu_prefix),
-	       file->filep);
+	ret = replace_file(file, tmp, tmpname);
+	if (ret < 0)
+		return ret;
 
 	printf("TI Stellaris prefix removed\n");
-#else
-	printf("Prefix removal not implemented on this platform\n");
-#endif /* HAVE_FTRUNCATE */
-
 	return ret;
 }
 
@@ -23,7 +23,8 @@
 #ifndef LMDFU_H
 #define LMDFU_H
 
-int lmdfu_add_prefix(struct dfu_file file, unsigned int address);
+int lmdfu_add_prefix(struct dfu_file *file, unsigned int address,
+		     uint32_t *crc);
 int lmdfu_remove_prefix(struct dfu_file *file);
 int lmdfu_check_prefix(struct dfu_file *file);
 
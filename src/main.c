@@ -32,9 +32,16 @@
 #include "dfu.h"
 #include "usb_dfu.h"
 #include "dfu_file.h"
-#include "dfu_load.h"
 #include "dfuse.h"
 #include "quirks.h"
+#include "poll_history.h"
+#include "progress.h"
+#include "xfer_pool.h"
+#include "plan.h"
+#include "session.h"
+#include "sink.h"
+#include "stream.h"
+#include "usb_sysfs.h"
 
 #ifdef HAVE_USBPATH_H
 #include <usbpath.h>
@@ -42,6 +49,8 @@
 
 int debug;
 int verbose = 0;
+int verify = 0;
+int plan = 0;
 
 /* USB string descriptor should contain max 126 UTF-16 characters
  * but 253 would even accomodate any UTF-8 encoding */
@@ -224,18 +233,23 @@ static int print_dfu_if(struct dfu_if *dfu_if, void *v)
 /* Walk the device tree and print out DFU devices */
 static int list_dfu_interfaces(libusb_context *ctx)
 {
+	struct usb_sysfs_candidates candidates;
 	libusb_device **list;
 	libusb_device *dev;
 	ssize_t num_devs, i;
 
+	usb_sysfs_scan(&candidates, NULL);
 	num_devs = libusb_get_device_list(ctx, &list);
 
 	for (i = 0; i < num_devs; ++i) {
 		dev = list[i];
+		if (!usb_sysfs_candidate(&candidates, dev))
+			continue;
 		find_dfu_if(dev, &print_dfu_if, NULL);
 	}
 
 	libusb_free_device_list(list, 1);
+	usb_sysfs_free(&candidates);
 	return 0;
 }
 
@@ -254,6 +268,38 @@ static int alt_by_name(struct dfu_if *dfu_if, void *v)
 	return dfu_if->altsetting+1;
 }
 
+/* Switches the claimed interface to another alternate setting, given by
+ * number or name, for the alt command of session scripts */
+static int select_alt(struct dfu_if *dif, const char *alt)
+{
+	static unsigned char alt_name[MAX_DESC_STR_LEN+1];
+	char *end;
+	int n;
+
+	n = strtoul(alt, &end, 0);
+	if (*end || end == alt) {
+		n = find_dfu_if(dif->dev, &alt_by_name, (void *) alt);
+		if (n <= 0) {
+			fprintf(stderr, "No such Alternate Setting: \"%s\"\n",
+			    alt);
+			return -EINVAL;
+		}
+		n--;
+	}
+	printf("Setting Alternate Setting #%d ...\n", n);
+	if (libusb_set_interface_alt_setting(dif->dev_handle, dif->interface,
+					     n) < 0) {
+		fprintf(stderr, "Cannot set alternate interface\n");
+		return -EIO;
+	}
+	dif->altsetting = n;
+	if (get_alt_name(dif, alt_name) > 0)
+		dif->alt_name = alt_name;
+	else
+		dif->alt_name = NULL;
+	return 0;
+}
+
 static int _count_cb(struct dfu_if *dif, void *v)
 {
 	int *count = (int*) v;
@@ -278,15 +324,20 @@ static int count_dfu_interfaces(libusb_device *dev)
 static int iterate_dfu_devices(libusb_context *ctx, struct dfu_if *dif,
     int (*action)(struct libusb_device *dev, void *user), void *user)
 {
+	struct usb_sysfs_candidates candidates;
 	libusb_device **list;
 	ssize_t num_devs, i;
 
+	/* on Linux, only the devices sysfs lists with a DFU interface */
+	usb_sysfs_scan(&candidates, dif);
 	num_devs = libusb_get_device_list(ctx, &list);
 	for (i = 0; i < num_devs; ++i) {
 		int retval;
 		struct libusb_device_descriptor desc;
 		struct libusb_device *dev = list[i];
 
+		if (!usb_sysfs_candidate(&candidates, dev))
+			continue;
 		if (dif && (dif->flags & DFU_IFF_DEVNUM) &&
 		    (libusb_get_bus_number(dev) != dif->bus ||
 		     libusb_get_device_address(dev) != dif->devnum))
@@ -305,10 +356,12 @@ static int iterate_dfu_devices(libusb_context *ctx, struct dfu_if *dif,
 		retval = action(dev, user);
 		if (retval) {
 			libusb_free_device_list(list, 0);
+			usb_sysfs_free(&candidates);
 			return retval;
 		}
 	}
 	libusb_free_device_list(list, 0);
+	usb_sysfs_free(&candidates);
 	return 0;
 }
 
@@ -544,7 +597,15 @@ static void help(void)
 	printf(	"  -t --transfer-size\t\tSpecify the number of bytes per USB Transfer\n"
 		"  -U --upload file\t\tRead firmware from device into <file>\n"
 		"  -D --download file\t\tWrite firmware from <file> into device\n"
+		"  -S --script file\t\tRun the commands in <file> in one session\n"
 		"  -R --reset\t\t\tIssue USB Reset signalling once we're finished\n"
+		"  -y --verify\t\t\tRead back and compare memory after download\n"
+		"  -n --plan\t\t\tList the download operations with a time\n"
+		"\t\t\t\testimate, without sending them\n"
+		"  -C --compile-plan file\tAlso write the planned DfuSe download\n"
+		"\t\t\t\tto <file>, for downloading it with -D\n"
+		"  -Z --compress format\t\tCompress uploads with gz, xz, zst or bz2\n"
+		"  -P --progress-fd fd\t\tWrite progress as JSON lines to <fd>\n"
 		"  -s --dfuse-address address\tST DfuSe mode, specify target address for\n"
 		"\t\t\t\traw file download or upload. Not applicable for\n"
 		"\t\t\t\tDfuSe file (.dfu) downloads\n"
@@ -577,8 +638,15 @@ static struct option opts[] = {
 	{ "transfer-size", 1, 0, 't' },
 	{ "upload", 1, 0, 'U' },
 	{ "download", 1, 0, 'D' },
+	{ "script", 1, 0, 'S' },
 	{ "reset", 0, 0, 'R' },
-	{ "dfuse-address", 1, 0, 's' }
+	{ "verify", 0, 0, 'y' },
+	{ "plan", 0, 0, 'n' },
+	{ "compile-plan", 1, 0, 'C' },
+	{ "compress", 1, 0, 'Z' },
+	{ "progress-fd", 1, 0, 'P' },
+	{ "dfuse-address", 1, 0, 's' },
+	{ 0, 0, 0, 0 }
 };
 
 enum mode {
@@ -587,7 +655,8 @@ enum mode {
 	MODE_LIST,
 	MODE_DETACH,
 	MODE_UPLOAD,
-	MODE_DOWNLOAD
+	MODE_DOWNLOAD,
+	MODE_SCRIPT
 };
 
 int main(int argc, char **argv)
@@ -602,6 +671,7 @@ int main(int argc, char **argv)
 	libusb_context *ctx;
 	struct libusb_device_descriptor desc;
 	struct dfu_file file;
+	struct session session;
 	char *alt_name = NULL; /* query alt name if non-NULL */
 	char *device_id_filter = NULL;
 	unsigned char active_alt_name[MAX_DESC_STR_LEN+1];
@@ -610,13 +680,15 @@ int main(int argc, char **argv)
 	int ret;
 	int dfuse_device = 0;
 	const char *dfuse_options = NULL;
+	const char *plan_output = NULL;
+	const char *compress = NULL;
 
 	memset(dif, 0, sizeof(*dif));
 	file.name = NULL;
 
 	while (1) {
 		int c, option_index = 0;
-		c = getopt_long(argc, argv, "hVvled:p:c:i:a:t:U:D:Rs:", opts,
+		c = getopt_long(argc, argv, "hVvled:p:c:i:a:t:U:D:S:RynC:Z:P:s:", opts,
 				&option_index);
 		if (c == -1)
 			break;
@@ -684,9 +756,40 @@ int main(int argc, char **argv)
 			mode = MODE_DOWNLOAD;
 			file.name = optarg;
 			break;
+		case 'S':
+			mode = MODE_SCRIPT;
+			file.name = optarg;
+			break;
 		case 'R':
 			final_reset = 1;
 			break;
+		case 'y':
+			verify = 1;
+			break;
+		case 'n':
+			plan = 1;
+			break;
+		case 'C':
+			plan = 1;
+			plan_output = optarg;
+			break;
+		case 'Z':
+			compress = stream_compressor_format(optarg);
+			if (!compress) {
+				fprintf(stderr, "Unknown compression `%s', "
+					"use gz, xz, zst or bz2\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'P':
+			ret = strtol(optarg, &end, 0);
+			if (*end || end == optarg || ret < 0) {
+				fprintf(stderr, "Invalid file descriptor "
+					"`%s'\n", optarg);
+				exit(2);
+			}
+			progress_json_fd(ret);
+			break;
 		case 's':
 			dfuse_options = optarg;
 			break;
@@ -696,17 +799,42 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* the uploaded image goes to standard output, all else to stderr */
+	if (mode == MODE_UPLOAD && !strcmp(file.name, "-") &&
+	    !sink_claim_stdout())
+		exit(1);
+
 	print_version();
 	if (mode == MODE_VERSION) {
 		exit(0);
 	}
 
 	if (mode == MODE_NONE) {
-		fprintf(stderr, "Error: You need to specify one of -D or -U\n\n");
+		fprintf(stderr, "Error: You need to specify one of -D, -U "
+			"or -S\n\n");
 		help();
 		exit(2);
 	}
 
+	if (plan && mode != MODE_DOWNLOAD) {
+		fprintf(stderr, "Error: Only downloads can be planned\n");
+		exit(2);
+	}
+	if (plan)
+		progress_quiet();
+
+	if (compress && mode == MODE_DOWNLOAD) {
+		fprintf(stderr, "Error: Only uploads can be compressed, "
+			"downloads are decompressed by their name\n");
+		exit(2);
+	}
+
+	if (mode == MODE_SCRIPT && dfuse_options) {
+		fprintf(stderr, "Error: DfuSe modifiers go on the script "
+			"lines, not in -s\n");
+		exit(2);
+	}
+
 	if (device_id_filter) {
 		/* Parse device ID */
 		parse_vendprod(&dif->vendor, &dif->product, device_id_filter);
@@ -842,7 +970,7 @@ int main(int argc, char **argv)
 					fprintf(stderr, "error resetting "
 						"after detach\n");
 			}
-			milli_sleep(2000);
+			milli_sleep(profile.detach_delay);
 			break;
 		case DFU_STATE_dfuERROR:
 			printf("dfuERROR, clearing status\n");
@@ -1051,13 +1179,30 @@ status_again:
 	if (quirks & QUIRK_FORCE_DFU11)
 		func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x0110);
 
+	if (ret >= 7) {
+		dif->bmAttributes = func_dfu.bmAttributes;
+	} else {
+		/* keep asking for the status during manifestation */
+		dif->bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD |
+				    USB_DFU_MANIFEST_TOL;
+	}
+
 	printf("DFU mode device DFU version %04x\n",
 	       libusb_le16_to_cpu(func_dfu.bcdDFUVersion));
 
 	if (func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
 		dfuse_device = 1;
 
+	/* busy times learned in earlier sessions with this model */
+	poll_history_load(dif->vendor, dif->product, dif->bcdDevice);
+	atexit(poll_history_save);
+
 	/* If not overridden by the user */
+	if (!transfer_size && profile.transfer_size) {
+		transfer_size = profile.transfer_size;
+		printf("Using transfer size %i from device profile\n",
+		       transfer_size);
+	}
 	if (!transfer_size) {
 		transfer_size = libusb_le16_to_cpu(func_dfu.wTransferSize);
 		if (transfer_size) {
@@ -1091,81 +1236,43 @@ status_again:
 		printf("Adjusted transfer size to %i\n", transfer_size);
 	}
 
+	session.dif = dif;
+	session.xfer_size = transfer_size;
+	session.dfuse_device = dfuse_device;
+	session.compress = compress;
+	session.select_alt = select_alt;
+
 	switch (mode) {
 	case MODE_UPLOAD:
-		/* open for "exclusive" writing in a portable way */
-		file.filep = fopen(file.name, "ab");
-		if (file.filep == NULL) {
-			perror(file.name);
-			exit(1);
-		}
-		if (ftell(file.filep)) {
-			fprintf(stderr, "%s: File exists\n", file.name);
-			fclose(file.filep);
-			exit(1);
-		}
-		if (dfuse_device || dfuse_options) {
-		    if (dfuse_do_upload(dif, transfer_size, file,
-					dfuse_options) < 0)
+		if (session_upload(&session, file.name, dfuse_options) < 0)
 			exit(1);
-		} else {
-		    if (dfuload_do_upload(dif, transfer_size, file) < 0)
-			exit(1);
-		}
-		fclose(file.filep);
 		break;
 	case MODE_DOWNLOAD:
-		file.filep = fopen(file.name, "rb");
-		if (file.filep == NULL) {
-			perror(file.name);
-			exit(1);
-		}
-		ret = parse_dfu_suffix(&file);
-		if (ret < 0)
+		if (plan)
+			plan_start(dif, transfer_size, plan_output);
+		if (session_download(&session, file.name, dfuse_options) < 0)
 			exit(1);
-		if (ret == 0) {
-			fprintf(stderr, "Warning: File has no DFU suffix\n");
-		} else if (file.bcdDFU != 0x0100 && file.bcdDFU != 0x11a) {
-			fprintf(stderr, "Unsupported DFU file revision "
-				"%04x\n", file.bcdDFU);
+		if (plan)
+			plan_report();
+		break;
+	case MODE_SCRIPT:
+		if (session_run_script(&session, file.name) < 0)
 			exit(1);
-		}
-		if (file.idVendor != 0xffff &&
-		    dif->vendor != file.idVendor) {
-			fprintf(stderr, "Warning: File vendor ID %04x does "
-				"not match device %04x\n", file.idVendor, dif->vendor);
-		}
-		if (file.idProduct != 0xffff &&
-		    dif->product != file.idProduct) {
-			fprintf(stderr, "Warning: File product ID %04x does "
-				"not match device %04x\n", file.idProduct, dif->product);
-		}
-		if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
-		        if (dfuse_do_dnload(dif, transfer_size, file,
-							dfuse_options) < 0)
-				exit(1);
-		} else {
-			if (dfuload_do_dnload(dif, transfer_size, file) < 0)
-				exit(1);
-	 	}
-		fclose(file.filep);
 		break;
 	default:
 		fprintf(stderr, "Unsupported mode: %u\n", mode);
 		exit(1);
 	}
 
-	if (final_reset) {
-		if (dfu_detach(dif->dev_handle, dif->interface, 1000) < 0) {
-			fprintf(stderr, "can't detach\n");
-		}
-		printf("Resetting USB to switch back to runtime mode\n");
-		ret = libusb_reset_device(dif->dev_handle);
-		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
-			fprintf(stderr, "error resetting after download\n");
-		}
-	}
+	if (dfu_retry_count)
+		printf("%u requests were repeated after transient errors\n",
+		       dfu_retry_count);
+
+	if (final_reset && !plan && !(dif->flags & DFU_IFF_GONE))
+		session_reset(&session);
 
+	dfuse_release_layouts();
+	xfer_pool_release();
 	libusb_close(dif->dev_handle);
 	libusb_exit(ctx);
 	exit(0);
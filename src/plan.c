@@ -0,0 +1,368 @@
+/* Dry run of downloads, listing the planned operations with a time estimate
+ *
+ * With --plan the download code runs as usual, parsing the file, the
+ * memory layout, choosing how to erase and cutting the image into chunks,
+ * but every request that would erase, address, write or read back device
+ * memory is added to the plan instead of being sent. Each operation is
+ * timed from the busy times learned for the device model, the erase
+ * times of its profile or else its poll timeout, plus a rough cost per
+ * request and per byte transferred.
+ *
+ * With --compile-plan the plan of a DfuSe download is also written to a
+ * file, together with the data of every chunk, so that production
+ * stations can download it without parsing the image or working out the
+ * erase and write schedule again. After a header identifying the device
+ * model, memory layout, transfer size and source image follow records
+ * of PLAN_RECORD_SIZE bytes: the type, three zero bytes, and the address,
+ * size and CRC of the data following the record, all little endian. A
+ * DFU suffix with the device IDs and a CRC of the whole plan ends the
+ * file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfuse_cost.h"
+#include "plan.h"
+#include "poll_history.h"
+
+static const char *plan_names[PLAN_OPS] = {
+	"unprotect",
+	"mass-erase",
+	"erase",
+	"set-address",
+	"write",
+	"manifest",
+	"verify",
+	"leave"
+};
+
+static int poll_timeout;
+static int plan_xfer_size;
+static int counts[PLAN_OPS];
+static long long bytes[PLAN_OPS];
+static long times[PLAN_OPS];
+
+/* Compiled plan being written */
+static const char *output_name;
+static FILE *output;
+static uint32_t output_bytes;
+static int output_error;
+
+static void put_le16(unsigned char *p, uint16_t value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = value >> 24;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Starts a plan, which is also compiled into the file output if that
+ * is not NULL */
+void plan_start(struct dfu_if *dif, int xfer_size, const char *output)
+{
+	poll_timeout = poll_timeout_now(dif);
+	plan_xfer_size = xfer_size;
+	output_name = output;
+	printf("Planning the download, nothing is sent to the device\n");
+	printf("Poll timeout %i ms, transfer size %i\n", poll_timeout,
+	       xfer_size);
+}
+
+/* returns the learned busy time of op on size bytes, or else the poll
+ * timeout */
+long plan_busy_ms(enum busy_op op, int size)
+{
+	int learned = poll_history_estimate(op, size);
+
+	return learned >= 0 ? learned : poll_timeout;
+}
+
+/* returns the estimated duration of op, including the requests around it */
+static long plan_cost(enum plan_op op, long long size, long busy_ms)
+{
+	switch (op) {
+	case PLAN_ERASE:
+	case PLAN_MASS_ERASE:
+	case PLAN_SET_ADDRESS:
+		/* as in the erase estimates */
+		return busy_ms + DFUSE_COMMAND_OVERHEAD + 2 * poll_timeout;
+	case PLAN_WRITE:
+		/* download and status requests */
+		return busy_ms + 2 * PLAN_REQUEST_TIME +
+		       size / PLAN_TRANSFER_RATE;
+	case PLAN_UNPROTECT:
+		return 2 * PLAN_REQUEST_TIME + poll_timeout;
+	case PLAN_LEAVE:
+		return 3 * PLAN_REQUEST_TIME + poll_timeout;
+	case PLAN_MANIFEST:
+		return busy_ms + 2 * PLAN_REQUEST_TIME;
+	case PLAN_VERIFY:
+		return (size + plan_xfer_size - 1) / plan_xfer_size *
+		       PLAN_REQUEST_TIME + size / PLAN_TRANSFER_RATE;
+	default:
+		return 0;
+	}
+}
+
+int plan_compiling(void)
+{
+	return output_name != NULL;
+}
+
+/* Writes the header of the compiled plan for a download of image
+ * returns 0 on success, negative on errors */
+int plan_compile_start(struct dfu_if *dif, struct dfu_file *image)
+{
+	unsigned char header[PLAN_HEADER_SIZE];
+	const char *layout = (const char *)dif->alt_name;
+	uint32_t crc = 0xffffffff;
+	int ret;
+
+	rewind(image->filep);
+	ret = crc32_file(image, image->size, &crc);
+	rewind(image->filep);
+	if (ret < 0)
+		return ret;
+
+	output = fopen(output_name, "w+b");
+	if (!output) {
+		perror(output_name);
+		return -errno;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, PLAN_FILE_MAGIC, 8);
+	put_le32(header + 8, PLAN_FILE_VERSION);
+	put_le16(header + 12, dif->vendor);
+	put_le16(header + 14, dif->product);
+	put_le16(header + 16, dif->bcdDevice);
+	put_le16(header + 18, strlen(layout));
+	put_le32(header + 20, plan_xfer_size);
+	put_le32(header + 24, image->size);
+	put_le32(header + 28, crc);
+	/* the bytes written are filled in at the end */
+	if (fwrite(header, 1, sizeof(header), output) < sizeof(header) ||
+	    fwrite(layout, 1, strlen(layout), output) < strlen(layout))
+		output_error = 1;
+	output_bytes = 0;
+	return 0;
+}
+
+static void plan_compile_record(int type, unsigned int address,
+				const unsigned char *data, int size)
+{
+	unsigned char record[PLAN_RECORD_SIZE];
+
+	if (!output)
+		return;
+	memset(record, 0, sizeof(record));
+	record[0] = type;
+	put_le32(record + 4, address);
+	put_le32(record + 8, size);
+	put_le32(record + 12, data ? crc32_buf(0xffffffff, data, size) : 0);
+	if (fwrite(record, 1, sizeof(record), output) < sizeof(record) ||
+	    (data && fwrite(data, 1, size, output) < size))
+		output_error = 1;
+}
+
+/* Ends the compiled plan with its DFU suffix, or removes it if the
+ * download could not be planned
+ * returns 0 on success, negative on errors */
+int plan_compile_finish(struct dfu_if *dif, int ok)
+{
+	struct dfu_file file;
+	unsigned char total[4];
+	uint32_t crc = 0xffffffff;
+	int ret = 0;
+
+	if (!output)
+		return 0;
+	plan_compile_record(PLAN_RECORD_END, 0, NULL, 0);
+	put_le32(total, output_bytes);
+	if (fseek(output, 32, SEEK_SET) ||
+	    fwrite(total, 1, sizeof(total), output) < sizeof(total))
+		output_error = 1;
+
+	memset(&file, 0, sizeof(file));
+	file.name = output_name;
+	file.filep = output;
+	if (ok && !output_error && !fflush(output)) {
+		fseeko(output, 0, SEEK_END);
+		file.size = ftello(output);
+		rewind(output);
+		ret = crc32_file(&file, file.size, &crc);
+		file.idVendor = dif->vendor;
+		file.idProduct = dif->product;
+		file.bcdDevice = dif->bcdDevice;
+		file.bcdDFU = 0x11a;
+		if (ret >= 0 && write_dfu_suffix(&file, crc) < 0)
+			ret = -EIO;
+	} else if (ok) {
+		ret = -EIO;
+	}
+	if (fclose(output))
+		ret = -EIO;
+	output = NULL;
+
+	if (!ok || ret < 0) {
+		if (ok)
+			fprintf(stderr, "Could not write plan %s\n",
+				output_name);
+		remove(output_name);
+		return ok ? ret : 0;
+	}
+	printf("Compiled plan written to %s\n", output_name);
+	return 0;
+}
+
+/* Reads the header of a compiled plan, header->layout is to be freed
+ * returns 0 on success, negative on errors */
+int plan_read_header(struct dfu_file *file, struct plan_header *header)
+{
+	unsigned char buf[PLAN_HEADER_SIZE];
+	int len;
+
+	rewind(file->filep);
+	if (fread(buf, 1, sizeof(buf), file->filep) < sizeof(buf) ||
+	    memcmp(buf, PLAN_FILE_MAGIC, 8)) {
+		fprintf(stderr, "Invalid plan header\n");
+		return -EINVAL;
+	}
+	if (get_le32(buf + 8) != PLAN_FILE_VERSION) {
+		fprintf(stderr, "Plan version %u not supported\n",
+			get_le32(buf + 8));
+		return -EINVAL;
+	}
+	header->idVendor = get_le16(buf + 12);
+	header->idProduct = get_le16(buf + 14);
+	header->bcdDevice = get_le16(buf + 16);
+	len = get_le16(buf + 18);
+	header->xfer_size = get_le32(buf + 20);
+	header->image_size = get_le32(buf + 24);
+	header->image_crc = get_le32(buf + 28);
+	header->bytes = get_le32(buf + 32);
+
+	header->layout = malloc(len + 1);
+	if (!header->layout)
+		return -ENOMEM;
+	if (fread(header->layout, 1, len, file->filep) < len) {
+		fprintf(stderr, "Invalid plan header\n");
+		free(header->layout);
+		return -EINVAL;
+	}
+	header->layout[len] = '\0';
+	return 0;
+}
+
+/* Reads the next record of a compiled plan, the data of a write record
+ * follows it in the file
+ * returns 0 on success, negative on errors */
+int plan_read_record(struct dfu_file *file, struct plan_record *record)
+{
+	unsigned char buf[PLAN_RECORD_SIZE];
+
+	if (fread(buf, 1, sizeof(buf), file->filep) < sizeof(buf)) {
+		fprintf(stderr, "Plan ends without end record\n");
+		return -EINVAL;
+	}
+	record->type = buf[0];
+	record->address = get_le32(buf + 4);
+	record->size = get_le32(buf + 8);
+	record->crc = get_le32(buf + 12);
+	return 0;
+}
+
+void plan_add(enum plan_op op, unsigned int address, long long size,
+	      long busy_ms)
+{
+	long ms = plan_cost(op, size, busy_ms);
+
+	if (op == PLAN_ERASE)
+		plan_compile_record(PLAN_RECORD_ERASE, address, NULL, size);
+	else if (op == PLAN_MASS_ERASE)
+		plan_compile_record(PLAN_RECORD_MASS_ERASE, 0, NULL, 0);
+	else if (op == PLAN_LEAVE)
+		plan_compile_record(PLAN_RECORD_LEAVE, 0, NULL, 0);
+
+	counts[op]++;
+	bytes[op] += size;
+	times[op] += ms;
+
+	printf("  %-11s", plan_names[op]);
+	if (op == PLAN_ERASE || op == PLAN_SET_ADDRESS || op == PLAN_WRITE ||
+	    op == PLAN_VERIFY)
+		printf(" 0x%08x", address);
+	else
+		printf("           ");
+	if (size)
+		printf(" %8lli bytes", size);
+	else
+		printf("               ");
+	printf(" %6li ms\n", ms);
+}
+
+/* Adds a write of size bytes of data at address, also to the compiled
+ * plan */
+void plan_write(unsigned int address, const unsigned char *data, int size,
+		long busy_ms)
+{
+	plan_compile_record(PLAN_RECORD_WRITE, address, data, size);
+	output_bytes += size;
+	plan_add(PLAN_WRITE, address, size, busy_ms);
+}
+
+void plan_report(void)
+{
+	long total = 0;
+	int op;
+
+	printf("Plan summary:\n");
+	for (op = 0; op < PLAN_OPS; op++) {
+		if (!counts[op])
+			continue;
+		printf("  %-11s %6i times", plan_names[op], counts[op]);
+		if (bytes[op])
+			printf(" %9lli bytes", bytes[op]);
+		else
+			printf("                ");
+		printf(" %7li ms\n", times[op]);
+		total += times[op];
+	}
+	printf("Estimated duration %li.%03li s, without retries\n",
+	       total / 1000, total % 1000);
+}
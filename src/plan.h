@@ -0,0 +1,90 @@
+/* Dry run of downloads, listing the planned operations with a time estimate
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include "dfu.h"
+#include "dfu_file.h"
+#include "poll_history.h"
+
+/* Every control request is taken to cost about this much */
+#define PLAN_REQUEST_TIME 1		/* ms */
+
+/* Rough payload rate of control transfers at full speed */
+#define PLAN_TRANSFER_RATE 500		/* bytes per ms */
+
+enum plan_op {
+	PLAN_UNPROTECT,
+	PLAN_MASS_ERASE,
+	PLAN_ERASE,		/* erase the page at address of size bytes */
+	PLAN_SET_ADDRESS,
+	PLAN_WRITE,		/* write size bytes at address or offset */
+	PLAN_MANIFEST,
+	PLAN_VERIFY,		/* read back size bytes */
+	PLAN_LEAVE,
+	PLAN_OPS
+};
+
+/* Compiled plan file */
+#define PLAN_FILE_MAGIC "DfuPlan"	/* with its terminating zero */
+#define PLAN_FILE_VERSION 1
+#define PLAN_HEADER_SIZE 36		/* followed by the layout string */
+#define PLAN_RECORD_SIZE 16
+
+enum plan_record_type {
+	PLAN_RECORD_END = 'Z',
+	PLAN_RECORD_ERASE = 'E',	/* page at address of size bytes */
+	PLAN_RECORD_MASS_ERASE = 'M',
+	PLAN_RECORD_WRITE = 'W',	/* size bytes of data follow */
+	PLAN_RECORD_LEAVE = 'L'
+};
+
+struct plan_header {
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	int xfer_size;
+	uint32_t image_size;
+	uint32_t image_crc;
+	uint32_t bytes;			/* written in total */
+	char *layout;			/* name of the alternate setting */
+};
+
+struct plan_record {
+	int type;
+	uint32_t address;
+	uint32_t size;
+	uint32_t crc;			/* of the data */
+};
+
+void plan_start(struct dfu_if *dif, int xfer_size, const char *output);
+long plan_busy_ms(enum busy_op op, int size);
+void plan_add(enum plan_op op, unsigned int address, long long size,
+	      long busy_ms);
+void plan_write(unsigned int address, const unsigned char *data, int size,
+		long busy_ms);
+void plan_report(void);
+
+int plan_compiling(void);
+int plan_compile_start(struct dfu_if *dif, struct dfu_file *image);
+int plan_compile_finish(struct dfu_if *dif, int ok);
+int plan_read_header(struct dfu_file *file, struct plan_header *header);
+int plan_read_record(struct dfu_file *file, struct plan_record *record);
+
+#endif /* PLAN_H */
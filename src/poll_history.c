@@ -0,0 +1,349 @@
+/* Busy times learned from earlier sessions with the same device model.
+ *
+ * Devices report in bwPollTimeout how long to wait before the next
+ * status request, but many report a fixed worst case or nothing useful
+ * at all. The time each erase, programming, DfuSe address change and
+ * manifestation actually took is therefore kept per device model in
+ * ~/.dfu-util/poll-<vendor>-<product>-<bcdDevice>, one line per
+ * operation and size with the most recent samples in milliseconds:
+ *
+ *    program 2048 12 11 12 13
+ *    erase 16384 230 228 241
+ *
+ * Once enough samples are known, the first status request after an
+ * operation is made when most earlier ones had completed, and further
+ * requests follow at shorter intervals. When the first request finds the
+ * operation done, half the time is recorded, so that the wait shrinks
+ * until it meets the real duration.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#ifdef HAVE_WINDOWS_H
+# include <io.h>
+# define make_dir(name) mkdir(name)
+#else
+# include <sys/stat.h>
+# define make_dir(name) mkdir(name, 0755)
+#endif
+
+#include "dfu.h"
+#include "dfu_file.h"
+#include "usb_dfu.h"
+#include "quirks.h"
+#include "progress.h"
+#include "poll_history.h"
+
+extern int verbose;
+
+#define POLL_HISTORY_SAMPLES 32	/* kept per operation and size */
+#define POLL_HISTORY_KEYS 16
+#define POLL_HISTORY_MIN 4	/* samples needed before they are used */
+#define POLL_HISTORY_PERCENTILE 75
+#define MANIFEST_POLL_START 10	/* ms, first step of the backoff */
+
+struct history_key {
+	enum busy_op op;
+	int size;
+	int count;
+	int next;
+	unsigned int ms[POLL_HISTORY_SAMPLES];
+};
+
+static const char *op_names[BUSY_OPS] = {
+	"program", "erase", "mass-erase", "set-address", "manifest"
+};
+
+static struct history_key keys[POLL_HISTORY_KEYS];
+static int num_keys;
+static int history_changed;
+static char *history_dir;
+static char *history_name;
+
+static struct history_key *find_key(enum busy_op op, int size, int create)
+{
+	int i;
+
+	for (i = 0; i < num_keys; i++)
+		if (keys[i].op == op && keys[i].size == size)
+			return &keys[i];
+	if (!create || num_keys == POLL_HISTORY_KEYS)
+		return NULL;
+	memset(&keys[num_keys], 0, sizeof(keys[0]));
+	keys[num_keys].op = op;
+	keys[num_keys].size = size;
+	return &keys[num_keys++];
+}
+
+static void add_sample(struct history_key *key, unsigned int ms)
+{
+	key->ms[key->next] = ms;
+	key->next = (key->next + 1) % POLL_HISTORY_SAMPLES;
+	if (key->count < POLL_HISTORY_SAMPLES)
+		key->count++;
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* returns the learned time to wait for op on size bytes, -1 if unknown */
+static int learned_wait(enum busy_op op, int size)
+{
+	struct history_key *key;
+	unsigned int sorted[POLL_HISTORY_SAMPLES];
+
+	if (op == BUSY_NONE)
+		return -1;
+	key = find_key(op, size, 0);
+	if (!key || key->count < POLL_HISTORY_MIN)
+		return -1;
+	memcpy(sorted, key->ms, key->count * sizeof(sorted[0]));
+	qsort(sorted, key->count, sizeof(sorted[0]), compare_ms);
+	return sorted[(key->count - 1) * POLL_HISTORY_PERCENTILE / 100];
+}
+
+/* returns the typical (median) learned time of op on size bytes, for
+ * estimates, -1 if unknown */
+int poll_history_estimate(enum busy_op op, int size)
+{
+	struct history_key *key;
+	unsigned int sorted[POLL_HISTORY_SAMPLES];
+
+	key = find_key(op, size, 0);
+	if (!key || key->count < POLL_HISTORY_MIN)
+		return -1;
+	memcpy(sorted, key->ms, key->count * sizeof(sorted[0]));
+	qsort(sorted, key->count, sizeof(sorted[0]), compare_ms);
+	return sorted[key->count / 2];
+}
+
+void poll_history_load(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
+{
+	char line[512];
+	const char *dir = getenv("DFU_UTIL_HISTORY");
+	FILE *filep;
+	int samples = 0;
+
+	if (dir) {
+		history_dir = strdup(dir);
+	} else {
+		const char *home = getenv("HOME");
+
+		if (!home)
+			return;
+		history_dir = malloc(strlen(home) + strlen(POLL_HISTORY_DIR) + 2);
+		if (history_dir)
+			sprintf(history_dir, "%s/%s", home, POLL_HISTORY_DIR);
+	}
+	if (!history_dir)
+		return;
+	history_name = malloc(strlen(history_dir) + 22);
+	if (!history_name)
+		return;
+	sprintf(history_name, "%s/poll-%04x-%04x-%04x", history_dir, vendor,
+		product, bcdDevice);
+
+	filep = fopen(history_name, "r");
+	if (!filep)
+		return;
+	while (fgets(line, sizeof(line), filep)) {
+		struct history_key *key;
+		char *word = strtok(line, " \t\r\n");
+		char *end;
+		long size, ms;
+		int op;
+
+		if (!word || word[0] == '#')
+			continue;
+		for (op = 0; op < BUSY_OPS; op++)
+			if (!strcmp(word, op_names[op]))
+				break;
+		word = strtok(NULL, " \t\r\n");
+		if (op == BUSY_OPS || !word)
+			continue;
+		size = strtol(word, &end, 10);
+		if (*end || size < 0)
+			continue;
+		key = find_key(op, size, 1);
+		if (!key)
+			continue;
+		while ((word = strtok(NULL, " \t\r\n"))) {
+			ms = strtol(word, &end, 10);
+			if (*end || ms < 0)
+				break;
+			add_sample(key, ms);
+			samples++;
+		}
+	}
+	fclose(filep);
+	if (verbose)
+		printf("Read %i busy time samples from %s\n", samples,
+		       history_name);
+}
+
+/* Writes back the history if anything was learned in this session. It
+ * is written to a temporary file first and then moved over the old one,
+ * so that a crash or another dfu-util saving at the same time can not
+ * leave it cut short or mixed. */
+void poll_history_save(void)
+{
+	struct dfu_file file;
+	char *tmpname;
+	FILE *filep;
+	int i, j;
+
+	if (!history_changed || !history_name)
+		return;
+	history_changed = 0;
+
+	if (make_dir(history_dir) < 0 && errno != EEXIST) {
+		perror(history_dir);
+		return;
+	}
+	memset(&file, 0, sizeof(file));
+	file.name = history_name;
+	filep = open_temp_file(&file, &tmpname);
+	if (!filep)
+		return;
+	fprintf(filep, "# dfu-util busy times in ms, oldest first\n");
+	for (i = 0; i < num_keys; i++) {
+		struct history_key *key = &keys[i];
+
+		fprintf(filep, "%s %i", op_names[key->op], key->size);
+		for (j = 0; j < key->count; j++)
+			fprintf(filep, " %u", key->ms[(key->next - key->count +
+				j + POLL_HISTORY_SAMPLES) % POLL_HISTORY_SAMPLES]);
+		fprintf(filep, "\n");
+	}
+	replace_file(&file, filep, tmpname);
+}
+
+static int is_busy(enum busy_op op, int state)
+{
+	if (op == BUSY_MANIFEST)
+		return state == DFU_STATE_dfuMANIFEST_SYNC ||
+		       state == DFU_STATE_dfuMANIFEST;
+	return state == DFU_STATE_dfuDNBUSY ||
+	       state == DFU_STATE_dfuDNLOAD_SYNC;
+}
+
+/* returns the wait the device asks for, or the configured one */
+static int reported_wait(struct dfu_status *dst)
+{
+	if (quirks & QUIRK_POLLTIMEOUT)
+		return profile.poll_timeout;
+	return dst->bwPollTimeout;
+}
+
+/* returns the wait before the first status request in manifestation,
+ * the learned time if there is one. Some devices (e.g. TAS1020b) need
+ * some time before we can obtain the status, so otherwise it is at least
+ * the manifest wait of the profile. */
+int poll_manifest_wait(struct dfu_status *dst)
+{
+	int learned = learned_wait(BUSY_MANIFEST, 0);
+
+	if (learned >= 0)
+		return learned;
+	if (reported_wait(dst) > profile.manifest_wait)
+		return reported_wait(dst);
+	return profile.manifest_wait;
+}
+
+/* returns the wait the device asks for in its current state, or the
+ * configured one, 0 if the status can not be read */
+int poll_timeout_now(struct dfu_if *dif)
+{
+	struct dfu_status dst;
+
+	if (quirks & QUIRK_POLLTIMEOUT)
+		return profile.poll_timeout;
+	if (dfu_get_status(dif->dev_handle, dif->interface, &dst) < 0)
+		return 0;
+	return dst.bwPollTimeout;
+}
+
+/* Requests the status until the device is no longer busy with op on size
+ * bytes, starting from the status in dst which is updated. The first
+ * request is timed from the learned busy time if there is one, otherwise
+ * from the poll timeout, or in manifestation from poll_manifest_wait(),
+ * and the observed time is added to the history.
+ * returns 0 on success, the libusb error code on transfer errors */
+int poll_busy(struct dfu_if *dif, struct dfu_status *dst, enum busy_op op,
+	      int size)
+{
+	struct history_key *key;
+	int learned = learned_wait(op, size);
+	int wait, polls = 0;
+	int backoff = MANIFEST_POLL_START;
+	long start = milli_time();
+	long elapsed;
+	int ret;
+
+	if (op == BUSY_MANIFEST)
+		wait = poll_manifest_wait(dst);
+	else
+		wait = learned >= 0 ? learned : reported_wait(dst);
+	while (is_busy(op, dst->bState)) {
+		if (verbose > 1)
+			printf("   Poll timeout %i ms%s\n", wait,
+			       learned >= 0 && !polls ? " (learned)" : "");
+		milli_sleep(wait);
+		ret = dfu_get_status(dif->dev_handle, dif->interface, dst);
+		if (ret < 0)
+			return ret;
+		polls++;
+
+		wait = reported_wait(dst);
+		if (learned >= 0) {
+			/* missed it, check back soon */
+			if (learned / 4 < wait)
+				wait = learned / 4 + 1;
+		} else if (op == BUSY_MANIFEST) {
+			/* manifestation often takes much longer than the
+			 * poll timeout, back off up to the profile wait */
+			if (wait < backoff)
+				wait = backoff;
+			backoff += backoff / 2;
+			if (backoff > profile.manifest_wait)
+				backoff = profile.manifest_wait;
+		}
+	}
+
+	elapsed = milli_time() - start;
+	if (op == BUSY_NONE || !polls || dst->bStatus != DFU_STATUS_OK)
+		return 0;
+	/* done on the first request, possibly well before it, so try a
+	 * shorter wait next time */
+	if (polls == 1)
+		elapsed /= 2;
+	key = find_key(op, size, 1);
+	if (key) {
+		add_sample(key, elapsed);
+		history_changed = 1;
+	}
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* Busy times learned from earlier sessions with the same device model
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef POLL_HISTORY_H
+#define POLL_HISTORY_H
+
+#include <stdint.h>
+#include "dfu.h"
+
+/* Operations that keep the device busy, their durations are learned
+ * per operation and size */
+enum busy_op {
+	BUSY_NONE = -1,		/* not learned */
+	BUSY_PROGRAM,		/* programming a chunk of the given size */
+	BUSY_ERASE,		/* erasing a page of the given size */
+	BUSY_MASS_ERASE,
+	BUSY_SET_ADDRESS,
+	BUSY_MANIFEST,
+	BUSY_OPS
+};
+
+/* Directory below $HOME, overridden by the DFU_UTIL_HISTORY variable */
+#define POLL_HISTORY_DIR ".dfu-util"
+
+void poll_history_load(uint16_t vendor, uint16_t product, uint16_t bcdDevice);
+void poll_history_save(void);
+int poll_history_estimate(enum busy_op op, int size);
+int poll_timeout_now(struct dfu_if *dif);
+int poll_manifest_wait(struct dfu_status *dst);
+int poll_busy(struct dfu_if *dif, struct dfu_status *dst, enum busy_op op,
+	      int size);
+
+#endif /* POLL_HISTORY_H */
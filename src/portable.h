@@ -15,4 +15,25 @@
 # error "Can't get no sleep! Please report"
 #endif /* HAVE_USLEEP */
 
+/* File positions beyond 2 GiB need off_t, not long */
+#ifndef HAVE_FSEEKO
+# define fseeko(stream, offset, whence) fseek(stream, offset, whence)
+# define ftello(stream) ftell(stream)
+#endif
+
+/* Decompressors are read and compressors written through a pipe, in
+ * binary mode on Windows */
+#if !defined HAVE_POPEN && defined HAVE_WINDOWS_H
+# define popen(command, mode) _popen(command, mode)
+# define pclose(stream) _pclose(stream)
+# define HAVE_POPEN 1
+#endif
+#ifdef HAVE_WINDOWS_H
+# define POPEN_READ "rb"
+# define POPEN_WRITE "wb"
+#else
+# define POPEN_READ "r"
+# define POPEN_WRITE "w"
+#endif
+
 #endif /* PORTABLE_H */
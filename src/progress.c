@@ -0,0 +1,235 @@
+/* Progress reporting for uploads, downloads and verification.
+ *
+ * The transfer loops only add to a byte counter, everything else happens
+ * when the counter passes the next reporting step. Reports go to one
+ * sink: the hash mark bar on stdout, JSON lines on a file descriptor for
+ * other programs to parse, or a callback function. JSON lines and
+ * callbacks are sent at most every PROGRESS_INTERVAL ms, apart from the
+ * final report of each phase, and look like
+ *
+ *   {"phase":"download","bytes":16384,"total":40000,"elapsed_ms":120,
+ *    "rate":136533,"eta_ms":173,"done":false}
+ *
+ * with rate in bytes/s since the previous report, and null for the total
+ * and ETA when the size is not known in advance.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+# include <sys/time.h>
+#endif
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+
+#include "progress.h"
+
+extern int verbose;
+
+#define PROGRESS_BAR_WIDTH 50
+#define PROGRESS_INTERVAL 100		/* ms between JSON lines */
+#define PROGRESS_UNKNOWN_STEP 16384	/* bytes per report, size unknown */
+
+enum progress_sink {
+	SINK_BAR,
+	SINK_JSON,
+	SINK_CALLBACK,
+	SINK_NONE
+};
+
+struct progress progress;
+
+static enum progress_sink sink = SINK_BAR;
+static FILE *json_file;
+static progress_callback callback;
+static void *callback_data;
+static int hashes;
+
+long milli_time(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+#elif defined HAVE_WINDOWS_H
+	return GetTickCount();
+#else
+	return time(NULL) * 1000L;
+#endif
+}
+
+/* Sends progress as JSON lines to the file descriptor fd instead of
+ * drawing the bar on stdout */
+void progress_json_fd(int fd)
+{
+	json_file = fdopen(fd, "w");
+	if (!json_file) {
+		perror("Progress file descriptor");
+		exit(1);
+	}
+	sink = SINK_JSON;
+}
+
+/* Passes progress to function instead of drawing the bar on stdout */
+void progress_set_callback(progress_callback function, void *data)
+{
+	callback = function;
+	callback_data = data;
+	sink = function ? SINK_CALLBACK : SINK_BAR;
+}
+
+/* Reports nothing at all, for dry runs */
+void progress_quiet(void)
+{
+	sink = SINK_NONE;
+}
+
+const char *progress_phase_name(enum progress_phase phase)
+{
+	switch (phase) {
+	case PROGRESS_UPLOAD:
+		return "upload";
+	case PROGRESS_DOWNLOAD:
+		return "download";
+	case PROGRESS_VERIFY:
+		return "verify";
+	}
+	return "unknown";
+}
+
+static void draw_bar(void)
+{
+	int todo;
+
+	/* the per request messages would break up the bar */
+	if (verbose)
+		return;
+	if (progress.total)
+		todo = progress.bytes * PROGRESS_BAR_WIDTH / progress.total -
+		       hashes;
+	else
+		todo = 1;
+	hashes += todo;
+	while (todo-- > 0)
+		putchar('#');
+	fflush(stdout);
+}
+
+static void send_json(void)
+{
+	fprintf(json_file, "{\"phase\":\"%s\",\"bytes\":%lli,",
+		progress_phase_name(progress.phase), progress.bytes);
+	if (progress.total)
+		fprintf(json_file, "\"total\":%lli,", progress.total);
+	else
+		fprintf(json_file, "\"total\":null,");
+	fprintf(json_file, "\"elapsed_ms\":%li,\"rate\":%lli,",
+		progress.elapsed, progress.rate);
+	if (progress.eta >= 0)
+		fprintf(json_file, "\"eta_ms\":%li,", progress.eta);
+	else
+		fprintf(json_file, "\"eta_ms\":null,");
+	fprintf(json_file, "\"done\":%s}\n", progress.done ? "true" : "false");
+	fflush(json_file);
+}
+
+/* Works out the rate and ETA and passes them on, if it is time for it */
+static void send_report(void)
+{
+	long now = milli_time();
+
+	if (!progress.done && now - progress.last_ms < PROGRESS_INTERVAL)
+		return;
+
+	progress.elapsed = now - progress.start_ms;
+	if (now > progress.last_ms)
+		progress.rate = (progress.bytes - progress.last_bytes) * 1000 /
+				(now - progress.last_ms);
+	progress.last_ms = now;
+	progress.last_bytes = progress.bytes;
+	if (progress.done)
+		progress.eta = 0;
+	else if (progress.total && progress.bytes)
+		progress.eta = (double) progress.elapsed *
+			       (progress.total - progress.bytes) / progress.bytes;
+	else
+		progress.eta = -1;
+
+	if (sink == SINK_JSON)
+		send_json();
+	else
+		callback(&progress, callback_data);
+}
+
+/* Starts a phase transferring total bytes, or an unknown amount if 0 */
+void progress_start(enum progress_phase phase, long long total)
+{
+	memset(&progress, 0, sizeof(progress));
+	progress.phase = phase;
+	progress.total = total;
+	progress.eta = -1;
+	progress.start_ms = progress.last_ms = milli_time();
+	if (total)
+		progress.step = total / PROGRESS_BAR_WIDTH;
+	else
+		progress.step = PROGRESS_UNKNOWN_STEP;
+	if (progress.step < 1)
+		progress.step = 1;
+	progress.next_report = progress.step;
+	hashes = 0;
+
+	if (sink == SINK_BAR && !verbose) {
+		printf("Starting %s: [", progress_phase_name(phase));
+		fflush(stdout);
+	}
+}
+
+/* Called by progress_add() when the counter passes the next step */
+void progress_report(void)
+{
+	while (progress.next_report <= progress.bytes)
+		progress.next_report += progress.step;
+	if (sink == SINK_BAR)
+		draw_bar();
+	else if (sink != SINK_NONE)
+		send_report();
+}
+
+void progress_finish(void)
+{
+	progress.done = 1;
+	if (sink == SINK_NONE)
+		return;
+	if (sink != SINK_BAR) {
+		send_report();
+		return;
+	}
+	if (verbose)
+		return;
+	if (progress.total && progress.bytes >= progress.total)
+		draw_bar();
+	printf("] finished!\n");
+	fflush(stdout);
+}
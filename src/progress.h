@@ -0,0 +1,65 @@
+/* Progress reporting for uploads, downloads and verification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+enum progress_phase {
+	PROGRESS_UPLOAD,
+	PROGRESS_DOWNLOAD,
+	PROGRESS_VERIFY
+};
+
+struct progress {
+	enum progress_phase phase;
+	long long total;	/* bytes expected, 0 if not known */
+	long long bytes;	/* bytes transferred so far */
+	long elapsed;		/* ms since the phase started */
+	long long rate;		/* bytes/s since the previous report */
+	long eta;		/* ms left, -1 if not known */
+	int done;		/* set in the last report of a phase */
+
+	/* internal */
+	long long next_report;	/* byte count that triggers a report */
+	long long step;
+	long start_ms;
+	long last_ms;
+	long long last_bytes;
+};
+
+typedef void (*progress_callback)(const struct progress *progress,
+				  void *data);
+
+extern struct progress progress;
+
+/* Counts len more bytes, only every step bytes is anything else done */
+#define progress_add(len) do { \
+	progress.bytes += (len); \
+	if (progress.bytes >= progress.next_report) \
+		progress_report(); \
+} while (0)
+
+long milli_time(void);
+void progress_json_fd(int fd);
+void progress_set_callback(progress_callback callback, void *data);
+void progress_quiet(void);
+const char *progress_phase_name(enum progress_phase phase);
+void progress_start(enum progress_phase phase, long long total);
+void progress_report(void);
+void progress_finish(void);
+
+#endif /* PROGRESS_H */
@@ -1,6 +1,30 @@
 /*  Simple quirk system for dfu-util
  *  Copyright 2010 Tormod Volden
  *
+ *  Quirks and timing profiles are described by entries of the form
+ *
+ *    <vendor> <product> <bcdDevice> <setting>...
+ *
+ *  where each ID is a hexadecimal number, a range like 0100-01ff or * for
+ *  any value. The settings are
+ *
+ *    polltimeout=<ms>    ignore bwPollTimeout, wait <ms> instead
+ *    force-dfu11         treat the device as DFU 1.1
+ *    transfer-size=<n>   default transfer size
+ *    skip-set-address    the DfuSe address pointer follows consecutive
+ *                        chunks, so it is only set when needed (block
+ *                        numbers count in units of the device's own
+ *                        wTransferSize, so do not combine with another
+ *                        transfer size)
+ *    detach-delay=<ms>   wait for the device to reattach after detach
+ *    manifest-wait=<ms>  first and longest wait between requests during
+ *                        manifestation, until its time is learned
+ *    erase-time=<ms>     time per KiB of flash erased page by page
+ *    mass-erase-time=<ms> time of a DfuSe mass erase
+ *
+ *  The built-in entries below are read first, then the profile file.
+ *  All matching entries apply in order, so later ones can override.
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -16,22 +40,178 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "quirks.h"
 
+extern int verbose;
+
 int quirks = 0;
 
-void set_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
-{
-	/* Device returns bogus bwPollTimeout values */
-	if (vendor == VENDOR_OPENMOKO ||
-	    vendor == VENDOR_FIC ||
-	    vendor == VENDOR_VOTI)
-		quirks |= QUIRK_POLLTIMEOUT;
+struct dfu_profile profile = {
+	.poll_timeout = DEFAULT_POLLTIMEOUT,
+	.transfer_size = 0,
+	.detach_delay = 2000,
+	.manifest_wait = 1000,
+};
 
+/* profile entries are written like the profiles file, IDs as 0x1234 */
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+static const char *builtin_profiles[] = {
+	/* Device returns bogus bwPollTimeout values */
+	XSTR(VENDOR_OPENMOKO) " * * polltimeout=" XSTR(DEFAULT_POLLTIMEOUT),
+	XSTR(VENDOR_FIC) " * * polltimeout=" XSTR(DEFAULT_POLLTIMEOUT),
+	XSTR(VENDOR_VOTI) " * * polltimeout=" XSTR(DEFAULT_POLLTIMEOUT),
 	/* Reports wrong DFU version in DFU descriptor */
-	if (vendor == VENDOR_LEAFLABS &&
-	    product == PRODUCT_MAPLE3 &&
-	    bcdDevice == 0x0200)
+	XSTR(VENDOR_LEAFLABS) " " XSTR(PRODUCT_MAPLE3) " 0x0200 force-dfu11",
+	NULL
+};
+
+/* returns 1 if value matches the ID field, 0 if not, -1 on syntax error */
+static int match_id(const char *field, uint16_t value)
+{
+	unsigned long low, high;
+	char *end;
+
+	if (!strcmp(field, "*"))
+		return 1;
+	low = strtoul(field, &end, 16);
+	high = low;
+	if (*end == '-')
+		high = strtoul(end + 1, &end, 16);
+	if (end == field || *end || low > 0xffff || high > 0xffff)
+		return -1;
+	return value >= low && value <= high;
+}
+
+static int apply_setting(const char *setting)
+{
+	const char *value = strchr(setting, '=');
+	long number = 0;
+	char *end;
+
+	if (value) {
+		number = strtol(value + 1, &end, 0);
+		if (end == value + 1 || *end || number < 0)
+			return -1;
+	}
+
+	if (!strcmp(setting, "force-dfu11")) {
 		quirks |= QUIRK_FORCE_DFU11;
+	} else if (!strcmp(setting, "skip-set-address")) {
+		quirks |= QUIRK_SKIP_SET_ADDRESS;
+	} else if (!value) {
+		return -1;
+	} else if (!strncmp(setting, "polltimeout=", value - setting + 1)) {
+		quirks |= QUIRK_POLLTIMEOUT;
+		profile.poll_timeout = number;
+	} else if (!strncmp(setting, "transfer-size=", value - setting + 1)) {
+		profile.transfer_size = number;
+	} else if (!strncmp(setting, "detach-delay=", value - setting + 1)) {
+		profile.detach_delay = number;
+	} else if (!strncmp(setting, "manifest-wait=", value - setting + 1)) {
+		profile.manifest_wait = number;
+	} else if (!strncmp(setting, "erase-time=", value - setting + 1)) {
+		profile.erase_time = number;
+	} else if (!strncmp(setting, "mass-erase-time=", value - setting + 1)) {
+		profile.mass_erase_time = number;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* Applies the entry in line if it matches the device
+ * returns 0 on success, -1 on syntax errors */
+static int apply_profile(char *line, uint16_t vendor, uint16_t product,
+			 uint16_t bcdDevice)
+{
+	const char *sep = " \t\r\n";
+	char *ids[3];
+	char *setting;
+	int i, match = 1;
+
+	/* comments and empty lines */
+	line[strcspn(line, "#")] = 0;
+	ids[0] = strtok(line, sep);
+	if (!ids[0])
+		return 0;
+	ids[1] = strtok(NULL, sep);
+	ids[2] = strtok(NULL, sep);
+	if (!ids[2])
+		return -1;
+
+	for (i = 0; i < 3; i++) {
+		int ret = match_id(ids[i], i == 0 ? vendor :
+				   i == 1 ? product : bcdDevice);
+		if (ret < 0)
+			return -1;
+		match &= ret;
+	}
+
+	while ((setting = strtok(NULL, sep))) {
+		if (match && apply_setting(setting) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void load_profile_file(uint16_t vendor, uint16_t product,
+			      uint16_t bcdDevice)
+{
+	char line[256];
+	char *name = getenv("DFU_UTIL_PROFILES");
+	char *path = NULL;
+	FILE *filep;
+	int lineno = 0;
+
+	if (!name) {
+		const char *home = getenv("HOME");
+
+		if (!home)
+			return;
+		path = malloc(strlen(home) + strlen(PROFILE_FILE) + 2);
+		if (!path)
+			return;
+		sprintf(path, "%s/%s", home, PROFILE_FILE);
+		name = path;
+	}
+
+	filep = fopen(name, "r");
+	if (filep) {
+		if (verbose)
+			printf("Reading device profiles from %s\n", name);
+		while (fgets(line, sizeof(line), filep)) {
+			lineno++;
+			if (apply_profile(line, vendor, product, bcdDevice))
+				fprintf(stderr, "Warning: Invalid profile "
+					"entry in %s line %i\n", name, lineno);
+		}
+		fclose(filep);
+	}
+	free(path);
+}
+
+void set_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
+{
+	char line[256];
+	int i;
+
+	for (i = 0; builtin_profiles[i]; i++) {
+		strcpy(line, builtin_profiles[i]);
+		apply_profile(line, vendor, product, bcdDevice);
+	}
+	load_profile_file(vendor, product, bcdDevice);
+
+	if (verbose > 1)
+		printf("Quirks 0x%x, poll timeout %i ms, transfer size %i, "
+		       "detach delay %i ms, manifest wait %i ms, erase time "
+		       "%i ms/KiB, mass erase time %i ms\n", quirks,
+		       profile.poll_timeout, profile.transfer_size,
+		       profile.detach_delay, profile.manifest_wait,
+		       profile.erase_time, profile.mass_erase_time);
 }
@@ -9,11 +9,27 @@
 
 #define QUIRK_POLLTIMEOUT  (1<<0)
 #define QUIRK_FORCE_DFU11  (1<<1)
+#define QUIRK_SKIP_SET_ADDRESS (1<<2)
 
 /* Fallback value, works for OpenMoko */
 #define DEFAULT_POLLTIMEOUT  5
 
+/* Per-device timing and transfer settings, the defaults apply unless a
+ * profile entry for the device changes them */
+struct dfu_profile {
+	int poll_timeout;	/* ms, used instead of bogus bwPollTimeout */
+	int transfer_size;	/* 0 for the functional descriptor value */
+	int detach_delay;	/* ms to wait for the device to reattach */
+	int manifest_wait;	/* longest ms between manifestation requests */
+	int erase_time;		/* ms per KiB of page erase, 0 if not known */
+	int mass_erase_time;	/* ms, 0 if not known */
+};
+
+/* Profile file location, overridden by the DFU_UTIL_PROFILES variable */
+#define PROFILE_FILE ".dfu-util/profiles"
+
 extern int quirks;
+extern struct dfu_profile profile;
 
 void set_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice);
 
@@ -0,0 +1,564 @@
+/* Several operations on one claimed DFU interface.
+ *
+ * Uploads and downloads are run from here, both for the single operation
+ * given on the command line and for session scripts. A script lists
+ * operations one per line, which are then run in order on the same
+ * claimed interface, without detaching or reenumerating in between:
+ *
+ *   # replace the firmware and keep a copy of the calibration page
+ *   mass-erase
+ *   alt @Internal Flash  /0x08000000/64*002Kg
+ *   verify on
+ *   download firmware.bin 0x08000000
+ *   upload calibration.bin 0x0801f800:2048
+ *   leave
+ *
+ * download and upload take a file name and optional DfuSe modifiers as
+ * for --dfuse-address, alt takes the rest of the line as the name or
+ * number of the alternate setting. verify on|off sets read back after
+ * the following downloads, mass-erase and leave are for DfuSe devices,
+ * reset resets the device. leave and reset end the session, so they can
+ * only be the last command. The whole script is checked before the
+ * first command is sent to the device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_load.h"
+#include "dfuse.h"
+#include "session.h"
+#include "sink.h"
+#include "stream.h"
+
+extern int verbose;
+extern int verify;
+
+#define SCRIPT_LINE_MAX 1024
+
+enum step_command {
+	STEP_ALT,
+	STEP_DOWNLOAD,
+	STEP_UPLOAD,
+	STEP_VERIFY,
+	STEP_MASS_ERASE,
+	STEP_LEAVE,
+	STEP_RESET
+};
+
+static const struct {
+	const char *name;
+	enum step_command command;
+	int min_args;
+	int max_args;
+	int dfuse_only;
+} commands[] = {
+	{ "alt", STEP_ALT, 1, 1, 0 },
+	{ "download", STEP_DOWNLOAD, 1, 2, 0 },
+	{ "upload", STEP_UPLOAD, 1, 2, 0 },
+	{ "verify", STEP_VERIFY, 1, 1, 0 },
+	{ "mass-erase", STEP_MASS_ERASE, 0, 0, 1 },
+	{ "leave", STEP_LEAVE, 0, 0, 1 },
+	{ "reset", STEP_RESET, 0, 0, 0 },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+struct step {
+	int command;		/* index into commands[] */
+	char *arg;		/* alternate setting, file name or on/off */
+	char *options;		/* DfuSe modifiers, or NULL */
+	int line;
+	struct step *next;
+};
+
+int session_upload(struct session *s, const char *name,
+		   const char *dfuse_options)
+{
+	struct dfu_file file;
+	const char *command;
+	off_t pos = -1;
+	int ret;
+
+	memset(&file, 0, sizeof(file));
+	if (!strcmp(name, "-")) {
+		file.name = "standard output";
+		file.filep = sink_claim_stdout();
+		if (!file.filep)
+			return -EIO;
+	} else {
+		file.name = name;
+		/* open for "exclusive" writing in a portable way */
+		file.filep = fopen(file.name, "ab");
+		if (file.filep == NULL) {
+			perror(file.name);
+			return -errno;
+		}
+		/* pipes and character devices have no position */
+		pos = ftello(file.filep);
+	}
+	/* a partial upload can be continued with the resume
+	 * modifier, the DfuSe code checks the existing data */
+	if (pos > 0 &&
+	    !(dfuse_options && dfuse_upload_resumes(dfuse_options))) {
+		fprintf(stderr, "%s: File exists\n", file.name);
+		fclose(file.filep);
+		return -EEXIST;
+	}
+	command = s->compress ? s->compress : stream_compressor(name);
+	if (command || pos < 0) {
+		if (command)
+			printf("Compressing %s on the fly with %s\n",
+			       file.name, command);
+		ret = sink_open(&file, command);
+		if (ret < 0)
+			return ret;
+	}
+	if (s->dfuse_device || dfuse_options)
+		ret = dfuse_do_upload(s->dif, s->xfer_size, file,
+				      dfuse_options);
+	else
+		ret = dfuload_do_upload(s->dif, s->xfer_size, file);
+	if (file.sink) {
+		if (sink_close(&file, ret >= 0) < 0 && ret >= 0)
+			ret = -EIO;
+	} else {
+		fclose(file.filep);
+	}
+	return ret;
+}
+
+/* Checks the DFU suffix of a download against the device
+ * returns 0 if it can be downloaded, negative otherwise */
+static int session_check_suffix(struct dfu_if *dif, struct dfu_file *file)
+{
+	if (file->bcdDFU && file->bcdDFU != 0x0100 && file->bcdDFU != 0x11a) {
+		fprintf(stderr, "Unsupported DFU file revision "
+			"%04x\n", file->bcdDFU);
+		return -EINVAL;
+	}
+	if (file->idVendor != 0xffff &&
+	    dif->vendor != file->idVendor) {
+		fprintf(stderr, "Warning: File vendor ID %04x does "
+			"not match device %04x\n", file->idVendor, dif->vendor);
+	}
+	if (file->idProduct != 0xffff &&
+	    dif->product != file->idProduct) {
+		fprintf(stderr, "Warning: File product ID %04x does "
+			"not match device %04x\n", file->idProduct, dif->product);
+	}
+	return 0;
+}
+
+/* Downloads a compressed image through its decompressor, or else the
+ * open file->filep that can not seek. The DFU suffix is only seen at the
+ * end, so it can only be checked afterwards. */
+static int session_download_stream(struct session *s, struct dfu_file *file,
+				   const char *command,
+				   const char *dfuse_options)
+{
+	struct dfu_if *dif = s->dif;
+	int ret;
+
+	if (command) {
+		printf("Decompressing %s on the fly with %s\n", file->name,
+		       command);
+		ret = stream_open(file, command);
+	} else {
+		printf("Reading %s as a stream\n", file->name);
+		ret = stream_attach(file);
+	}
+	if (ret < 0)
+		return ret;
+	if (s->dfuse_device || dfuse_options)
+		ret = dfuse_do_dnload(dif, s->xfer_size, *file, dfuse_options);
+	else
+		ret = dfuload_do_dnload(dif, s->xfer_size, *file);
+	stream_close(file);
+	if (ret < 0)
+		return ret;
+
+	if (file->suffixlen)
+		printf("Dfu suffix version %x\n", file->bcdDFU);
+	else
+		fprintf(stderr, "Warning: File has no DFU suffix\n");
+	if (file->bcdDFU == 0x11a) {
+		fprintf(stderr, "Error: %s was a DfuSe file, not meant for "
+			"raw download\n", file->name);
+		return -EINVAL;
+	}
+	return session_check_suffix(dif, file);
+}
+
+int session_download(struct session *s, const char *name,
+		     const char *dfuse_options)
+{
+	struct dfu_if *dif = s->dif;
+	struct dfu_file file;
+	const char *command;
+	int dfuse;
+	int ret;
+
+	memset(&file, 0, sizeof(file));
+	if (!strcmp(name, "-")) {
+		file.name = "standard input";
+		file.filep = stdin;
+		return session_download_stream(s, &file, NULL, dfuse_options);
+	}
+	file.name = name;
+	file.filep = fopen(file.name, "rb");
+	if (file.filep == NULL) {
+		perror(file.name);
+		return -errno;
+	}
+	command = stream_decompressor(name);
+	if (command) {
+		fclose(file.filep);
+		return session_download_stream(s, &file, command,
+					       dfuse_options);
+	}
+	/* pipes and character devices */
+	if (fseeko(file.filep, 0, SEEK_END) && errno == ESPIPE)
+		return session_download_stream(s, &file, NULL, dfuse_options);
+	ret = parse_dfu_suffix(&file);
+	if (ret < 0)
+		goto out;
+	if (ret == 0)
+		fprintf(stderr, "Warning: File has no DFU suffix\n");
+	ret = session_check_suffix(dif, &file);
+	if (ret < 0)
+		goto out;
+	dfuse = s->dfuse_device || dfuse_options || file.bcdDFU == 0x11a;
+	if (!dfuse && detect_file_format(&file) != DFU_FORMAT_RAW) {
+		fprintf(stderr, "Warning: %s file will be sent as is, "
+			"addresses are only used with DfuSe devices\n",
+			file_format_to_string(detect_file_format(&file)));
+	}
+	if (dfuse)
+		ret = dfuse_do_dnload(dif, s->xfer_size, file, dfuse_options);
+	else
+		ret = dfuload_do_dnload(dif, s->xfer_size, file);
+out:
+	fclose(file.filep);
+	return ret;
+}
+
+/* Detaches and resets the device, so that it runs its application */
+int session_reset(struct session *s)
+{
+	struct dfu_if *dif = s->dif;
+	int ret;
+
+	if (dfu_detach(dif->dev_handle, dif->interface, 1000) < 0) {
+		fprintf(stderr, "can't detach\n");
+	}
+	printf("Resetting USB to switch back to runtime mode\n");
+	ret = libusb_reset_device(dif->dev_handle);
+	dif->flags |= DFU_IFF_GONE;
+	if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+		fprintf(stderr, "error resetting after download\n");
+		return ret;
+	}
+	return 0;
+}
+
+/* Brings the device back to dfuIDLE after the previous command */
+static int session_idle(struct session *s)
+{
+	struct dfu_if *dif = s->dif;
+	struct dfu_status status;
+	int tries;
+
+	for (tries = 0; tries < 3; tries++) {
+		if (dfu_get_status(dif->dev_handle, dif->interface,
+				   &status) < 0) {
+			fprintf(stderr, "error get_status\n");
+			return -EIO;
+		}
+		switch (status.bState) {
+		case DFU_STATE_dfuIDLE:
+			if (status.bStatus == DFU_STATUS_OK)
+				return 0;
+			/* fall through */
+		case DFU_STATE_dfuERROR:
+			if (verbose)
+				printf("Clearing status '%s'\n",
+				       dfu_status_to_string(status.bStatus));
+			dfu_clear_status(dif->dev_handle, dif->interface);
+			break;
+		case DFU_STATE_dfuDNLOAD_IDLE:
+		case DFU_STATE_dfuUPLOAD_IDLE:
+			if (verbose)
+				printf("Aborting to leave %s\n",
+				       dfu_state_to_string(status.bState));
+			dfu_abort(dif->dev_handle, dif->interface);
+			break;
+		default:
+			fprintf(stderr, "Device is in state %s\n",
+				dfu_state_to_string(status.bState));
+			return -EIO;
+		}
+	}
+	fprintf(stderr, "Device does not return to dfuIDLE\n");
+	return -EIO;
+}
+
+static void free_steps(struct step *list)
+{
+	while (list) {
+		struct step *next = list->next;
+
+		free(list->arg);
+		free(list->options);
+		free(list);
+		list = next;
+	}
+}
+
+/* Splits one script line into a step, returns NULL and sets *ret on
+ * errors, NULL with *ret 0 for empty lines */
+static struct step *parse_line(const struct session *s, char *line,
+			       const char *name, int lineno, int *ret)
+{
+	struct step *step;
+	char *args[3];
+	char *p;
+	int nargs = 0;
+	unsigned int i;
+
+	*ret = -EINVAL;
+	line[strcspn(line, "\r\n")] = '\0';
+	/* a word starting with # comments out the rest of the line */
+	for (p = line; (p = strchr(p, '#')); p++) {
+		if (p == line || isspace((unsigned char) p[-1])) {
+			*p = '\0';
+			break;
+		}
+	}
+	for (p = line; isspace((unsigned char) *p); p++)
+		;
+	if (!*p) {
+		*ret = 0;
+		return NULL;
+	}
+	args[0] = p;
+	p += strcspn(p, " \t");
+	if (*p)
+		*p++ = '\0';
+
+	for (i = 0; i < NUM_COMMANDS; i++)
+		if (!strcmp(args[0], commands[i].name))
+			break;
+	if (i == NUM_COMMANDS) {
+		fprintf(stderr, "%s:%i: Unknown command \"%s\"\n",
+			name, lineno, args[0]);
+		return NULL;
+	}
+
+	while (*p) {
+		while (isspace((unsigned char) *p))
+			p++;
+		if (!*p)
+			break;
+		if (nargs == commands[i].max_args) {
+			fprintf(stderr, "%s:%i: Too many arguments for %s\n",
+				name, lineno, commands[i].name);
+			return NULL;
+		}
+		args[++nargs] = p;
+		if (commands[i].command == STEP_ALT) {
+			/* names can have spaces, take the rest of the line */
+			p += strlen(p);
+			while (isspace((unsigned char) p[-1]))
+				p--;
+		} else {
+			p += strcspn(p, " \t");
+		}
+		if (*p)
+			*p++ = '\0';
+	}
+	if (nargs < commands[i].min_args) {
+		fprintf(stderr, "%s:%i: Missing argument for %s\n",
+			name, lineno, commands[i].name);
+		return NULL;
+	}
+	if (commands[i].command == STEP_VERIFY &&
+	    strcmp(args[1], "on") && strcmp(args[1], "off")) {
+		fprintf(stderr, "%s:%i: verify takes on or off\n",
+			name, lineno);
+		return NULL;
+	}
+	if (commands[i].command == STEP_UPLOAD && !strcmp(args[1], "-")) {
+		fprintf(stderr, "%s:%i: Only -U can upload to standard "
+			"output\n", name, lineno);
+		return NULL;
+	}
+	if (commands[i].command == STEP_DOWNLOAD && !strcmp(args[1], "-") &&
+	    !strcmp(name, "-")) {
+		fprintf(stderr, "%s:%i: The script is read from standard "
+			"input, download needs a file\n", name, lineno);
+		return NULL;
+	}
+	if (commands[i].dfuse_only && !s->dfuse_device) {
+		fprintf(stderr, "%s:%i: %s is only for DfuSe devices\n",
+			name, lineno, commands[i].name);
+		return NULL;
+	}
+
+	step = calloc(1, sizeof(*step));
+	if (!step) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	step->command = i;
+	step->line = lineno;
+	if ((nargs >= 1 && !(step->arg = strdup(args[1]))) ||
+	    (nargs >= 2 && !(step->options = strdup(args[2])))) {
+		free_steps(step);
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	*ret = 0;
+	return step;
+}
+
+/* Reads and checks the whole script, "-" is standard input */
+static int read_script(const struct session *s, const char *name,
+		       struct step **list)
+{
+	struct step **tail = list;
+	struct step *step;
+	char line[SCRIPT_LINE_MAX];
+	FILE *f;
+	int lineno = 0;
+	int ended = 0;
+	int ret = 0;
+
+	*list = NULL;
+	if (!strcmp(name, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(name, "r");
+		if (!f) {
+			perror(name);
+			return -errno;
+		}
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (!strchr(line, '\n') && !feof(f)) {
+			fprintf(stderr, "%s:%i: Line too long\n", name, lineno);
+			ret = -EINVAL;
+			break;
+		}
+		step = parse_line(s, line, name, lineno, &ret);
+		if (ret < 0)
+			break;
+		if (!step)
+			continue;
+		if (ended) {
+			fprintf(stderr, "%s:%i: Nothing can follow %s\n",
+				name, lineno, commands[ended - 1].name);
+			free_steps(step);
+			ret = -EINVAL;
+			break;
+		}
+		if (commands[step->command].command == STEP_LEAVE ||
+		    commands[step->command].command == STEP_RESET)
+			ended = step->command + 1;
+		*tail = step;
+		tail = &step->next;
+	}
+	if (!ret && ferror(f)) {
+		perror(name);
+		ret = -EIO;
+	}
+	if (f != stdin)
+		fclose(f);
+	if (ret < 0) {
+		free_steps(*list);
+		*list = NULL;
+	}
+	return ret;
+}
+
+static int run_step(struct session *s, struct step *step)
+{
+	switch (commands[step->command].command) {
+	case STEP_ALT:
+		dfuse_forget_erased();
+		return s->select_alt(s->dif, step->arg);
+	case STEP_DOWNLOAD:
+		return session_download(s, step->arg, step->options);
+	case STEP_UPLOAD:
+		return session_upload(s, step->arg, step->options);
+	case STEP_VERIFY:
+		verify = !strcmp(step->arg, "on");
+		return 0;
+	case STEP_MASS_ERASE:
+		return dfuse_do_mass_erase(s->dif);
+	case STEP_LEAVE:
+		return dfuse_do_leave(s->dif);
+	case STEP_RESET:
+		return session_reset(s);
+	}
+	return -EINVAL;
+}
+
+/* Runs the commands of a script file, stopping at the first failure */
+int session_run_script(struct session *s, const char *name)
+{
+	struct step *list;
+	struct step *step;
+	int ret;
+
+	ret = read_script(s, name, &list);
+	if (ret < 0)
+		return ret;
+
+	for (step = list; step; step = step->next) {
+		printf("%s:%i: %s%s%s%s%s\n", name, step->line,
+		       commands[step->command].name,
+		       step->arg ? " " : "", step->arg ? step->arg : "",
+		       step->options ? " " : "",
+		       step->options ? step->options : "");
+		if (s->dif->flags & DFU_IFF_GONE) {
+			fprintf(stderr, "%s:%i: The device has left DFU mode\n",
+				name, step->line);
+			ret = -ENODEV;
+			break;
+		}
+		ret = session_idle(s);
+		if (ret >= 0)
+			ret = run_step(s, step);
+		if (ret < 0) {
+			fprintf(stderr, "%s:%i: %s failed\n", name,
+				step->line, commands[step->command].name);
+			break;
+		}
+	}
+	free_steps(list);
+	return ret < 0 ? ret : 0;
+}
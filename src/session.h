@@ -0,0 +1,39 @@
+/* Several operations on one claimed DFU interface
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "dfu.h"
+
+struct session {
+	struct dfu_if *dif;		/* claimed, in DFU mode */
+	int xfer_size;
+	int dfuse_device;
+	const char *compress;		/* compressor for uploads, or NULL */
+	/* switches dif to another alternate setting, by number or name */
+	int (*select_alt)(struct dfu_if *dif, const char *alt);
+};
+
+int session_upload(struct session *s, const char *name,
+		   const char *dfuse_options);
+int session_download(struct session *s, const char *name,
+		     const char *dfuse_options);
+int session_reset(struct session *s);
+int session_run_script(struct session *s, const char *name);
+
+#endif /* SESSION_H */
@@ -0,0 +1,337 @@
+/* Upload output to standard output, pipes and compressors
+ *
+ * Uploads to "-" go to standard output, and everything else printed
+ * there is moved over to standard error, so that the image can be piped
+ * on. Uploads to files named *.gz, *.xz, *.zst or *.bz2, or with
+ * --compress, go through the matching compressor, which runs as a process
+ * of its own. Uploads to files that can not seek, such as named pipes,
+ * are written out the same way, without compressor.
+ *
+ * The uploaded data is queued in a buffer of SINK_BUFFER_SIZE bytes and
+ * written out by a thread of its own, so that a slow reader or
+ * compressor on the other end does not hold up the USB transfers until
+ * the buffer is full. The writer also takes the CRC32 and SHA-256 of the
+ * uploaded data, before compression, which are printed at the end. Without
+ * threads the data is written out right away.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_WINDOWS_H
+# include <io.h>
+# include <fcntl.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "dfu_file.h"
+#include "sha256.h"
+#include "sink.h"
+
+extern int verbose;
+
+#ifndef HAVE_POPEN
+/* no pipes, so every compressor fails to start */
+# define popen(command, mode) (errno = ENOSYS, (FILE *) NULL)
+# define pclose(stream) (-1)
+#endif
+
+struct sink {
+	FILE *out;		/* the file, or the pipe to the compressor */
+	const char *command;	/* the compressor, or NULL */
+	uint32_t crc;
+	struct sha256 sha;
+	off_t bytes;		/* written out so far */
+	int error;		/* errno of the first failed write */
+#ifdef HAVE_PTHREAD_H
+	int threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* queue changed */
+	unsigned char *queue;	/* ring of SINK_BUFFER_SIZE bytes */
+	size_t head;		/* next byte to write out */
+	size_t queued;
+	int closing;
+#endif
+};
+
+/* Standard output, kept for the uploaded data */
+static FILE *data_out;
+
+/* Keeps standard output for the uploaded data, and sends everything else
+ * printed there to standard error from now on
+ * returns the stream for the data, NULL on errors */
+FILE *sink_claim_stdout(void)
+{
+	int fd;
+
+	if (data_out)
+		return data_out;
+	fflush(stdout);
+	fd = dup(fileno(stdout));
+	if (fd < 0 || dup2(fileno(stderr), fileno(stdout)) < 0) {
+		perror("Could not take over standard output");
+		return NULL;
+	}
+#ifdef HAVE_WINDOWS_H
+	_setmode(fd, _O_BINARY);
+#endif
+	data_out = fdopen(fd, "wb");
+	if (!data_out)
+		perror("Could not take over standard output");
+	return data_out;
+}
+
+static void sink_release(FILE *out)
+{
+	if (out == data_out)
+		data_out = NULL;
+	fclose(out);
+}
+
+/* Starts command with its output going to out
+ * returns the pipe to the command, NULL on errors */
+static FILE *sink_start(FILE *out, const char *command)
+{
+	FILE *pipe;
+	int saved;
+
+	if (verbose)
+		printf("Running %s\n", command);
+	fflush(stdout);
+	fflush(out);
+	/* the command writes to what is standard output when it starts */
+	saved = dup(fileno(stdout));
+	if (saved < 0 || dup2(fileno(out), fileno(stdout)) < 0) {
+		perror(command);
+		if (saved >= 0)
+			close(saved);
+		return NULL;
+	}
+	pipe = popen(command, POPEN_WRITE);
+	if (!pipe)
+		perror(command);
+	dup2(saved, fileno(stdout));
+	close(saved);
+	return pipe;
+}
+
+/* Takes the digests of the data and writes it out, unless an earlier
+ * write failed. s->error is left to the caller, which may hold the lock.
+ * returns 0 on success, the errno if the write failed */
+static int sink_out(struct sink *s, const unsigned char *buf, size_t len,
+		    int failed)
+{
+	s->crc = crc32_buf(s->crc, buf, len);
+	sha256_update(&s->sha, buf, len);
+	s->bytes += len;
+	if (!failed && fwrite(buf, 1, len, s->out) < len)
+		return errno ? errno : EIO;
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *sink_worker(void *arg)
+{
+	struct sink *s = arg;
+	size_t len;
+	int failed;
+	int error;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		while (!s->queued && !s->closing)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (!s->queued)
+			break;
+		len = s->queued;
+		if (len > SINK_BUFFER_SIZE - s->head)
+			len = SINK_BUFFER_SIZE - s->head;
+		/* the queue only grows behind what is written here */
+		failed = s->error;
+		pthread_mutex_unlock(&s->lock);
+		error = sink_out(s, s->queue + s->head, len, failed);
+		pthread_mutex_lock(&s->lock);
+		if (error && !s->error)
+			s->error = error;
+		s->head = (s->head + len) % SINK_BUFFER_SIZE;
+		s->queued -= len;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* Writes the upload to file->filep from now on, through command if that
+ * is not NULL. file->filep is closed by sink_close(), or right away on
+ * errors.
+ * returns 0 on success, negative on errors */
+int sink_open(struct dfu_file *file, const char *command)
+{
+	struct sink *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		fprintf(stderr, "Unable to allocate upload output\n");
+		sink_release(file->filep);
+		return -ENOMEM;
+	}
+	if (command) {
+		s->out = sink_start(file->filep, command);
+		sink_release(file->filep);
+		if (!s->out) {
+			free(s);
+			return -EIO;
+		}
+		s->command = command;
+	} else {
+		s->out = file->filep;
+	}
+	file->filep = NULL;
+	file->sink = s;
+	s->crc = 0xffffffff;
+	sha256_init(&s->sha);
+
+#ifdef HAVE_PTHREAD_H
+	s->queue = malloc(SINK_BUFFER_SIZE);
+	if (s->queue) {
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		if (!pthread_create(&s->thread, NULL, sink_worker, s)) {
+			s->threaded = 1;
+		} else {
+			pthread_mutex_destroy(&s->lock);
+			pthread_cond_destroy(&s->cond);
+		}
+	}
+	/* without the thread the data is written out right away */
+	if (!s->threaded) {
+		free(s->queue);
+		s->queue = NULL;
+	}
+#endif
+	return 0;
+}
+
+/* Queues len bytes of the upload for writing out
+ * returns 0 on success, negative if writing out failed */
+int sink_write(struct dfu_file *file, const unsigned char *buf, int len)
+{
+	struct sink *s = file->sink;
+	int error;
+
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock(&s->lock);
+		while (len && !s->error) {
+			size_t tail = (s->head + s->queued) % SINK_BUFFER_SIZE;
+			size_t n = SINK_BUFFER_SIZE - s->queued;
+
+			if (!n) {
+				pthread_cond_wait(&s->cond, &s->lock);
+				continue;
+			}
+			if (n > SINK_BUFFER_SIZE - tail)
+				n = SINK_BUFFER_SIZE - tail;
+			if (n > len)
+				n = len;
+			memcpy(s->queue + tail, buf, n);
+			s->queued += n;
+			buf += n;
+			len -= n;
+			pthread_cond_signal(&s->cond);
+		}
+		error = s->error;
+		pthread_mutex_unlock(&s->lock);
+	} else
+#endif
+	{
+		error = sink_out(s, buf, len, s->error);
+		if (error && !s->error)
+			s->error = error;
+		error = s->error;
+	}
+	if (error) {
+		fprintf(stderr, "Error writing %s: %s\n", file->name,
+			strerror(error));
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Writes out the rest of the upload, stops the compressor, and prints
+ * the digests of what was uploaded if the upload went ok
+ * returns 0 on success, negative on errors */
+int sink_close(struct dfu_file *file, int ok)
+{
+	struct sink *s = file->sink;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	int ret = 0;
+	int i;
+
+	if (!s)
+		return 0;
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock(&s->lock);
+		s->closing = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+		free(s->queue);
+	}
+#endif
+	if (!s->error && fflush(s->out))
+		s->error = errno;
+	if (s->error) {
+		fprintf(stderr, "Error writing %s: %s\n", file->name,
+			strerror(s->error));
+		ret = -EIO;
+	}
+	if (s->command) {
+		if (pclose(s->out)) {
+			fprintf(stderr, "Error: %s failed on %s\n",
+				s->command, file->name);
+			ret = -EIO;
+		}
+	} else {
+		sink_release(s->out);
+	}
+
+	if (ok && !ret) {
+		sha256_final(&s->sha, digest);
+		printf("Uploaded %lli bytes, CRC32 %08x, SHA-256 ",
+		       (long long) s->bytes, ~s->crc);
+		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+			printf("%02x", digest[i]);
+		printf("\n");
+	}
+	free(s);
+	file->sink = NULL;
+	return ret;
+}
@@ -0,0 +1,32 @@
+/* Upload output to standard output, pipes and compressors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdio.h>
+#include "dfu_file.h"
+
+/* Uploaded data waiting to be written out */
+#define SINK_BUFFER_SIZE (4 * 1024 * 1024)
+
+FILE *sink_claim_stdout(void);
+int sink_open(struct dfu_file *file, const char *command);
+int sink_write(struct dfu_file *file, const unsigned char *buf, int len);
+int sink_close(struct dfu_file *file, int ok);
+
+#endif /* SINK_H */
@@ -0,0 +1,424 @@
+/* Download images read from a decompressor or a pipe, of unknown length
+ *
+ * Images named *.gz, *.xz, *.zst or *.bz2 are run through the matching
+ * decompressor on the way to the device, so that they are never stored
+ * uncompressed. The decompressor runs as a process of its own and fills
+ * the pipe while the device is busy with the previous block. Standard
+ * input and other files that can not seek, such as named pipes, are
+ * read the same way.
+ *
+ * The length of the image is only known at the end of the stream, and
+ * so is whether it ends in a DFU suffix. The last bytes read are held
+ * back in a window until more data follows them. At the end of the
+ * stream the suffix signature is looked for at the end of the window,
+ * and checked against the CRC of everything passed on before it, which
+ * is kept up to date as the data goes out. Without a valid suffix the
+ * window is passed on as the last of the image.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_WINDOWS_H
+# include <io.h>
+# include <fcntl.h>
+#endif
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "stream.h"
+
+extern int verbose;
+
+#ifndef HAVE_POPEN
+/* no pipes, so every stream fails to start */
+# define popen(command, mode) (errno = ENOSYS, (FILE *) NULL)
+# define pclose(stream) (-1)
+#endif
+
+static const struct {
+	const char *extension;
+	const char *command;
+	const char *compress;	/* for uploads, see sink.c */
+} decompressors[] = {
+	{ ".gz", "gzip -dc", "gzip -c" },
+	{ ".xz", "xz -dc", "xz -c" },
+	{ ".zst", "zstd -dc", "zstd -qc" },
+	{ ".bz2", "bzip2 -dc", "bzip2 -c" },
+};
+
+#define NUM_DECOMPRESSORS (sizeof(decompressors) / sizeof(decompressors[0]))
+
+static int stream_find(const char *name)
+{
+	size_t len = strlen(name);
+	int i;
+
+	for (i = 0; i < NUM_DECOMPRESSORS; i++) {
+		size_t ext = strlen(decompressors[i].extension);
+
+		if (len > ext &&
+		    !strcmp(name + len - ext, decompressors[i].extension))
+			return i;
+	}
+	return -1;
+}
+
+/* returns the command decompressing the file name, or NULL if the name
+ * has no known compressed extension */
+const char *stream_decompressor(const char *name)
+{
+	int i = stream_find(name);
+
+	return i < 0 ? NULL : decompressors[i].command;
+}
+
+/* returns the command compressing into the file name, or NULL if the
+ * name has no known compressed extension */
+const char *stream_compressor(const char *name)
+{
+	int i = stream_find(name);
+
+	return i < 0 ? NULL : decompressors[i].compress;
+}
+
+/* returns the command compressing into format, an extension without
+ * the dot such as "zst", or NULL if it is not known */
+const char *stream_compressor_format(const char *format)
+{
+	int i;
+
+	for (i = 0; i < NUM_DECOMPRESSORS; i++)
+		if (!strcmp(format, decompressors[i].extension + 1))
+			return decompressors[i].compress;
+	return NULL;
+}
+
+/* Builds the shell command running command on the file name */
+static char *stream_command_line(const char *command, const char *name)
+{
+	char *line;
+	char *p;
+
+	line = malloc(strlen(command) + 4 * strlen(name) + 4);
+	if (!line)
+		return NULL;
+	p = line + sprintf(line, "%s ", command);
+#ifdef HAVE_WINDOWS_H
+	/* file names can not contain quotes on Windows */
+	p += sprintf(p, "\"%s\"", name);
+#else
+	*p++ = '\'';
+	for (; *name; name++) {
+		if (*name == '\'') {
+			memcpy(p, "'\\''", 4);
+			p += 4;
+		} else {
+			*p++ = *name;
+		}
+	}
+	*p++ = '\'';
+	*p = '\0';
+#endif
+	return line;
+}
+
+static struct stream *stream_new(struct dfu_file *file, FILE *pipe,
+				 const char *command)
+{
+	struct stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		fprintf(stderr, "Unable to allocate stream\n");
+		return NULL;
+	}
+	s->pipe = pipe;
+	s->command = command;
+	s->crc = 0xffffffff;
+	s->suffix.idVendor = 0xffff;	/* wildcard value */
+	s->suffix.idProduct = 0xffff;	/* wildcard value */
+	s->suffix.bcdDevice = 0xffff;	/* wildcard value */
+
+	file->stream = s;
+	file->filep = NULL;
+	file->size = -1;
+	file->dwCRC = 0;
+	file->suffixlen = 0;
+	file->bcdDFU = 0;
+	file->idVendor = 0xffff;
+	file->idProduct = 0xffff;
+	file->bcdDevice = 0xffff;
+	return s;
+}
+
+/* Starts command on the file, whose output is then read by
+ * stream_read() instead of file->filep
+ * returns 0 on success, negative on errors */
+int stream_open(struct dfu_file *file, const char *command)
+{
+	FILE *pipe;
+	char *line;
+
+	line = stream_command_line(command, file->name);
+	if (!line) {
+		fprintf(stderr, "Unable to allocate command line\n");
+		return -ENOMEM;
+	}
+	if (verbose)
+		printf("Running %s\n", line);
+	fflush(stdout);
+	pipe = popen(line, POPEN_READ);
+	free(line);
+	if (!pipe) {
+		perror(command);
+		return -EIO;
+	}
+	if (!stream_new(file, pipe, command)) {
+		pclose(pipe);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Reads the already open file->filep, which can not seek, through
+ * stream_read() from now on
+ * returns 0 on success, negative on errors */
+int stream_attach(struct dfu_file *file)
+{
+#ifdef HAVE_WINDOWS_H
+	if (file->filep == stdin)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	if (!stream_new(file, file->filep, NULL))
+		return -ENOMEM;
+	return 0;
+}
+
+/* Called at the end of the stream, takes the DFU suffix off the end of
+ * the window if there is a valid one
+ * returns 0 on success, negative if reading or the decompressor failed */
+static int stream_end(struct dfu_file *file)
+{
+	struct stream *s = file->stream;
+	struct dfu_file *suffix = &s->suffix;
+	unsigned char *dfusuffix;
+	uint32_t crc;
+	int status;
+
+	s->ended = 1;
+	if (ferror(s->pipe)) {
+		perror(file->name);
+		status = -1;
+	} else {
+		status = 0;
+	}
+	if (s->command) {
+		if (pclose(s->pipe)) {
+			fprintf(stderr, "Error: %s failed on %s\n",
+				s->command, file->name);
+			status = -1;
+		}
+		s->pipe = NULL;
+	}
+	if (status)
+		return -EIO;
+
+	/* this is the end of a download in progress, the caller reports
+	 * the suffix found afterwards */
+	if (s->window_len < DFU_SUFFIX_LENGTH)
+		return 0;
+	dfusuffix = s->window + s->window_len - DFU_SUFFIX_LENGTH;
+	if (dfusuffix[10] != 'D' || dfusuffix[9] != 'F' ||
+	    dfusuffix[8] != 'U')
+		return 0;
+	suffix->dwCRC = (dfusuffix[15] << 24) + (dfusuffix[14] << 16) +
+			(dfusuffix[13] << 8) + dfusuffix[12];
+	crc = crc32_buf(s->crc, s->window, s->window_len - 4);
+	if (suffix->dwCRC != crc) {
+		fprintf(stderr, "DFU CRC does not match\n");
+		return 0;
+	}
+	suffix->suffixlen = dfusuffix[11];
+	if (suffix->suffixlen < DFU_SUFFIX_LENGTH ||
+	    suffix->suffixlen > s->window_len) {
+		fprintf(stderr, "Unsupported DFU suffix length %i\n",
+			suffix->suffixlen);
+		suffix->suffixlen = 0;
+		return 0;
+	}
+	suffix->bcdDFU = (dfusuffix[7] << 8) + dfusuffix[6];
+	suffix->idVendor = (dfusuffix[5] << 8) + dfusuffix[4];
+	suffix->idProduct = (dfusuffix[3] << 8) + dfusuffix[2];
+	suffix->bcdDevice = (dfusuffix[1] << 8) + dfusuffix[0];
+	s->window_len -= suffix->suffixlen;
+	return 0;
+}
+
+/* Reads until the window holds want bytes or the stream ends
+ * returns 0 on success, negative on errors */
+static int stream_fill(struct dfu_file *file, int want)
+{
+	struct stream *s = file->stream;
+	int n;
+
+	if (s->window_size < want) {
+		unsigned char *window = realloc(s->window, want);
+
+		if (!window) {
+			fprintf(stderr, "Unable to allocate stream window\n");
+			return -ENOMEM;
+		}
+		s->window = window;
+		s->window_size = want;
+	}
+	while (!s->ended && s->window_len < want) {
+		n = fread(s->window + s->window_len, 1, want - s->window_len,
+			  s->pipe);
+		s->window_len += n;
+		if (s->window_len < want) {
+			n = stream_end(file);
+			if (n < 0)
+				return n;
+		}
+	}
+	return 0;
+}
+
+/* Copies up to len bytes from the start of what is left of the image,
+ * without taking them out of the stream
+ * returns the number of bytes copied, negative on errors */
+int stream_peek(struct dfu_file *file, unsigned char *buf, int len)
+{
+	struct stream *s = file->stream;
+	int ret;
+
+	ret = stream_fill(file, len + DFU_SUFFIX_LENGTH);
+	if (ret < 0)
+		return ret;
+	if (len > s->window_len)
+		len = s->window_len;
+	memcpy(buf, s->window, len);
+	return len;
+}
+
+/* Reads up to len bytes of the image, holding back what could be the
+ * DFU suffix until the end of the stream
+ * returns the number of bytes read, 0 at the end, negative on errors */
+int stream_read(struct dfu_file *file, unsigned char *buf, int len)
+{
+	struct stream *s = file->stream;
+	int n;
+
+	n = stream_fill(file, len + DFU_SUFFIX_LENGTH);
+	if (n < 0)
+		return n;
+	n = s->ended ? s->window_len : s->window_len - DFU_SUFFIX_LENGTH;
+	if (n > len)
+		n = len;
+	memcpy(buf, s->window, n);
+	memmove(s->window, s->window + n, s->window_len - n);
+	s->window_len -= n;
+	s->crc = crc32_buf(s->crc, buf, n);
+	s->bytes += n;
+	return n;
+}
+
+/* Reads the rest of the image into memory, to be freed
+ * returns the data, NULL on errors */
+unsigned char *stream_read_all(struct dfu_file *file, off_t *size)
+{
+	unsigned char *data = NULL;
+	size_t allocated = 0;
+	int ret;
+
+	*size = 0;
+	do {
+		if (*size + DFU_FILE_BUFSIZE > allocated) {
+			unsigned char *more;
+
+			allocated = allocated ? allocated * 2 :
+				    DFU_FILE_BUFSIZE;
+			more = realloc(data, allocated);
+			if (!more) {
+				fprintf(stderr, "Unable to allocate memory "
+					"for %s\n", file->name);
+				free(data);
+				return NULL;
+			}
+			data = more;
+		}
+		ret = stream_read(file, data + *size, DFU_FILE_BUFSIZE);
+		if (ret < 0) {
+			free(data);
+			return NULL;
+		}
+		*size += ret;
+	} while (ret);
+	return data;
+}
+
+/* Reads through the rest of the image without keeping it
+ * returns the length of the whole image, negative on errors */
+off_t stream_skip(struct dfu_file *file)
+{
+	unsigned char *buf;
+	int ret;
+
+	buf = malloc(DFU_FILE_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate file buffer\n");
+		return -ENOMEM;
+	}
+	while ((ret = stream_read(file, buf, DFU_FILE_BUFSIZE)) > 0)
+		;
+	free(buf);
+	return ret < 0 ? ret : file->stream->bytes;
+}
+
+/* returns the CRC register over the image data read so far, as
+ * crc32_buf() from 0xffffffff */
+uint32_t stream_crc(struct dfu_file *file)
+{
+	return file->stream->crc;
+}
+
+/* Stops the decompressor if it is still running, closes the file read
+ * unless it is standard input, and fills in the DFU suffix fields of
+ * file from the end of the stream */
+void stream_close(struct dfu_file *file)
+{
+	struct stream *s = file->stream;
+
+	if (!s)
+		return;
+	if (s->pipe && s->command)
+		pclose(s->pipe);
+	else if (s->pipe && s->pipe != stdin)
+		fclose(s->pipe);
+	file->size = s->bytes + s->suffix.suffixlen;
+	file->dwCRC = s->suffix.dwCRC;
+	file->suffixlen = s->suffix.suffixlen;
+	file->bcdDFU = s->suffix.bcdDFU;
+	file->idVendor = s->suffix.idVendor;
+	file->idProduct = s->suffix.idProduct;
+	file->bcdDevice = s->suffix.bcdDevice;
+	free(s->window);
+	free(s);
+	file->stream = NULL;
+}
@@ -0,0 +1,51 @@
+/* Download images read from a decompressor or a pipe, of unknown length
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "dfu_file.h"
+
+struct stream {
+	FILE *pipe;
+	const char *command;	/* the decompressor, NULL for plain pipes */
+	/* the last bytes read, which may turn out to be a DFU suffix */
+	unsigned char *window;
+	int window_len;
+	int window_size;
+	int ended;		/* the end of the stream was read */
+	uint32_t crc;		/* over the bytes passed on so far */
+	off_t bytes;		/* image data passed on so far */
+	struct dfu_file suffix;	/* the DFU suffix found at the end */
+};
+
+const char *stream_decompressor(const char *name);
+const char *stream_compressor(const char *name);
+const char *stream_compressor_format(const char *format);
+int stream_open(struct dfu_file *file, const char *command);
+int stream_attach(struct dfu_file *file);
+int stream_peek(struct dfu_file *file, unsigned char *buf, int len);
+int stream_read(struct dfu_file *file, unsigned char *buf, int len);
+unsigned char *stream_read_all(struct dfu_file *file, off_t *size);
+off_t stream_skip(struct dfu_file *file);
+uint32_t stream_crc(struct dfu_file *file);
+void stream_close(struct dfu_file *file);
+
+#endif /* STREAM_H */
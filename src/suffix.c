@@ -23,7 +23,9 @@
 #include <string.h>
 
 #include "dfu_file.h"
+#include "dfuse_file.h"
 #include "lmdfu.h"
+#include "suffix_batch.h"
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -35,7 +37,9 @@ enum mode {
 	MODE_NONE,
 	MODE_ADD,
 	MODE_DEL,
-	MODE_CHECK
+	MODE_CHECK,
+	MODE_BUILD,
+	MODE_BATCH
 };
 
 enum lmdfu_mode {
@@ -57,6 +61,20 @@ static void help(void)
 		"  -c --check\tCheck DFU suffix of <file>\n"
 		"  -a --add\tAdd DFU suffix to <file>\n"
 		);
+	printf("  -b --build <file>  Build DfuSe image <file> from the "
+		"elements given by -e,\n\t\tand add a DFU suffix\n"
+		"  -e --element <alt>:<address>:<input>  Add raw binary "
+		"<input> at <address>\n\t\tof alternate setting <alt>, to be "
+		"used with -b, can be repeated\n"
+		);
+	printf("  -B --batch <op>  Run check, add or delete on all files "
+		"given after the\n\t\toptions and by -m, reporting one line "
+		"of JSON per file\n"
+		"  -m --manifest <file>  Read file names for -B from <file>, "
+		"one per line,\n\t\t\"-\" for stdin\n"
+		"  -j --jobs <n>\tNumber of threads computing CRCs in "
+		"batch mode\n"
+		);
 	printf( "  -s --stellaris-address <address>  Add TI Stellaris address "
 		"prefix to <file>,\n\t\tto be used together with -a\n"
 		"  -T --stellaris  Act on TI Stellaris extension prefix of "
@@ -84,6 +102,12 @@ static struct option opts[] = {
 	{ "add", 1, 0, 'a' },
 	{ "stellaris-address", 1, 0, 's' },
 	{ "stellaris", 0, 0, 'T' },
+	{ "build", 1, 0, 'b' },
+	{ "element", 1, 0, 'e' },
+	{ "batch", 1, 0, 'B' },
+	{ "manifest", 1, 0, 'm' },
+	{ "jobs", 1, 0, 'j' },
+	{ 0, 0, 0, 0 }
 };
 
 static int check_suffix(struct dfu_file *file) {
@@ -113,8 +137,7 @@ static int remove_suffix(struct dfu_file *file)
 
 #ifdef HAVE_FTRUNCATE
 	/* There is no easy way to truncate to a size with stdio */
-	ret = ftruncate(fileno(file->filep),
-			(long) file->size - file->suffixlen);
+	ret = ftruncate(fileno(file->filep), file->size - file->suffixlen);
 	if (ret < 0) {
 		perror("ftruncate");
 		exit(1);
@@ -126,14 +149,44 @@ static int remove_suffix(struct dfu_file *file)
 	return 1;
 }
 
-static void add_suffix(struct dfu_file *file, int pid, int vid, int did) {
+static void build_dfuse(struct dfu_file *file, int pid, int vid, int did,
+			struct dfuse_input *inputs, int num_inputs)
+{
+	int ret;
+
+	if (!num_inputs) {
+		fprintf(stderr, "You need to specify at least one element "
+			"with -e\n");
+		exit(2);
+	}
+
+	file->idProduct = pid;
+	file->idVendor = vid;
+	file->bcdDevice = did;
+
+	ret = dfuse_build_file(file, inputs, num_inputs);
+	if (ret < 0) {
+		fclose(file->filep);
+		remove(file->name);
+		exit(1);
+	}
+	printf("DfuSe image with DFU suffix written, %lli bytes\n",
+	       (long long) file->size);
+}
+
+/* crc is the CRC over the file contents if already known, otherwise NULL */
+static void add_suffix(struct dfu_file *file, int pid, int vid, int did,
+		       uint32_t *crc) {
 	int ret;
 
 	file->idProduct = pid;
 	file->idVendor = vid;
 	file->bcdDevice = did;
 
-	ret = generate_dfu_suffix(file);
+	if (crc)
+		ret = append_dfu_suffix(file, *crc);
+	else
+		ret = generate_dfu_suffix(file);
 	if (ret < 0) {
 		perror("generate");
 		exit(1);
@@ -149,26 +202,39 @@ int main(int argc, char **argv)
 	enum lmdfu_mode lmdfu_mode = LMDFU_NONE;
 	unsigned int lmdfu_flash_address=0;
 	int lmdfu_prefix=0;
+	struct dfuse_input *dfuse_inputs;
+	int num_dfuse_inputs = 0;
+	char **batch_names = NULL;
+	int num_batch_names = 0;
+	enum batch_op batch_op = BATCH_CHECK;
+	int batch_jobs = 1;
 	char *end;
 
-	print_version();
-
 	pid = vid = did = 0xffff;
 	file.name = NULL;
 
+	/* there can not be more elements than arguments */
+	dfuse_inputs = calloc(argc, sizeof(*dfuse_inputs));
+	if (!dfuse_inputs) {
+		fprintf(stderr, "Unable to allocate element list\n");
+		exit(1);
+	}
+
 	while (1) {
 		int c, option_index = 0;
-		c = getopt_long(argc, argv, "hVD:p:v:d:c:a:s:T", opts,
+		c = getopt_long(argc, argv, "hVD:p:v:d:c:a:s:Tb:e:B:m:j:", opts,
 				&option_index);
 		if (c == -1)
 			break;
 
 		switch (c) {
 		case 'h':
+			print_version();
 			help();
 			exit(0);
 			break;
 		case 'V':
+			print_version();
 			exit(0);
 			break;
 		case 'D':
@@ -204,12 +270,77 @@ int main(int argc, char **argv)
 		case 'T':
 			lmdfu_mode = LMDFU_CHECK; /* or LMDFU_DEL */
 			break;
+		case 'b':
+			file.name = optarg;
+			mode = MODE_BUILD;
+			break;
+		case 'e':
+			if (dfuse_parse_input(optarg,
+					      &dfuse_inputs[num_dfuse_inputs])) {
+				fprintf(stderr, "Error: Invalid element "
+					"\"%s\", expected alt:address:file\n",
+					optarg);
+				exit(2);
+			}
+			num_dfuse_inputs++;
+			break;
+		case 'B':
+			if (batch_parse_op(optarg, &batch_op)) {
+				fprintf(stderr, "Error: Invalid batch operation "
+					"\"%s\", expected check, add or "
+					"delete\n", optarg);
+				exit(2);
+			}
+			mode = MODE_BATCH;
+			break;
+		case 'm':
+			if (batch_read_manifest(optarg, &batch_names,
+						&num_batch_names))
+				exit(1);
+			break;
+		case 'j':
+			batch_jobs = strtol(optarg, &end, 0);
+			if (*end || batch_jobs < 1) {
+				fprintf(stderr, "Error: Invalid number of "
+					"jobs: %s\n", optarg);
+				exit(2);
+			}
+			break;
 		default:
+			print_version();
 			help();
 			exit(2);
 		}
 	}
 
+	/* stdout is reserved for the JSON report in batch mode */
+	if (mode == MODE_BATCH) {
+		int failed;
+
+		while (optind < argc) {
+			char **new_names;
+
+			new_names = realloc(batch_names, (num_batch_names + 1) *
+					    sizeof(char *));
+			if (!new_names) {
+				fprintf(stderr, "Unable to allocate file list\n");
+				exit(1);
+			}
+			batch_names = new_names;
+			batch_names[num_batch_names++] = argv[optind++];
+		}
+		if (!num_batch_names) {
+			fprintf(stderr, "You need to specify files for batch "
+				"mode\n");
+			exit(2);
+		}
+		failed = batch_run(batch_op, batch_names, num_batch_names,
+				   batch_jobs, vid, pid, did);
+		exit(failed ? 1 : 0);
+	}
+
+	print_version();
+
 	if(mode == MODE_DEL && lmdfu_mode == LMDFU_CHECK)
 		lmdfu_mode = LMDFU_DEL;
 
@@ -219,7 +350,13 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
-	if (mode != MODE_NONE) {
+	if (mode == MODE_BUILD) {
+		file.filep = fopen(file.name, "wb");
+		if (file.filep == NULL) {
+			perror(file.name);
+			exit(1);
+		}
+	} else if (mode != MODE_NONE) {
 		file.filep = fopen(file.name, "r+b");
 		if (file.filep == NULL) {
 			perror(file.name);
@@ -235,12 +372,22 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 		if(lmdfu_mode == LMDFU_ADD) {
+			/* the CRC is computed while the prefix is added */
+			uint32_t crc = 0xffffffff;
+
 			if(lmdfu_check_prefix(&file)) {
 				fprintf(stderr, "Adding new anyway\n");
 			}
-			lmdfu_add_prefix(file, lmdfu_flash_address);
+			if (lmdfu_add_prefix(&file, lmdfu_flash_address, &crc) < 0)
+				exit(1);
+			add_suffix(&file, pid, vid, did, &crc);
+			break;
 		}
-		add_suffix(&file, pid, vid, did);
+		add_suffix(&file, pid, vid, did, NULL);
+		break;
+	case MODE_BUILD:
+		build_dfuse(&file, pid, vid, did, dfuse_inputs,
+			    num_dfuse_inputs);
 		break;
 	case MODE_CHECK:
 		/* FIXME: could open read-only here */
@@ -272,5 +419,6 @@ int main(int argc, char **argv)
 	}
 
 	fclose(file.filep);
+	free(dfuse_inputs);
 	exit(0);
 }
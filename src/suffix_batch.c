@@ -0,0 +1,470 @@
+/*
+ * Batch mode for dfu-suffix: checks, adds or removes DFU suffixes of
+ * many files, using a pool of worker threads for the CRC calculation.
+ * Each file is split into slices whose CRCs are merged afterwards, so
+ * large files are spread over all workers as well.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#ifdef HAVE_FTRUNCATE
+# include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "dfu_file.h"
+#include "suffix_batch.h"
+
+/* Files are split into slices of this size for the CRC calculation */
+#define BATCH_SLICE_SIZE (4 * 1024 * 1024)
+
+struct batch_file {
+	const char *name;
+	off_t size;
+	off_t crc_len;		/* bytes covered by the CRC */
+	int has_suffix;
+	unsigned char dfusuffix[DFU_SUFFIX_LENGTH];
+	int queued;		/* prepared, waiting for its CRC */
+	int slices;
+	int slices_left;
+	uint32_t *slice_crc;
+	const char *error;
+};
+
+struct batch_task {
+	struct batch_file *file;
+	int slice;
+};
+
+struct batch {
+	enum batch_op op;
+	uint16_t vid, pid, did;
+	struct batch_task *tasks;
+	int num_tasks;
+	int next_task;
+	int failed;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+};
+
+static const char *batch_op_names[] = { "check", "add", "delete" };
+
+static void batch_lock(struct batch *b)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&b->lock);
+#endif
+}
+
+static void batch_unlock(struct batch *b)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+int batch_parse_op(const char *str, enum batch_op *op)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!strcmp(str, batch_op_names[i])) {
+			*op = i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/* Reads file names, one per line, from manifest ("-" for stdin) and
+ * appends them to the names array.
+ * returns 0 on success, negative on errors */
+int batch_read_manifest(const char *manifest, char ***names, int *count)
+{
+	char line[4096];
+	FILE *filep;
+	int capacity = *count;
+
+	if (!strcmp(manifest, "-"))
+		filep = stdin;
+	else
+		filep = fopen(manifest, "r");
+	if (!filep) {
+		perror(manifest);
+		return -EIO;
+	}
+	while (fgets(line, sizeof(line), filep)) {
+		size_t len = strcspn(line, "\r\n");
+
+		line[len] = 0;
+		if (!len)
+			continue;
+		if (*count >= capacity) {
+			char **new_names;
+
+			capacity = capacity ? capacity * 2 : 256;
+			new_names = realloc(*names, capacity * sizeof(char *));
+			if (!new_names) {
+				fprintf(stderr, "Unable to allocate file list\n");
+				return -ENOMEM;
+			}
+			*names = new_names;
+		}
+		(*names)[*count] = strdup(line);
+		if (!(*names)[*count])
+			return -ENOMEM;
+		(*count)++;
+	}
+	if (filep != stdin)
+		fclose(filep);
+	return 0;
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			printf("\\u%04x", (unsigned char) *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+/* Prints one line of JSON for the file, must be called with the lock held
+ * when running threaded */
+static void batch_report(struct batch *b, struct batch_file *f,
+			 const char *status, uint32_t crc)
+{
+	printf("{\"file\":");
+	print_json_string(f->name);
+	printf(",\"op\":\"%s\",\"status\":\"%s\"", batch_op_names[b->op],
+	       status);
+	if (f->error) {
+		printf(",\"error\":");
+		print_json_string(f->error);
+	} else {
+		printf(",\"size\":%lli", (long long) f->size);
+	}
+	if (f->has_suffix || b->op == BATCH_ADD) {
+		const unsigned char *s = f->dfusuffix;
+
+		printf(",\"vid\":\"0x%04x\",\"pid\":\"0x%04x\","
+		       "\"did\":\"0x%04x\",\"dfu\":\"0x%04x\"",
+		       s[4] | s[5] << 8, s[2] | s[3] << 8,
+		       s[0] | s[1] << 8, s[6] | s[7] << 8);
+		if (!f->error)
+			printf(",\"crc\":\"0x%08x\"", crc);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* Looks at the file size and suffix signature, and queues the slices
+ * that need their CRC computed.
+ * returns the number of slices, or negative if the file is done */
+static int batch_prepare(struct batch *b, struct batch_file *f)
+{
+	FILE *filep;
+
+	filep = fopen(f->name, b->op == BATCH_CHECK ? "rb" : "r+b");
+	if (!filep) {
+		f->error = strerror(errno);
+		return -EIO;
+	}
+	fseeko(filep, 0, SEEK_END);
+	f->size = ftello(filep);
+	if (f->size >= DFU_SUFFIX_LENGTH &&
+	    !fseeko(filep, -DFU_SUFFIX_LENGTH, SEEK_END) &&
+	    fread(f->dfusuffix, 1, DFU_SUFFIX_LENGTH, filep) ==
+	    DFU_SUFFIX_LENGTH &&
+	    f->dfusuffix[10] == 'D' && f->dfusuffix[9] == 'F' &&
+	    f->dfusuffix[8] == 'U' && f->dfusuffix[11] >= DFU_SUFFIX_LENGTH)
+		f->has_suffix = 1;
+	fclose(filep);
+
+	if (b->op == BATCH_ADD) {
+		struct dfu_file file;
+
+		if (f->has_suffix)
+			return -EEXIST;
+		file.idVendor = b->vid;
+		file.idProduct = b->pid;
+		file.bcdDevice = b->did;
+		file.bcdDFU = 0x0100;
+		file.suffixlen = DFU_SUFFIX_LENGTH;
+		fill_dfu_suffix(&file, f->dfusuffix);
+		f->crc_len = f->size;
+	} else {
+		if (!f->has_suffix)
+			return -ENOENT;
+		f->crc_len = f->size - 4;
+	}
+
+	f->queued = 1;
+	f->slices = (f->crc_len + BATCH_SLICE_SIZE - 1) / BATCH_SLICE_SIZE;
+	f->slices_left = f->slices;
+	if (f->slices) {
+		f->slice_crc = calloc(f->slices, sizeof(uint32_t));
+		if (!f->slice_crc) {
+			f->error = strerror(ENOMEM);
+			return -ENOMEM;
+		}
+	}
+	return f->slices;
+}
+
+/* Merges the slice CRCs and carries out the operation on the file */
+static void batch_finish(struct batch *b, struct batch_file *f)
+{
+	uint32_t crc = 0xffffffff;
+	uint32_t stored;
+	const char *status = "ok";
+	FILE *filep;
+	int i;
+
+	for (i = 0; i < f->slices; i++) {
+		off_t len = BATCH_SLICE_SIZE;
+
+		if (i == f->slices - 1)
+			len = f->crc_len - (off_t) i * BATCH_SLICE_SIZE;
+		crc = crc32_combine(crc, f->slice_crc[i], len);
+	}
+	stored = f->dfusuffix[12] | f->dfusuffix[13] << 8 |
+		 f->dfusuffix[14] << 16 | (uint32_t) f->dfusuffix[15] << 24;
+
+	if (f->error) {
+		status = "error";
+	} else if (b->op == BATCH_ADD) {
+		crc = crc32_buf(crc, f->dfusuffix, DFU_SUFFIX_LENGTH - 4);
+		f->dfusuffix[12] = crc;
+		f->dfusuffix[13] = crc >> 8;
+		f->dfusuffix[14] = crc >> 16;
+		f->dfusuffix[15] = crc >> 24;
+		filep = fopen(f->name, "ab");
+		if (!filep || fwrite(f->dfusuffix, 1, DFU_SUFFIX_LENGTH,
+				     filep) < DFU_SUFFIX_LENGTH) {
+			f->error = "Could not write DFU suffix";
+			status = "error";
+		} else {
+			status = "added";
+		}
+		if (filep && fclose(filep)) {
+			f->error = "Could not write DFU suffix";
+			status = "error";
+		}
+	} else if (crc != stored) {
+		status = "bad-crc";
+	} else if (b->op == BATCH_DELETE) {
+#ifdef HAVE_FTRUNCATE
+		if (truncate(f->name, f->size - f->dfusuffix[11]) < 0) {
+			f->error = strerror(errno);
+			status = "error";
+		} else {
+			status = "removed";
+		}
+#else
+		f->error = "Suffix removal not implemented on this platform";
+		status = "error";
+#endif /* HAVE_FTRUNCATE */
+	}
+
+	batch_lock(b);
+	if (strcmp(status, "ok") && strcmp(status, "added") &&
+	    strcmp(status, "removed"))
+		b->failed++;
+	batch_report(b, f, status, crc);
+	batch_unlock(b);
+
+	free(f->slice_crc);
+	f->slice_crc = NULL;
+}
+
+/* Computes the CRC of one slice, starting from a zero register */
+static void batch_crc_slice(struct batch_file *f, int slice,
+			    unsigned char *buf)
+{
+	off_t offset = (off_t) slice * BATCH_SLICE_SIZE;
+	off_t len = f->crc_len - offset;
+	uint32_t crc = 0;
+	FILE *filep;
+
+	if (len > BATCH_SLICE_SIZE)
+		len = BATCH_SLICE_SIZE;
+
+	filep = fopen(f->name, "rb");
+	if (!filep || fseeko(filep, offset, SEEK_SET)) {
+		f->error = "Could not read file";
+		goto out;
+	}
+	while (len > 0) {
+		size_t chunk = len < DFU_FILE_BUFSIZE ? len : DFU_FILE_BUFSIZE;
+
+		if (fread(buf, 1, chunk, filep) < chunk) {
+			f->error = "Could not read whole file";
+			break;
+		}
+		crc = crc32_buf(crc, buf, chunk);
+		len -= chunk;
+	}
+ out:
+	if (filep)
+		fclose(filep);
+	f->slice_crc[slice] = crc;
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	unsigned char *buf;
+
+	buf = malloc(DFU_FILE_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate file buffer\n");
+		exit(1);
+	}
+	while (1) {
+		struct batch_task *task;
+		int left;
+
+		batch_lock(b);
+		if (b->next_task >= b->num_tasks) {
+			batch_unlock(b);
+			break;
+		}
+		task = &b->tasks[b->next_task++];
+		batch_unlock(b);
+
+		batch_crc_slice(task->file, task->slice, buf);
+
+		batch_lock(b);
+		left = --task->file->slices_left;
+		batch_unlock(b);
+		/* whoever computes the last slice finishes the file */
+		if (!left)
+			batch_finish(b, task->file);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Runs op on all named files, printing one line of JSON per file.
+ * returns the number of files that failed */
+int batch_run(enum batch_op op, char **names, int count, int jobs,
+	      uint16_t vid, uint16_t pid, uint16_t did)
+{
+	struct batch b;
+	struct batch_file *files;
+	int i, j;
+
+	memset(&b, 0, sizeof(b));
+	b.op = op;
+	b.vid = vid;
+	b.pid = pid;
+	b.did = did;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&b.lock, NULL);
+#endif
+
+	files = calloc(count, sizeof(*files));
+	if (!files) {
+		fprintf(stderr, "Unable to allocate file list\n");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		int ret;
+
+		files[i].name = names[i];
+		ret = batch_prepare(&b, &files[i]);
+		if (ret == -EEXIST || ret == -ENOENT) {
+			const unsigned char *s = files[i].dfusuffix;
+
+			b.failed++;
+			batch_report(&b, &files[i], ret == -EEXIST ?
+				     "has-suffix" : "no-suffix",
+				     s[12] | s[13] << 8 | s[14] << 16 |
+				     (uint32_t) s[15] << 24);
+		} else if (ret < 0) {
+			b.failed++;
+			batch_report(&b, &files[i], "error", 0);
+		} else {
+			b.num_tasks += ret;
+		}
+	}
+
+	b.tasks = malloc((b.num_tasks + 1) * sizeof(*b.tasks));
+	if (!b.tasks) {
+		fprintf(stderr, "Unable to allocate task list\n");
+		exit(1);
+	}
+	b.num_tasks = 0;
+	for (i = 0; i < count; i++) {
+		/* empty files have no slices, finish them right away */
+		if (files[i].queued && !files[i].slices)
+			batch_finish(&b, &files[i]);
+		for (j = 0; j < files[i].slices; j++) {
+			b.tasks[b.num_tasks].file = &files[i];
+			b.tasks[b.num_tasks].slice = j;
+			b.num_tasks++;
+		}
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (jobs > 1) {
+		pthread_t *threads;
+		int started = 0;
+
+		threads = malloc(jobs * sizeof(*threads));
+		if (!threads) {
+			fprintf(stderr, "Unable to allocate thread list\n");
+			exit(1);
+		}
+		/* the main thread is one of the jobs */
+		for (i = 0; i < jobs - 1; i++) {
+			if (pthread_create(&threads[i], NULL, batch_worker, &b))
+				break;
+			started++;
+		}
+		/* the main thread also works, so no thread is fine */
+		batch_worker(&b);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	} else
+#endif /* HAVE_PTHREAD_H */
+	{
+		batch_worker(&b);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&b.lock);
+#endif
+	free(b.tasks);
+	free(files);
+	return b.failed;
+}
@@ -0,0 +1,34 @@
+/* Batch mode for dfu-suffix
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SUFFIX_BATCH_H
+#define SUFFIX_BATCH_H
+
+#include <stdint.h>
+
+enum batch_op {
+	BATCH_CHECK,
+	BATCH_ADD,
+	BATCH_DELETE
+};
+
+int batch_parse_op(const char *str, enum batch_op *op);
+int batch_read_manifest(const char *manifest, char ***names, int *count);
+int batch_run(enum batch_op op, char **names, int count, int jobs,
+	      uint16_t vid, uint16_t pid, uint16_t did);
+
+#endif /* SUFFIX_BATCH_H */
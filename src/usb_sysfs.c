@@ -0,0 +1,232 @@
+/* Finding DFU candidates in the Linux sysfs before asking libusb
+ *
+ * Looking for DFU devices through libusb means fetching the device and
+ * configuration descriptors of every USB device on the system, before
+ * the vendor and product given with -d can rule any of them out. On
+ * hosts with many hubs, cameras and HID devices this dominates startup.
+ *
+ * On Linux the same information is in /sys/bus/usb/devices, which can be
+ * read much faster: every device directory holds idVendor, idProduct,
+ * busnum and devnum, and a directory for each interface of the active
+ * configuration with its bInterfaceClass and bInterfaceSubClass. Only
+ * devices with a DFU interface (class 0xfe, subclass 1) are then looked
+ * at through libusb. Devices that are not configured, or have more than
+ * one configuration, are always handed to libusb, as their DFU interface
+ * may not be visible in sysfs.
+ *
+ * Where there is no sysfs, every device is scanned through libusb as
+ * before. So are devices that libusb finds but sysfs does not list, for
+ * instance in containers where sysfs does not match the devices that can
+ * be opened. When sysfs lists no candidate at all, no device is scanned.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+# include <dirent.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_sysfs.h"
+
+extern int verbose;
+
+#ifndef USB_SYSFS_DEVICES
+# define USB_SYSFS_DEVICES "/sys/bus/usb/devices"
+#endif
+
+#ifdef __linux__
+
+/* Reads the attribute of a device or interface directory
+ * returns 0 on success, negative if it can not be read or is empty */
+static int sysfs_read(const char *dir, const char *attr, char *buf, int len)
+{
+	char path[512];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), USB_SYSFS_DEVICES "/%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	if (!fgets(buf, len, f))
+		ret = -EINVAL;
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	if (!ret && !*buf)
+		ret = -EINVAL;
+	return ret;
+}
+
+/* returns the attribute read as a number in base, negative on errors */
+static long sysfs_number(const char *dir, const char *attr, int base)
+{
+	char buf[32];
+	char *end;
+	long value;
+
+	if (sysfs_read(dir, attr, buf, sizeof(buf)) < 0)
+		return -1;
+	value = strtol(buf, &end, base);
+	if (*end || end == buf)
+		return -1;
+	return value;
+}
+
+/* returns 1 if the device named may have a DFU interface, 0 if not */
+static int sysfs_has_dfu(const char *name)
+{
+	char path[512];
+	char dir[512];
+	struct dirent *entry;
+	DIR *d;
+	int found = 0;
+
+	/* the interfaces of other configurations are not listed */
+	if (sysfs_number(name, "bNumConfigurations", 10) != 1 ||
+	    sysfs_number(name, "bConfigurationValue", 10) < 0)
+		return 1;
+
+	snprintf(path, sizeof(path), USB_SYSFS_DEVICES "/%s", name);
+	d = opendir(path);
+	if (!d)
+		return 1;
+	while (!found && (entry = readdir(d))) {
+		/* interfaces are named bus-port.port:config.interface */
+		if (!strchr(entry->d_name, ':'))
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", name, entry->d_name);
+		if (sysfs_number(dir, "bInterfaceClass", 16) == 0xfe &&
+		    sysfs_number(dir, "bInterfaceSubClass", 16) == 1)
+			found = 1;
+	}
+	closedir(d);
+	return found;
+}
+
+/* Lists the devices in sysfs, marking those that may have a DFU interface
+ * and pass the vendor, product and device number filters of dif, if not
+ * NULL, as candidates. If sysfs can not be read the list is left unusable,
+ * which lets every device through.
+ * returns the number of candidates, negative if sysfs can not be read */
+int usb_sysfs_scan(struct usb_sysfs_candidates *c, const struct dfu_if *dif)
+{
+	struct dirent *entry;
+	DIR *d;
+	int size = 0;
+	int found = 0;
+
+	c->devs = NULL;
+	c->count = 0;
+	c->usable = 0;
+	d = opendir(USB_SYSFS_DEVICES);
+	if (!d)
+		return -errno;
+	while ((entry = readdir(d))) {
+		const char *name = entry->d_name;
+		long bus, devnum;
+		int candidate = 1;
+
+		/* devices, not interfaces or . and .. */
+		if (name[0] == '.' || strchr(name, ':'))
+			continue;
+		bus = sysfs_number(name, "busnum", 10);
+		devnum = sysfs_number(name, "devnum", 10);
+		if (bus < 0 || devnum < 0) {
+			/* can not be matched with the libusb device */
+			usb_sysfs_free(c);
+			closedir(d);
+			return -EINVAL;
+		}
+		if (dif && (dif->flags & DFU_IFF_DEVNUM) &&
+		    (bus != dif->bus || devnum != dif->devnum))
+			candidate = 0;
+		else if (dif && (dif->flags & DFU_IFF_VENDOR) &&
+			 sysfs_number(name, "idVendor", 16) != dif->vendor)
+			candidate = 0;
+		else if (dif && (dif->flags & DFU_IFF_PRODUCT) &&
+			 sysfs_number(name, "idProduct", 16) != dif->product)
+			candidate = 0;
+		else if (!sysfs_has_dfu(name))
+			candidate = 0;
+
+		if (c->count == size) {
+			struct usb_sysfs_device *devs;
+
+			size = size ? size * 2 : 16;
+			devs = realloc(c->devs, size * sizeof(*devs));
+			if (!devs) {
+				usb_sysfs_free(c);
+				closedir(d);
+				return -ENOMEM;
+			}
+			c->devs = devs;
+		}
+		c->devs[c->count].bus = bus;
+		c->devs[c->count].devnum = devnum;
+		c->devs[c->count].candidate = candidate;
+		c->count++;
+		found += candidate;
+	}
+	closedir(d);
+	c->usable = 1;
+	if (verbose > 1)
+		printf("Found %i DFU candidates among %i devices in sysfs\n",
+		       found, c->count);
+	return found;
+}
+
+#else /* __linux__ */
+
+int usb_sysfs_scan(struct usb_sysfs_candidates *c, const struct dfu_if *dif)
+{
+	c->devs = NULL;
+	c->count = 0;
+	c->usable = 0;
+	return -ENOSYS;
+}
+
+#endif /* __linux__ */
+
+/* returns 1 if dev is a candidate, is not listed in sysfs, or sysfs can
+ * not be used, 0 if sysfs rules it out */
+int usb_sysfs_candidate(const struct usb_sysfs_candidates *c,
+			libusb_device *dev)
+{
+	int bus, devnum;
+	int i;
+
+	if (!c->usable)
+		return 1;
+	bus = libusb_get_bus_number(dev);
+	devnum = libusb_get_device_address(dev);
+	for (i = 0; i < c->count; i++)
+		if (c->devs[i].bus == bus && c->devs[i].devnum == devnum)
+			return c->devs[i].candidate;
+	return 1;
+}
+
+void usb_sysfs_free(struct usb_sysfs_candidates *c)
+{
+	free(c->devs);
+	c->devs = NULL;
+	c->count = 0;
+	c->usable = 0;
+}
@@ -0,0 +1,42 @@
+/* Finding DFU candidates in the Linux sysfs before asking libusb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef USB_SYSFS_H
+#define USB_SYSFS_H
+
+#include <libusb.h>
+#include "dfu.h"
+
+struct usb_sysfs_device {
+	int bus;
+	int devnum;
+	int candidate;		/* may have a DFU interface, passes filters */
+};
+
+/* Devices listed in sysfs, by bus and device number */
+struct usb_sysfs_candidates {
+	struct usb_sysfs_device *devs;
+	int count;
+	int usable;		/* sysfs was read, devs can rule out devices */
+};
+
+int usb_sysfs_scan(struct usb_sysfs_candidates *c, const struct dfu_if *dif);
+int usb_sysfs_candidate(const struct usb_sysfs_candidates *c,
+			libusb_device *dev);
+void usb_sysfs_free(struct usb_sysfs_candidates *c);
+
+#endif /* USB_SYSFS_H */
@@ -0,0 +1,107 @@
+/* Reusable transfer buffers.
+ *
+ * Every upload, download and verification used to allocate and free its
+ * own buffers, per transfer, element or file. They now take them from
+ * this pool, which keeps released buffers for the next user, so that the
+ * chunks of all elements in a session run through the same memory.
+ *
+ * Each payload starts XFER_ALIGN aligned with at least XFER_HEADROOM
+ * free bytes in front of it, where libusb_fill_control_setup() can put
+ * the setup packet, so the payload can be handed to an asynchronous
+ * control transfer in place instead of being copied behind one.
+ *
+ *   | header | ... | setup packet | payload ...      |
+ *   ^ block                      ^ block + XFER_ALIGN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "xfer_pool.h"
+
+/* Sizes are rounded up to this, so that similar requests share buffers */
+#define XFER_GRANULE 4096
+
+struct xfer_block {
+	void *mem;			/* as returned by malloc() */
+	size_t size;			/* payload capacity */
+	struct xfer_block *next;	/* in the free list */
+};
+
+static struct xfer_block *free_list;
+
+static struct xfer_block *block_of(unsigned char *buf)
+{
+	return (struct xfer_block *) (buf - XFER_ALIGN);
+}
+
+/* Returns a buffer for at least size bytes of payload, reusing the
+ * smallest released one that is large enough, NULL if out of memory */
+unsigned char *xfer_buf_alloc(size_t size)
+{
+	struct xfer_block **best = NULL;
+	struct xfer_block **link;
+	struct xfer_block *block;
+	void *mem;
+
+	for (link = &free_list; *link; link = &(*link)->next)
+		if ((*link)->size >= size &&
+		    (!best || (*link)->size < (*best)->size))
+			best = link;
+	if (best) {
+		block = *best;
+		*best = block->next;
+		return (unsigned char *) block + XFER_ALIGN;
+	}
+
+	size = (size + XFER_GRANULE - 1) / XFER_GRANULE * XFER_GRANULE;
+	if (!size)
+		size = XFER_GRANULE;
+	mem = malloc(size + 2 * XFER_ALIGN);
+	if (!mem)
+		return NULL;
+	block = (struct xfer_block *) (((uintptr_t) mem + XFER_ALIGN - 1) &
+				       ~(uintptr_t) (XFER_ALIGN - 1));
+	block->mem = mem;
+	block->size = size;
+	block->next = NULL;
+	return (unsigned char *) block + XFER_ALIGN;
+}
+
+/* Gives a buffer back to the pool, NULL is ignored */
+void xfer_buf_free(unsigned char *buf)
+{
+	struct xfer_block *block;
+
+	if (!buf)
+		return;
+	block = block_of(buf);
+	block->next = free_list;
+	free_list = block;
+}
+
+/* Frees all released buffers */
+void xfer_pool_release(void)
+{
+	while (free_list) {
+		struct xfer_block *block = free_list;
+
+		free_list = block->next;
+		free(block->mem);
+	}
+}
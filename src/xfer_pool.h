@@ -0,0 +1,38 @@
+/* Reusable transfer buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef XFER_POOL_H
+#define XFER_POOL_H
+
+#include <stddef.h>
+#include <libusb.h>
+
+/* Payloads start at this alignment */
+#define XFER_ALIGN 64
+
+/* Free space in front of every payload, enough for the setup packet of
+ * an asynchronous control transfer */
+#define XFER_HEADROOM LIBUSB_CONTROL_SETUP_SIZE
+
+/* The setup packet position for a payload from xfer_buf_alloc() */
+#define XFER_SETUP(buf) ((buf) - XFER_HEADROOM)
+
+unsigned char *xfer_buf_alloc(size_t size);
+void xfer_buf_free(unsigned char *buf);
+void xfer_pool_release(void);
+
+#endif /* XFER_POOL_H */